@@ -34,24 +34,30 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(
     /**
     * DONE: implement per description
     */
-    size_t acc_length = 0;
-    size_t offset = buffer->out_offs;
-    size_t current_pos;
-
-    for (uint8_t i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; ++i) {
-        // Compute current pos in buffer with output offset
-        current_pos = (offset + i) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-
-        // If offset falls in current pos, return.
-        if (acc_length + buffer->entry[current_pos].size > char_offset) {
-            *entry_offset_byte_rtn = char_offset - acc_length; 
-            return &buffer->entry[current_pos];
+    size_t base = buffer->entries[buffer->out_offs].offset;
+    size_t low = 0, high = aesd_circular_buffer_count(buffer);
+    size_t mid, current_pos;
+
+    if (char_offset >= buffer->total_size) {
+        return NULL;
+    }
+
+    // Entry offsets increase from out_offs on, binary search the last entry
+    // starting at or before char_offset. Offsets are relative to the oldest
+    // entry, so wrap around of head does not matter.
+    while (high - low > 1) {
+        mid = low + (high - low) / 2;
+        current_pos = aesd_circular_buffer_pos(buffer, mid);
+        if (buffer->entries[current_pos].offset - base <= char_offset) {
+            low = mid;
+        } else {
+            high = mid;
         }
-           
-        acc_length += buffer->entry[current_pos].size;
     }
 
-    return NULL;
+    current_pos = aesd_circular_buffer_pos(buffer, low);
+    *entry_offset_byte_rtn = char_offset - (buffer->entries[current_pos].offset - base);
+    return &buffer->entries[current_pos];
 }
 
 /**
@@ -70,52 +76,226 @@ const char *aesd_circular_buffer_add_entry(
     */
     //Store old entry text pointer if present.
     const char *removed_buffptr = NULL;
-    if (buffer->entry[buffer->in_offs].buffptr) {
-        removed_buffptr = buffer->entry[buffer->in_offs].buffptr;
+    if (buffer->full) {
+        removed_buffptr = buffer->entries[buffer->in_offs].buffptr;
+        buffer->total_size -= buffer->entries[buffer->in_offs].size;
     }
 
     // Write new entry.
-    buffer->entry[buffer->in_offs] = *add_entry;
+    buffer->entries[buffer->in_offs] = *add_entry;
+    buffer->entries[buffer->in_offs].offset = buffer->head;
+    buffer->head += add_entry->size;
+    buffer->total_size += add_entry->size;
+    buffer->next_seq += 1;
     buffer->in_offs += 1;
 
     // Loop index if required.
-    if (buffer->in_offs == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
+    if (buffer->in_offs == buffer->capacity) {
         buffer->in_offs = 0;
-        buffer->full = true; // After first loop this is noop.
     }
 
     // When looping, move output offset to new start location.
     if (buffer->full) {
         buffer->out_offs = buffer->in_offs;
+    } else if (buffer->in_offs == buffer->out_offs) {
+        buffer->full = true;
+    }
+
+    return removed_buffptr;
+}
+
+/**
+* Removes the oldest entry of @param buffer, if any, and advances buffer->out_offs past it.
+* Used to enforce eviction policies other than the entry count, e.g. a cap on the total size.
+* Any necessary locking must be handled by the caller
+* @return the buffptr member of the removed entry, whose memory is now owned by the caller,
+* or NULL if the buffer is empty.
+*/
+const char *aesd_circular_buffer_remove_oldest(
+    struct aesd_circular_buffer *buffer )
+{
+    struct aesd_buffer_entry *entry = &buffer->entries[buffer->out_offs];
+    const char *removed_buffptr = entry->buffptr;
+
+    if (!buffer->full && buffer->in_offs == buffer->out_offs) {
+        return NULL;
     }
 
+    buffer->total_size -= entry->size;
+    entry->buffptr = NULL;
+    entry->size = 0;
+    buffer->out_offs += 1;
+    if (buffer->out_offs == buffer->capacity) {
+        buffer->out_offs = 0;
+    }
+    buffer->full = false;
+
     return removed_buffptr;
 }
 
 /**
-* Initializes the circular buffer described by @param buffer to an empty struct
+* Initializes the circular buffer described by @param buffer to an empty struct,
+* with the embedded storage of AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries
 */
 void aesd_circular_buffer_init(struct aesd_circular_buffer* buffer)
+{
+    aesd_circular_buffer_init_storage(buffer, buffer->entry,
+                                      AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+}
+
+/**
+* Initializes the circular buffer described by @param buffer to an empty struct,
+* storing up to @param capacity entries in @param entries, which must be allocated
+* by and have a lifetime managed by the caller. @param capacity must not be zero.
+*/
+void aesd_circular_buffer_init_storage(struct aesd_circular_buffer *buffer,
+    struct aesd_buffer_entry *entries, size_t capacity)
 {
     memset(buffer,0,sizeof(struct aesd_circular_buffer));
+    memset(entries,0,capacity * sizeof(struct aesd_buffer_entry));
+    buffer->entries = entries;
+    buffer->capacity = capacity;
 }
 
 /**
-* Computer the total size of the circular buffer 
+* Initializes the circular buffer described by @param buffer to an empty struct, in the
+* contiguous storage mode: entries are stored in @param capacity @param entries, and their
+* data in the byte ring @param ring of @param ring_size bytes, which must be a power of two.
+* Both must be allocated by and have a lifetime managed by the caller. Data is added with
+* aesd_circular_buffer_add_bytes, and read with aesd_circular_buffer_copy.
+*/
+void aesd_circular_buffer_init_ring(struct aesd_circular_buffer *buffer,
+    struct aesd_buffer_entry *entries, size_t capacity, char *ring, size_t ring_size)
+{
+    aesd_circular_buffer_init_storage(buffer, entries, capacity);
+    buffer->ring = ring;
+    buffer->ring_mask = ring_size - 1;
+}
+
+/**
+* Copies @param size bytes of @param data to the ring of @param buffer as a new entry,
+* evicting the oldest entries whose data it overwrites, and the oldest entry if all
+* entries are in use. There is no allocation, nor anything for the caller to free.
+* Any necessary locking must be handled by the caller
+* @return false if the entry does not fit in the ring.
+*/
+bool aesd_circular_buffer_add_bytes(struct aesd_circular_buffer *buffer,
+    const char *data, size_t size)
+{
+    size_t ring_size = buffer->ring_mask + 1;
+    size_t start = buffer->head & buffer->ring_mask;
+    size_t first = size < ring_size - start ? size : ring_size - start;
+    struct aesd_buffer_entry entry;
+
+    if (size > ring_size) {
+        return false;
+    }
+
+    while (buffer->total_size + size > ring_size) {
+        aesd_circular_buffer_remove_oldest(buffer);
+    }
+
+    // The data may wrap around the end of the ring.
+    memcpy(buffer->ring + start, data, first);
+    memcpy(buffer->ring, data + first, size - first);
+
+    entry.buffptr = buffer->ring + start;
+    entry.size = size;
+    aesd_circular_buffer_add_entry(buffer, &entry);
+
+    return true;
+}
+
+/**
+* Copies up to @param len bytes from @param buffer, in the contiguous storage mode, to
+* @param dst, starting at @param char_offset as described for
+* aesd_circular_buffer_find_entry_offset_for_fpos, and across entry boundaries. This takes
+* at most two memcpy calls, as the data may wrap around the end of the ring.
+* Any necessary locking must be handled by the caller
+* @return the number of bytes copied, 0 if char_offset is past the end of data.
+*/
+size_t aesd_circular_buffer_copy(struct aesd_circular_buffer *buffer,
+    size_t char_offset, char *dst, size_t len)
+{
+    size_t ring_size = buffer->ring_mask + 1;
+    size_t start, first;
+
+    if (char_offset >= buffer->total_size) {
+        return 0;
+    }
+    if (len > buffer->total_size - char_offset) {
+        len = buffer->total_size - char_offset;
+    }
+
+    // The oldest entry starts total_size bytes before head.
+    start = (buffer->head - buffer->total_size + char_offset) & buffer->ring_mask;
+    first = len < ring_size - start ? len : ring_size - start;
+    memcpy(dst, buffer->ring + start, first);
+    memcpy(dst + first, buffer->ring, len - first);
+
+    return len;
+}
+
+/**
+* Computer the total size of the circular buffer, kept up to date as entries
+* are added and removed
 */
 size_t aesd_circular_buffer_size(struct aesd_circular_buffer *buffer) {
-    struct aesd_buffer_entry *entry;
-    uint8_t offset = buffer->out_offs;
-    uint8_t current_pos;
+    return buffer->total_size;
+}
 
-    size_t buffer_size = 0;
+/**
+* @return the location in the entry structure of the entry at @param index,
+* zero referenced from the oldest one
+*/
+size_t aesd_circular_buffer_pos(struct aesd_circular_buffer *buffer, size_t index) {
+    size_t pos = buffer->out_offs + index;
+    return pos >= buffer->capacity ? pos - buffer->capacity : pos;
+}
 
-    for (uint8_t i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; ++i) {
-        current_pos = (offset + i) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-        entry = &buffer->entry[current_pos];
-        buffer_size += entry->size;
+/**
+* @return the sequence number of the oldest entry of the circular buffer, or next_seq if
+* the buffer is empty
+*/
+uint64_t aesd_circular_buffer_first_seq(struct aesd_circular_buffer *buffer) {
+    return buffer->next_seq - aesd_circular_buffer_count(buffer);
+}
+
+/**
+* @return the sequence number of @param entry, which must be stored in the circular buffer
+*/
+uint64_t aesd_circular_buffer_entry_seq(struct aesd_circular_buffer *buffer,
+    const struct aesd_buffer_entry *entry) {
+    size_t pos = entry - buffer->entries;
+    size_t index = pos >= buffer->out_offs ? pos - buffer->out_offs
+                                           : pos + buffer->capacity - buffer->out_offs;
+    return aesd_circular_buffer_first_seq(buffer) + index;
+}
+
+/**
+* @return the entry with sequence number @param seq, or NULL if it is not (or no longer)
+* in the circular buffer
+*/
+struct aesd_buffer_entry *aesd_circular_buffer_find_entry_for_seq(
+    struct aesd_circular_buffer *buffer, uint64_t seq) {
+    uint64_t first_seq = aesd_circular_buffer_first_seq(buffer);
+
+    if (seq < first_seq || seq >= buffer->next_seq) {
+        return NULL;
     }
+    return &buffer->entries[aesd_circular_buffer_pos(buffer, seq - first_seq)];
+}
 
-    return buffer_size;
+/**
+* @return the number of entries stored in the circular buffer
+*/
+size_t aesd_circular_buffer_count(struct aesd_circular_buffer *buffer) {
+    if (buffer->full) {
+        return buffer->capacity;
+    }
+    if (buffer->in_offs >= buffer->out_offs) {
+        return buffer->in_offs - buffer->out_offs;
+    }
+    return buffer->capacity - buffer->out_offs + buffer->in_offs;
 }
 
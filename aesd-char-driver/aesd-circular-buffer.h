@@ -16,39 +16,80 @@
 #include <stdbool.h>
 #endif
 
+/**
+ * Default capacity, used by aesd_circular_buffer_init with the storage embedded
+ * in struct aesd_circular_buffer. Larger buffers use external storage.
+ */
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
 
 struct aesd_buffer_entry
 {
     /**
-     * A location where the buffer contents in buffptr are stored
+     * A location where the buffer contents in buffptr are stored. In the
+     * byte ring storage mode, the start of the entry in the ring, where it
+     * may wrap around the end
      */
     const char *buffptr;
     /**
      * Number of bytes stored in buffptr
      */
     size_t size;
+    /**
+     * Number of bytes added to the buffer before this entry, i.e. the prefix
+     * sum of entry sizes. Set by aesd_circular_buffer_add_entry.
+     */
+    size_t offset;
 };
 
 struct aesd_circular_buffer
 {
     /**
-     * An array of pointers to memory allocated for the most recent write operations
+     * Embedded storage for the default capacity
      */
     struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    /**
+     * An array of pointers to memory allocated for the most recent write operations,
+     * either entry or external storage
+     */
+    struct aesd_buffer_entry *entries;
+    /**
+     * The number of entries of the entries array
+     */
+    size_t capacity;
     /**
      * The current location in the entry structure where the next write should
      * be stored.
      */
-    uint8_t in_offs;
+    size_t in_offs;
     /**
      * The first location in the entry structure to read from
      */
-    uint8_t out_offs;
+    size_t out_offs;
     /**
      * set to true when the buffer entry structure is full
      */
     bool full;
+    /**
+     * Number of bytes ever added, the offset of the next entry
+     */
+    size_t head;
+    /**
+     * Sum of the sizes of the entries in the buffer
+     */
+    size_t total_size;
+    /**
+     * Sequence number of the next entry, entries are numbered from zero in
+     * the order they are added, so the entries in the buffer have consecutive
+     * sequence numbers ending at next_seq - 1
+     */
+    uint64_t next_seq;
+    /**
+     * Byte ring of the contiguous storage mode, where the entry added at
+     * offset is stored at ring[offset & ring_mask], or NULL when entries
+     * point to memory managed by the caller
+     */
+    char *ring;
+    size_t ring_mask;
 };
 
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(
@@ -60,19 +101,49 @@ extern const char *aesd_circular_buffer_add_entry(
     struct aesd_circular_buffer *buffer,
     const struct aesd_buffer_entry *add_entry );
 
+extern const char *aesd_circular_buffer_remove_oldest(
+    struct aesd_circular_buffer *buffer );
+
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
+extern void aesd_circular_buffer_init_storage(struct aesd_circular_buffer *buffer,
+    struct aesd_buffer_entry *entries, size_t capacity);
+
+extern void aesd_circular_buffer_init_ring(struct aesd_circular_buffer *buffer,
+    struct aesd_buffer_entry *entries, size_t capacity, char *ring, size_t ring_size);
+
+extern bool aesd_circular_buffer_add_bytes(struct aesd_circular_buffer *buffer,
+    const char *data, size_t size);
+
+extern size_t aesd_circular_buffer_copy(struct aesd_circular_buffer *buffer,
+    size_t char_offset, char *dst, size_t len);
+
 extern size_t aesd_circular_buffer_size(
      struct aesd_circular_buffer *buffer );
 
+extern size_t aesd_circular_buffer_count(
+     struct aesd_circular_buffer *buffer );
+
+extern size_t aesd_circular_buffer_pos(
+     struct aesd_circular_buffer *buffer, size_t index );
+
+extern uint64_t aesd_circular_buffer_first_seq(
+     struct aesd_circular_buffer *buffer );
+
+extern uint64_t aesd_circular_buffer_entry_seq(
+     struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *entry );
+
+extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_for_seq(
+     struct aesd_circular_buffer *buffer, uint64_t seq );
+
 /**
  * Create a for loop to iterate over each member of the circular buffer.
  * Useful when you've allocated memory for circular buffer entries and need to free it
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is a size_t stack allocated value used by this macro for an index
  * Example usage:
- * uint8_t index;
+ * size_t index;
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
@@ -80,9 +151,9 @@ extern size_t aesd_circular_buffer_size(
  * }
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index) \
-    for(index=0, entryptr=&((buffer)->entry[index]); \
-            index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
-            index++, entryptr=&((buffer)->entry[index]))
+    for(index=0, entryptr=&((buffer)->entries[index]); \
+            index<(buffer)->capacity; \
+            index++, entryptr=&((buffer)->entries[index]))
 
 
 
@@ -0,0 +1,128 @@
+/**
+ * @file aesd-concurrent-buffer.c
+ * @brief Lock-free bounded buffer of aesd_buffer_entry, see aesd-concurrent-buffer.h
+ * for the memory ordering contract.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+
+#include "aesd-concurrent-buffer.h"
+
+/**
+ * Initializes @param buffer with @param capacity slots of storage @param slots.
+ * @return 0, or -1 with errno set to EINVAL if capacity is not a power of two.
+ * Must be called before the buffer is shared with other threads.
+ */
+int aesd_concurrent_buffer_init(struct aesd_concurrent_buffer *buffer,
+    struct aesd_concurrent_slot *slots, size_t capacity)
+{
+    if (!capacity || (capacity & (capacity - 1))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (size_t pos = 0; pos < capacity; ++pos) {
+        slots[pos].seq = pos;
+    }
+    buffer->slots = slots;
+    buffer->mask = capacity - 1;
+    buffer->in_offs = 0;
+    buffer->out_offs = 0;
+
+    return 0;
+}
+
+/**
+ * Adds a copy of @param entry to @param buffer, safe with any number of
+ * concurrent producers.
+ * @return true, or false if the buffer is full.
+ */
+bool aesd_concurrent_buffer_push(struct aesd_concurrent_buffer *buffer,
+    const struct aesd_buffer_entry *entry)
+{
+    struct aesd_concurrent_slot *slot;
+    size_t pos = __atomic_load_n(&buffer->in_offs, __ATOMIC_RELAXED);
+    size_t seq;
+
+    for (;;) {
+        slot = &buffer->slots[pos & buffer->mask];
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+        if (seq == pos) {
+            // The slot is free, claim its position. On failure pos is reloaded.
+            if (__atomic_compare_exchange_n(&buffer->in_offs, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if ((intptr_t) (seq - pos) < 0) {
+            // Not popped yet since the previous lap.
+            return false;
+        } else {
+            // Another producer claimed pos already.
+            pos = __atomic_load_n(&buffer->in_offs, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->entry = *entry;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * Adds a copy of @param entry to @param buffer, without the compare and swap
+ * of aesd_concurrent_buffer_push. Only for buffers with a single producer.
+ * @return true, or false if the buffer is full.
+ */
+bool aesd_concurrent_buffer_push_single(struct aesd_concurrent_buffer *buffer,
+    const struct aesd_buffer_entry *entry)
+{
+    size_t pos = __atomic_load_n(&buffer->in_offs, __ATOMIC_RELAXED);
+    struct aesd_concurrent_slot *slot = &buffer->slots[pos & buffer->mask];
+
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos) {
+        return false;
+    }
+
+    slot->entry = *entry;
+    __atomic_store_n(&buffer->in_offs, pos + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * Removes the oldest entry of @param buffer and copies it to @param entry.
+ * Only one thread may pop from a buffer.
+ * @return true, or false if the buffer is empty, or if the producer of the
+ * oldest entry has not completed its push yet.
+ */
+bool aesd_concurrent_buffer_pop(struct aesd_concurrent_buffer *buffer,
+    struct aesd_buffer_entry *entry)
+{
+    size_t pos = __atomic_load_n(&buffer->out_offs, __ATOMIC_RELAXED);
+    struct aesd_concurrent_slot *slot = &buffer->slots[pos & buffer->mask];
+
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1) {
+        return false;
+    }
+
+    *entry = slot->entry;
+    // Free for the push of the same slot in the next lap.
+    __atomic_store_n(&slot->seq, pos + buffer->mask + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&buffer->out_offs, pos + 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+/**
+ * @return the number of entries pushed and not popped yet, which is only a
+ * snapshot while other threads use the buffer.
+ */
+size_t aesd_concurrent_buffer_count(struct aesd_concurrent_buffer *buffer)
+{
+    size_t out_offs = __atomic_load_n(&buffer->out_offs, __ATOMIC_ACQUIRE);
+    size_t in_offs = __atomic_load_n(&buffer->in_offs, __ATOMIC_ACQUIRE);
+
+    // out_offs is read first and never passes in_offs, the difference is
+    // never negative
+    return in_offs - out_offs;
+}
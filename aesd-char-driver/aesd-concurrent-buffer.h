@@ -0,0 +1,81 @@
+/*
+ * aesd-concurrent-buffer.h
+ *
+ *  @brief Lock-free variant of aesd_circular_buffer for userspace, for single
+ *  or multiple producers and a single consumer.
+ *
+ *  Unlike aesd_circular_buffer, which overwrites the oldest entry and leaves
+ *  all locking to the caller, this buffer is a bounded queue: a push fails
+ *  when the buffer is full, and the consumer pops entries in order. Each slot
+ *  carries a sequence number telling whether it is free for the push of a
+ *  given position, or holds the entry for the pop of that position, so
+ *  producers only contend on in_offs, and never with the consumer.
+ *
+ *  Memory ordering contract:
+ *  - Everything a producer writes before a successful push, including the
+ *    data buffptr points to, is visible to the consumer after the pop that
+ *    returns the entry (release on push, acquire on pop).
+ *  - A pop copies the entry out before releasing its slot (release), and a
+ *    producer only reuses the slot once it sees it released (acquire), so
+ *    a push never overwrites an entry being popped.
+ *  - Entries of one producer are popped in the order they were pushed.
+ *    Entries of different producers are ordered by their push on in_offs.
+ *  - count is only a snapshot when other threads are pushing or popping.
+ */
+
+#ifndef AESD_CONCURRENT_BUFFER_H
+#define AESD_CONCURRENT_BUFFER_H
+
+#ifdef __KERNEL__
+#error "aesd-concurrent-buffer is for userspace, the driver uses aesd_circular_buffer with RCU"
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "aesd-circular-buffer.h"
+
+#define AESD_CACHELINE 64
+
+struct aesd_concurrent_slot
+{
+    /**
+     * Position the slot is free to be pushed at, or that position + 1 once
+     * the entry is stored, until the pop sets it to position + capacity
+     */
+    size_t seq;
+    struct aesd_buffer_entry entry;
+};
+
+struct aesd_concurrent_buffer
+{
+    /**
+     * Slots, capacity of them, which must be a power of two
+     */
+    struct aesd_concurrent_slot *slots;
+    size_t mask;
+    /**
+     * Position of the next push, only modified by producers
+     */
+    _Alignas(AESD_CACHELINE) size_t in_offs;
+    /**
+     * Position of the next pop, only modified by the consumer
+     */
+    _Alignas(AESD_CACHELINE) size_t out_offs;
+};
+
+extern int aesd_concurrent_buffer_init(struct aesd_concurrent_buffer *buffer,
+    struct aesd_concurrent_slot *slots, size_t capacity);
+
+extern bool aesd_concurrent_buffer_push(struct aesd_concurrent_buffer *buffer,
+    const struct aesd_buffer_entry *entry);
+
+extern bool aesd_concurrent_buffer_push_single(struct aesd_concurrent_buffer *buffer,
+    const struct aesd_buffer_entry *entry);
+
+extern bool aesd_concurrent_buffer_pop(struct aesd_concurrent_buffer *buffer,
+    struct aesd_buffer_entry *entry);
+
+extern size_t aesd_concurrent_buffer_count(struct aesd_concurrent_buffer *buffer);
+
+#endif /* AESD_CONCURRENT_BUFFER_H */
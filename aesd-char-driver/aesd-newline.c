@@ -0,0 +1,242 @@
+/**
+ * @file aesd-newline.c
+ * @brief Line splitting kernels, see aesd-newline.h.
+ */
+
+#ifdef __KERNEL__
+#include <linux/bitops.h>
+#include <linux/string.h>
+#define aesd_popcount64(x) hweight64(x)
+#else
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#define aesd_popcount64(x) __builtin_popcountll(x)
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define AESD_NEWLINE_X86
+#endif
+#endif
+
+#include "aesd-newline.h"
+
+#define AESD_NEWLINE_BLOCK 64
+#define AESD_NEWLINE_ONES 0x0101010101010101ULL
+
+/**
+ * @return a mask with bit i set if byte i of @param word, in memory order,
+ * is a newline. The zero byte test is exact, bytes above 0x80 or next to a
+ * newline give no false positives.
+ */
+static inline uint64_t aesd_newline_mask_word(uint64_t word)
+{
+    uint64_t x = word ^ (AESD_NEWLINE_ONES * '\n');
+    uint64_t low7 = AESD_NEWLINE_ONES * 0x7f;
+    uint64_t high = ~(((x & low7) + low7) | x | low7);
+
+    // gather the high bit of byte i into bit i of the top byte
+    return ((high >> 7) * 0x0102040810204080ULL) >> 56;
+}
+
+static inline uint64_t aesd_newline_mask_scalar(const char *data)
+{
+    uint64_t mask = 0, word;
+    int i;
+
+    for (i = 0; i < AESD_NEWLINE_BLOCK / 8; ++i) {
+        memcpy(&word, data + 8 * i, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        word = __builtin_bswap64(word);
+#endif
+        mask |= aesd_newline_mask_word(word) << (8 * i);
+    }
+    return mask;
+}
+
+#ifdef AESD_NEWLINE_X86
+static inline uint64_t aesd_newline_mask_sse2(const char *data)
+{
+    const __m128i newline = _mm_set1_epi8('\n');
+    uint64_t mask = 0;
+    int i;
+
+    for (i = 0; i < AESD_NEWLINE_BLOCK / 16; ++i) {
+        __m128i block = _mm_loadu_si128((const __m128i *) (data + 16 * i));
+        mask |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline)) << (16 * i);
+    }
+    return mask;
+}
+
+__attribute__((target("avx2")))
+static inline uint64_t aesd_newline_mask_avx2(const char *data)
+{
+    const __m256i newline = _mm256_set1_epi8('\n');
+    __m256i low = _mm256_loadu_si256((const __m256i *) data);
+    __m256i high = _mm256_loadu_si256((const __m256i *) (data + 32));
+
+    return (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(low, newline)) |
+           (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(high, newline)) << 32;
+}
+#endif
+
+/**
+ * Loops shared by all kernels, inlined in each with its block mask function.
+ * The tail shorter than a block is scanned byte by byte.
+ */
+static inline __attribute__((always_inline)) size_t aesd_newline_scan_blocks(
+    const char *data, size_t size, size_t *offsets, size_t max,
+    uint64_t (*block_mask)(const char *))
+{
+    size_t found = 0, pos = 0;
+    uint64_t mask;
+
+    for (; pos + AESD_NEWLINE_BLOCK <= size && found < max; pos += AESD_NEWLINE_BLOCK) {
+        mask = block_mask(data + pos);
+        while (mask && found < max) {
+            offsets[found++] = pos + __builtin_ctzll(mask);
+            mask &= mask - 1;
+        }
+    }
+    for (; pos < size && found < max; ++pos) {
+        if (data[pos] == '\n') {
+            offsets[found++] = pos;
+        }
+    }
+    return found;
+}
+
+static inline __attribute__((always_inline)) size_t aesd_newline_count_blocks(
+    const char *data, size_t size, uint64_t (*block_mask)(const char *))
+{
+    size_t count = 0, pos = 0;
+
+    for (; pos + AESD_NEWLINE_BLOCK <= size; pos += AESD_NEWLINE_BLOCK) {
+        count += aesd_popcount64(block_mask(data + pos));
+    }
+    for (; pos < size; ++pos) {
+        count += data[pos] == '\n';
+    }
+    return count;
+}
+
+static size_t aesd_newline_scan_scalar(const char *data, size_t size, size_t *offsets, size_t max)
+{
+    return aesd_newline_scan_blocks(data, size, offsets, max, aesd_newline_mask_scalar);
+}
+
+static size_t aesd_newline_count_scalar(const char *data, size_t size)
+{
+    return aesd_newline_count_blocks(data, size, aesd_newline_mask_scalar);
+}
+
+#ifdef AESD_NEWLINE_X86
+static size_t aesd_newline_scan_sse2(const char *data, size_t size, size_t *offsets, size_t max)
+{
+    return aesd_newline_scan_blocks(data, size, offsets, max, aesd_newline_mask_sse2);
+}
+
+static size_t aesd_newline_count_sse2(const char *data, size_t size)
+{
+    return aesd_newline_count_blocks(data, size, aesd_newline_mask_sse2);
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t aesd_newline_scan_avx2(const char *data, size_t size, size_t *offsets, size_t max)
+{
+    return aesd_newline_scan_blocks(data, size, offsets, max, aesd_newline_mask_avx2);
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t aesd_newline_count_avx2(const char *data, size_t size)
+{
+    return aesd_newline_count_blocks(data, size, aesd_newline_mask_avx2);
+}
+#endif
+
+struct aesd_newline_ops
+{
+    const char *name;
+    size_t (*scan)(const char *, size_t, size_t *, size_t);
+    size_t (*count)(const char *, size_t);
+};
+
+static const struct aesd_newline_ops aesd_newline_kernels[] = {
+    { "scalar", aesd_newline_scan_scalar, aesd_newline_count_scalar },
+#ifdef AESD_NEWLINE_X86
+    { "sse2", aesd_newline_scan_sse2, aesd_newline_count_sse2 },
+    { "avx2", aesd_newline_scan_avx2, aesd_newline_count_avx2 },
+#endif
+};
+
+#define AESD_NEWLINE_NR_KERNELS (sizeof(aesd_newline_kernels) / sizeof(aesd_newline_kernels[0]))
+
+/**
+ * Kernel in use, NULL until the first call selects the best one. Selection
+ * races are benign, every thread stores the same kernel.
+ */
+static const struct aesd_newline_ops *aesd_newline_ops;
+
+static bool aesd_newline_supported(const struct aesd_newline_ops *ops)
+{
+#ifdef AESD_NEWLINE_X86
+    if (ops->scan == aesd_newline_scan_avx2) {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+    }
+#endif
+    return true;
+}
+
+static const struct aesd_newline_ops *aesd_newline_get(void)
+{
+    const struct aesd_newline_ops *ops = __atomic_load_n(&aesd_newline_ops, __ATOMIC_RELAXED);
+    size_t index = AESD_NEWLINE_NR_KERNELS;
+
+    if (!ops) {
+        // the best kernels come last
+        do {
+            ops = &aesd_newline_kernels[--index];
+        } while (!aesd_newline_supported(ops));
+        __atomic_store_n(&aesd_newline_ops, ops, __ATOMIC_RELAXED);
+    }
+    return ops;
+}
+
+size_t aesd_newline_scan(const char *data, size_t size, size_t *offsets, size_t max)
+{
+#ifdef AESD_NEWLINE_X86
+    return aesd_newline_get()->scan(data, size, offsets, max);
+#else
+    return aesd_newline_scan_scalar(data, size, offsets, max);
+#endif
+}
+
+size_t aesd_newline_count(const char *data, size_t size)
+{
+#ifdef AESD_NEWLINE_X86
+    return aesd_newline_get()->count(data, size);
+#else
+    return aesd_newline_count_scalar(data, size);
+#endif
+}
+
+const char *aesd_newline_kernel(void)
+{
+    return aesd_newline_get()->name;
+}
+
+int aesd_newline_select(const char *name)
+{
+    size_t index;
+
+    for (index = 0; index < AESD_NEWLINE_NR_KERNELS; ++index) {
+        if (!strcmp(aesd_newline_kernels[index].name, name)) {
+            if (!aesd_newline_supported(&aesd_newline_kernels[index])) {
+                return -1;
+            }
+            __atomic_store_n(&aesd_newline_ops, &aesd_newline_kernels[index], __ATOMIC_RELAXED);
+            return 0;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,47 @@
+/*
+ * aesd-newline.h
+ *
+ *  Line splitting kernels, shared by the driver write path and aesdsocket.
+ *
+ *  Data is scanned in blocks of 64 bytes, each reduced to a mask with one bit
+ *  per newline, so that all the newlines of a buffer are found in one pass
+ *  instead of one memchr call per line. User space builds on x86-64 use SSE2,
+ *  or AVX2 when the cpu supports it, selected at the first call. The kernel
+ *  build uses the word at a time scalar version only, since vector registers
+ *  are not usable there without kernel_fpu_begin.
+ */
+
+#ifndef AESD_NEWLINE_H
+#define AESD_NEWLINE_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stddef.h> // size_t
+#endif
+
+/**
+ * Stores in @param offsets the offsets of the first newlines of the
+ * @param size bytes at @param data, at most @param max of them.
+ * @return the number of offsets stored. Scanning stops at the max-th newline,
+ * so a buffer is split in batches by resuming one past the last offset.
+ */
+size_t aesd_newline_scan(const char *data, size_t size, size_t *offsets, size_t max);
+
+/**
+ * @return the number of newlines in the @param size bytes at @param data.
+ */
+size_t aesd_newline_count(const char *data, size_t size);
+
+/**
+ * @return the name of the kernel in use: "scalar", "sse2" or "avx2".
+ */
+const char *aesd_newline_kernel(void);
+
+/**
+ * Selects the kernel named @param name, for tests and benchmarks.
+ * @return 0, or -1 if there is no such kernel or the cpu does not support it.
+ */
+int aesd_newline_select(const char *name);
+
+#endif /* AESD_NEWLINE_H */
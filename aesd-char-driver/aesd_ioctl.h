@@ -38,9 +38,138 @@ struct aesd_seekto {
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+/**
+ * Enables (non zero argument) or disables follow mode on an open file: reads
+ * at the end of data block until a new entry is written, or fail with EAGAIN
+ * if the file is non blocking, instead of returning 0. Poll and epoll report
+ * the file readable when data past its position is available. The argument
+ * is the flag itself, not a pointer to it.
+ */
+#define AESDCHAR_IOCFOLLOW _IO(AESD_IOC_MAGIC, 2)
+
+/**
+ * Eviction policy of the circular buffer, passed by AESDCHAR_IOCRESIZE.
+ */
+struct aesd_resize {
+    /**
+     * Number of entries of the circular buffer, at most the max_capacity module
+     * parameter. Oldest entries are evicted if the buffer shrinks. Zero only
+     * queries the current policy, which is returned in both cases.
+     */
+    uint32_t capacity;
+    uint32_t reserved;
+    /**
+     * Cap on the total size of the entries, zero for no cap. Oldest entries are
+     * evicted while the cap is exceeded, but the newest one is always kept.
+     */
+    uint64_t max_bytes;
+};
+
+/**
+ * Changes the eviction policy of the device, requires the file to be open for
+ * writing unless it is a query.
+ */
+#define AESDCHAR_IOCRESIZE _IOWR(AESD_IOC_MAGIC, 3, struct aesd_resize)
+/**
+ * Read position of an open file, returned by AESDCHAR_IOCCURSOR. Entries are
+ * numbered in the order they are written, and reads follow entries by their
+ * sequence number, so evicting old entries does not shift the position of a
+ * reader. If entries are evicted before a reader gets to them, it continues
+ * from the oldest entry and they are counted as lost.
+ */
+struct aesd_cursor {
+    uint64_t seq;       /* Sequence number of the entry to read next */
+    uint64_t offset;    /* Offset in that entry */
+    uint64_t lost;      /* Entries the file missed since it was opened */
+    uint64_t next_seq;  /* Sequence number of the next entry to be written */
+};
+
+#define AESDCHAR_IOCCURSOR _IOR(AESD_IOC_MAGIC, 4, struct aesd_cursor)
+
+/**
+ * Batch of lines committed by AESDCHAR_IOCWRITEBATCH, with a single lock of
+ * the device. The data must consist of newline terminated lines, each one
+ * becomes an entry, as if written with its own write call. The first line
+ * completes a previous partial write, if any.
+ */
+struct aesd_batch_write {
+    uint64_t data;          /* User pointer to the lines */
+    uint64_t size;          /* Size of the data in bytes, at most 4 MiB */
+    uint32_t count;         /* Returns the number of entries committed */
+    uint32_t reserved;
+};
+
+#define AESDCHAR_IOCWRITEBATCH _IOWR(AESD_IOC_MAGIC, 5, struct aesd_batch_write)
+
+/**
+ * Entry returned by AESDCHAR_IOCREADBATCH. Data of the entries follow each
+ * other in the data buffer, in the order of the descriptors.
+ */
+struct aesd_entry_desc {
+    uint64_t seq;           /* Sequence number of the entry */
+    uint64_t size;          /* Bytes of the entry in the data buffer */
+};
+
+/**
+ * Batch of entries fetched by AESDCHAR_IOCREADBATCH, from the read position
+ * of the file (see struct aesd_cursor), which is then moved past them. Only
+ * whole entries are returned, except for the first one if the file was left
+ * in the middle of it. Fails with EMSGSIZE if not even the first one fits in
+ * the data buffer, and like read for the rest, including follow mode.
+ */
+struct aesd_batch_read {
+    uint64_t descs;         /* User pointer to an array of struct aesd_entry_desc */
+    uint64_t data;          /* User pointer to the data buffer */
+    uint64_t data_size;     /* Size of the data buffer */
+    uint32_t max_entries;   /* Number of descriptors of the array */
+    uint32_t count;         /* Returns the number of entries read */
+    uint64_t size;          /* Returns the bytes of data read */
+};
+
+#define AESDCHAR_IOCREADBATCH _IOWR(AESD_IOC_MAGIC, 6, struct aesd_batch_read)
+
+/**
+ * Layout of the read-only mapping of an aesdchar device (mmap at offset 0):
+ * a header page, an index of entries, and a byte ring holding entry data,
+ * at the offsets given by the header. Entry i of the circular buffer (slot
+ * numbering, see in_offs and out_offs) starts at position index[i].offset of
+ * the stream of bytes ever written to the ring, i.e. at byte offset
+ * (index[i].offset % data_size) of the ring, possibly wrapping around its end.
+ * Data of an entry is no longer available if head - offset > data_size. The
+ * ring is sized from the max_bytes module parameter, so it holds the whole
+ * buffer unless the buffer is uncapped or a larger cap is set by resizing.
+ * Slots are renumbered from zero when the buffer is resized.
+ *
+ * The driver increments seq before and after each update, so readers retry
+ * while seq is odd or if it changed while they were reading.
+ */
+#define AESD_MMAP_MAGIC 0x41455344 /* "AESD" */
+#define AESD_MMAP_VERSION 1
+
+struct aesd_mmap_index {
+    uint64_t offset;
+    uint64_t size;
+};
+
+struct aesd_mmap_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t seq;
+    uint32_t max_entries;   /* Number of slots of the index, at least capacity */
+    uint64_t index_offset;  /* Offset of the index from the mapping start */
+    uint64_t data_offset;   /* Offset of the data ring from the mapping start */
+    uint64_t data_size;     /* Size of the data ring, a power of two */
+    uint64_t head;          /* Bytes ever written to the ring */
+    uint64_t total_size;    /* Sum of the sizes of the entries in the buffer */
+    uint32_t in_offs;
+    uint32_t out_offs;
+    uint32_t full;
+    uint32_t capacity;      /* Number of slots in use, see AESDCHAR_IOCRESIZE */
+};
+
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 6
 
 #endif /* AESD_IOCTL_H */
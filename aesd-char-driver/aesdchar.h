@@ -10,7 +10,7 @@
 
 #include "aesd-circular-buffer.h"
 
-#define AESD_DEBUG 1  //Remove comment on this line to enable debug
+//#define AESD_DEBUG 1  //Remove comment on this line to enable debug
 
 #undef PDEBUG             /* undef it, just in case */
 #ifdef AESD_DEBUG
@@ -25,16 +25,105 @@
 #  define PDEBUG(fmt, args...) /* not debugging: nothing */
 #endif
 
+/**
+ * Storage of an entry, buffptr of buffer entries points to data. The buffer
+ * holds one reference, and readers take another one while copying to user
+ * space, so that an entry evicted meanwhile stays valid. Readers look entries
+ * up under RCU, so large payloads are released after a grace period. Small
+ * ones come from a SLAB_TYPESAFE_BY_RCU cache and are recycled at once,
+ * readers check that the buffer did not change after taking their reference.
+ */
+struct aesd_payload
+{
+    struct kref ref;
+    bool cached;              /* Small payload, from the cache */
+    union {
+        struct rcu_head rcu;      /* Large payload being released */
+        struct list_head pool;    /* Small payload waiting for reuse */
+    };
+    char data[];
+};
+
+/**
+ * Chunk of a partial write. Chunks are page sized, so that appending to the
+ * work in progress entry never moves previously written bytes.
+ */
+struct aesd_wip_chunk
+{
+    struct list_head list;
+    size_t used;
+    char data[];
+};
+
+#define AESD_WIP_CHUNK_DATA (PAGE_SIZE - sizeof(struct aesd_wip_chunk))
+
+/**
+ * Entry being written, accumulated as a list of chunks until a newline is
+ * written, then linearized in a payload with a single copy.
+ */
+struct aesd_wip
+{
+    struct list_head chunks;
+    size_t size;
+};
+
+/**
+ * Circular buffer together with its entries, replaced as a whole on resize.
+ * The old one is freed after a grace period, since readers look it up under
+ * RCU.
+ */
+struct aesd_buffer_storage
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry entries[];
+};
+
+/**
+ * Counters of a device, kept per cpu so that lockless readers do not share
+ * cache lines, and summed up when shown in debugfs.
+ */
+struct aesd_stats
+{
+    u64 bytes_written;    /* Bytes of committed entries */
+    u64 lines_written;    /* Committed entries */
+    u64 bytes_read;
+    u64 lines_read;       /* Entries read up to their end */
+    u64 evictions;        /* Entries evicted from the buffer */
+    u64 lost;             /* Entries evicted before a reader got to them */
+    u64 contended;        /* Writers that had to wait for lock */
+};
+
 struct aesd_dev
 {
     /**
      * TODO: Add structure(s) and locks needed to complete assignment requirements
      */
-    struct aesd_circular_buffer *buffer;
-    struct aesd_buffer_entry wip_entry;
-    struct mutex lock;
+    struct aesd_circular_buffer __rcu *buffer; /* See aesd_buffer_storage */
+    size_t max_bytes;     /* Cap on the total size of entries, 0 if none */
+    seqcount_mutex_t seq; /* Readers retry if buffer changed meanwhile */
+    struct aesd_wip wip;  /* Partial write, protected by lock */
+    wait_queue_head_t wq; /* Woken up when an entry is committed */
+    void *mmap_area;      /* Read-only mapping for user space, see aesd_ioctl.h */
+    size_t mmap_size;
+    struct aesd_stats __percpu *stats;
+    struct dentry *debugfs;
+    struct mutex lock;    /* Serializes writers only */
     struct cdev cdev;     /* Char device structure      */
 };
 
+/**
+ * State of an open file, stored in its private_data. The cursor is not
+ * synchronized: like f_pos, which the VFS only serializes for regular files,
+ * it is undefined if threads sharing the file read, seek or write through it
+ * concurrently.
+ */
+struct aesd_file
+{
+    struct aesd_dev *dev;
+    bool follow;          /* Reads at end of data wait for new entries */
+    u64 seq;              /* Cursor, sequence number of the entry to read */
+    size_t offset;        /*   and offset in it, pinned by every seek */
+    u64 lost;             /* Entries evicted before they could be read */
+};
 
 #endif /* AESD_CHAR_DRIVER_AESDCHAR_H_ */
@@ -0,0 +1,93 @@
+/*
+ * aesdchar_trace.h
+ *
+ *  @brief Tracepoints of the aesdchar driver, enabled at run time through
+ *  /sys/kernel/tracing/events/aesdchar
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM aesdchar
+
+#if !defined(AESD_CHAR_DRIVER_AESDCHAR_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define AESD_CHAR_DRIVER_AESDCHAR_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+/**
+ * A write call, committed is the size of the lines it committed as entries,
+ * or 0 if the data was only appended to the partial write of wip_size bytes.
+ */
+TRACE_EVENT(aesd_write,
+    TP_PROTO(unsigned int minor, size_t count, size_t wip_size, size_t committed),
+    TP_ARGS(minor, count, wip_size, committed),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(size_t, count)
+        __field(size_t, wip_size)
+        __field(size_t, committed)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->count = count;
+        __entry->wip_size = wip_size;
+        __entry->committed = committed;
+    ),
+    TP_printk("minor=%u count=%zu wip_size=%zu committed=%zu",
+              __entry->minor, __entry->count, __entry->wip_size, __entry->committed)
+);
+
+/**
+ * A read call, seq and offset give the cursor it ended at.
+ */
+TRACE_EVENT(aesd_read,
+    TP_PROTO(unsigned int minor, size_t count, ssize_t ret, u64 seq, size_t offset),
+    TP_ARGS(minor, count, ret, seq, offset),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(size_t, count)
+        __field(ssize_t, ret)
+        __field(u64, seq)
+        __field(size_t, offset)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->count = count;
+        __entry->ret = ret;
+        __entry->seq = seq;
+        __entry->offset = offset;
+    ),
+    TP_printk("minor=%u count=%zu ret=%zd seq=%llu offset=%zu",
+              __entry->minor, __entry->count, __entry->ret,
+              (unsigned long long) __entry->seq, __entry->offset)
+);
+
+/**
+ * A seek, either with llseek or with the seekto ioctl.
+ */
+TRACE_EVENT(aesd_seek,
+    TP_PROTO(unsigned int minor, loff_t off, int whence, loff_t ret),
+    TP_ARGS(minor, off, whence, ret),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(loff_t, off)
+        __field(int, whence)
+        __field(loff_t, ret)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->off = off;
+        __entry->whence = whence;
+        __entry->ret = ret;
+    ),
+    TP_printk("minor=%u off=%lld whence=%d ret=%lld",
+              __entry->minor, __entry->off, __entry->whence, __entry->ret)
+);
+
+#endif /* AESD_CHAR_DRIVER_AESDCHAR_TRACE_H_ */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE aesdchar_trace
+#include <trace/define_trace.h>
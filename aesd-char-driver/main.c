@@ -11,15 +11,45 @@
  *
  */
 
+#ifdef __KERNEL__
 #include <linux/module.h>
 #include <linux/init.h>
 #include <linux/printk.h>
 #include <linux/types.h>
 #include <linux/cdev.h>
+#include <linux/debugfs.h>
 #include <linux/slab.h> // kmalloc
 #include <linux/fs.h> // file_operations
+#include <linux/kref.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/poll.h>
+#include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/rcupdate.h>
+#include <linux/seqlock.h>
+#include <linux/seq_file.h>
+#include <linux/version.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#else
+#include "aesd-uspace.h" // userspace build, see uspace/Makefile
+#endif
 #include "aesdchar.h"
 #include "aesd_ioctl.h"
+#include "aesd-newline.h"
+
+#ifdef __KERNEL__
+#define CREATE_TRACE_POINTS
+#include "aesdchar_trace.h"
+#endif
+
+#define AESD_MMAP_DATA_SIZE (64 * 1024) // least bytes of the mmap data ring
+#define AESD_PAYLOAD_CACHED 256 // object size of the payload cache
+#define AESD_PAYLOAD_POOL 128 // released small payloads kept for reuse
+#define AESD_BATCH_MAX_SIZE (4 * 1024 * 1024) // bytes of a batch write
+#define AESD_WRITE_LINES 8 // lines of a write committed without allocating entries
+#define AESD_SCAN_BATCH 32 // newline offsets found per scan call
 
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
@@ -27,21 +57,53 @@ int aesd_minor =   0;
 MODULE_AUTHOR("amasini0"); /** DONE: fill in your name **/
 MODULE_LICENSE("Dual BSD/GPL");
 
-struct aesd_dev aesd_device;
+static unsigned int aesd_nr_devices = 1;
+module_param_named(devices, aesd_nr_devices, uint, 0444);
+MODULE_PARM_DESC(devices, "Number of devices, each with its own buffer");
+
+static unsigned int aesd_capacity = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+module_param_named(capacity, aesd_capacity, uint, 0444);
+MODULE_PARM_DESC(capacity, "Initial number of entries of the circular buffer");
+
+static unsigned int aesd_max_capacity = 65536;
+module_param_named(max_capacity, aesd_max_capacity, uint, 0444);
+MODULE_PARM_DESC(max_capacity, "Number of entries the buffer can be resized to at most");
+
+static unsigned long aesd_max_bytes = 0;
+module_param_named(max_bytes, aesd_max_bytes, ulong, 0444);
+MODULE_PARM_DESC(max_bytes, "Initial cap on the total size of entries, 0 for no cap");
+
+struct aesd_dev *aesd_devices; // aesd_nr_devices devices, one per minor
+
+static struct dentry *aesd_debugfs_root;
+static struct kmem_cache *aesd_payload_cache;
+static LIST_HEAD(aesd_payload_pool);
+static size_t aesd_payload_pooled;
+static DEFINE_SPINLOCK(aesd_payload_lock);
+
+static void aesd_cursor_seek(struct aesd_file *file, loff_t pos);
 
 int aesd_open(struct inode *inode, struct file *filp)
 {
-    struct aesd_dev *dev;
+    struct aesd_file *file;
 
     PDEBUG("open");
     /**
      * DONE: handle open
      */
-    // Pass aesd_device to subsequent file operations.
-    // Actually, this is not needed, since we have a single, stack-allocated
-    // device. We do it since it is a best practice.
-    dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
-    filp->private_data = dev;
+    // Pass the device of this minor to subsequent file operations, together with the state
+    // of this open file.
+    file = kzalloc(sizeof(*file), GFP_KERNEL);
+    if (!file) {
+        return -ENOMEM;
+    }
+    file->dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
+    aesd_cursor_seek(file, 0);
+    filp->private_data = file;
+
+    // Reads and writes move the cursor, which only follows f_pos, so reading
+    // or writing at another position fails with ESPIPE.
+    filp->f_mode &= ~(FMODE_PREAD | FMODE_PWRITE);
 
     return 0;
 }
@@ -52,188 +114,1226 @@ int aesd_release(struct inode *inode, struct file *filp)
     /**
      * DONE: handle release
      */
-    // Nothing to deallocate
+    kfree(filp->private_data);
 
     return 0;
 }
 
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+/**
+ * Allocates a payload for size bytes of data. Small payloads are taken from
+ * the pool of released ones, or else from their cache, so that steady state
+ * writes of short lines do not go through the general allocator.
+ */
+static struct aesd_payload *aesd_payload_alloc(size_t size)
 {
-    struct aesd_dev *dev = filp->private_data;
+    struct aesd_payload *payload;
+
+    if (sizeof(*payload) + size > AESD_PAYLOAD_CACHED) {
+        payload = kmalloc(sizeof(*payload) + size, GFP_KERNEL);
+        if (!payload) {
+            return NULL;
+        }
+        payload->cached = false;
+    } else {
+        spin_lock(&aesd_payload_lock);
+        payload = list_first_entry_or_null(&aesd_payload_pool, struct aesd_payload, pool);
+        if (payload) {
+            list_del(&payload->pool);
+            aesd_payload_pooled--;
+        }
+        spin_unlock(&aesd_payload_lock);
+
+        if (!payload) {
+            payload = kmem_cache_alloc(aesd_payload_cache, GFP_KERNEL);
+            if (!payload) {
+                return NULL;
+            }
+        }
+        payload->cached = true;
+    }
+    kref_init(&payload->ref);
+
+    return payload;
+}
+
+/**
+ * Releases an entry payload once its last reference is dropped. Lockless
+ * readers may still be looking at it, hence the grace period before freeing
+ * large payloads. Small ones are type safe, and are recycled right away.
+ */
+static void aesd_payload_release(struct kref *ref)
+{
+    struct aesd_payload *payload = container_of(ref, struct aesd_payload, ref);
+
+    if (!payload->cached) {
+        kfree_rcu(payload, rcu);
+        return;
+    }
+
+    spin_lock(&aesd_payload_lock);
+    if (aesd_payload_pooled < AESD_PAYLOAD_POOL) {
+        list_add(&payload->pool, &aesd_payload_pool);
+        aesd_payload_pooled++;
+        payload = NULL;
+    }
+    spin_unlock(&aesd_payload_lock);
+
+    if (payload) {
+        kmem_cache_free(aesd_payload_cache, payload);
+    }
+}
+
+static void aesd_payload_pool_free(void)
+{
+    struct aesd_payload *payload, *next;
+
+    list_for_each_entry_safe(payload, next, &aesd_payload_pool, pool) {
+        list_del(&payload->pool);
+        kmem_cache_free(aesd_payload_cache, payload);
+    }
+    aesd_payload_pooled = 0;
+}
+
+static void aesd_payload_put(const char *buffptr)
+{
+    if (buffptr) {
+        kref_put(&container_of(buffptr, struct aesd_payload, data)->ref,
+                 aesd_payload_release);
+    }
+}
+
+/**
+ * Returns the circular buffer of dev. Must be called under RCU or with
+ * dev->lock held.
+ */
+static struct aesd_circular_buffer *aesd_buffer(struct aesd_dev *dev)
+{
+    return rcu_dereference_check(dev->buffer, lockdep_is_held(&dev->lock));
+}
+
+static struct aesd_circular_buffer *aesd_buffer_alloc(size_t capacity)
+{
+    struct aesd_buffer_storage *storage;
+
+    storage = kvmalloc(struct_size(storage, entries, capacity), GFP_KERNEL);
+    if (!storage) {
+        return NULL;
+    }
+    aesd_circular_buffer_init_storage(&storage->buffer, storage->entries, capacity);
+
+    return &storage->buffer;
+}
+
+static void aesd_buffer_free(struct aesd_circular_buffer *buffer)
+{
+    if (buffer) {
+        kvfree(container_of(buffer, struct aesd_buffer_storage, buffer));
+    }
+}
+
+/**
+ * Drops the reference of the buffer to an evicted entry, if any.
+ */
+static void aesd_buffer_evicted(struct aesd_dev *dev, const char *buffptr)
+{
+    if (buffptr) {
+        this_cpu_inc(dev->stats->evictions);
+        aesd_payload_put(buffptr);
+    }
+}
+
+/**
+ * Takes dev->lock for a writer, counting the times it has to wait.
+ */
+static int aesd_lock(struct aesd_dev *dev)
+{
+    if (mutex_trylock(&dev->lock)) {
+        return 0;
+    }
+    this_cpu_inc(dev->stats->contended);
+    return mutex_lock_interruptible(&dev->lock);
+}
+
+/**
+ * Evicts the oldest entries while their total size exceeds dev->max_bytes,
+ * always keeping the newest one. Must be called in a write seqcount section.
+ */
+static void aesd_buffer_trim(struct aesd_dev *dev, struct aesd_circular_buffer *buffer)
+{
+    if (!dev->max_bytes) {
+        return;
+    }
+
+    while (aesd_circular_buffer_size(buffer) > dev->max_bytes &&
+           aesd_circular_buffer_count(buffer) > 1) {
+        aesd_buffer_evicted(dev, aesd_circular_buffer_remove_oldest(buffer));
+    }
+}
+
+/**
+ * Moves the cursor of file to byte position pos, counted from the oldest entry
+ * as f_pos is. Positions past the end of data move it to the next entry. Every
+ * change of f_pos other than by reading goes through here, so that the target
+ * is pinned to an entry at once, and later evictions do not shift it.
+ */
+static void aesd_cursor_seek(struct aesd_file *file, loff_t pos)
+{
+    struct aesd_dev *dev = file->dev;
+    struct aesd_circular_buffer *buffer;
     struct aesd_buffer_entry *entry;
     size_t entry_pos = 0;
+    unsigned int seq;
+
+    rcu_read_lock();
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        buffer = aesd_buffer(dev);
+        entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, pos, &entry_pos);
+        if (entry) {
+            file->seq = aesd_circular_buffer_entry_seq(buffer, entry);
+            file->offset = entry_pos;
+        } else {
+            file->seq = buffer->next_seq;
+            file->offset = 0;
+        }
+    } while (read_seqcount_retry(&dev->seq, seq));
+    rcu_read_unlock();
+}
+
+/**
+ * Looks up the entry at the cursor of file without taking dev->lock, and takes
+ * a reference to its payload. Retries while writers modify the buffer. If the
+ * entry was evicted, moves the cursor to the oldest entry and accounts for the
+ * entries lost. Returns NULL if there is no entry at the cursor yet, otherwise
+ * stores the entry size and the position of its start, counted as f_pos is.
+ */
+static struct aesd_payload *aesd_cursor_get(struct aesd_file *file,
+        size_t *entry_size, loff_t *entry_start)
+{
+    struct aesd_dev *dev = file->dev;
+    struct aesd_circular_buffer *buffer;
+    struct aesd_buffer_entry *entry;
+    struct aesd_payload *payload;
+    u64 first_seq;
+    unsigned int seq;
+
+    rcu_read_lock();
+  retry:
+    do {
+        payload = NULL;
+        seq = read_seqcount_begin(&dev->seq);
+        buffer = aesd_buffer(dev);
+        first_seq = aesd_circular_buffer_first_seq(buffer);
+        entry = aesd_circular_buffer_find_entry_for_seq(buffer, max_t(u64, file->seq, first_seq));
+        if (entry) {
+            payload = container_of(entry->buffptr, struct aesd_payload, data);
+            *entry_size = entry->size;
+            *entry_start = entry->offset - buffer->entries[buffer->out_offs].offset;
+        }
+    } while (read_seqcount_retry(&dev->seq, seq));
+
+    // evicted after the lookup, look the oldest entry up again
+    if (payload && !kref_get_unless_zero(&payload->ref)) {
+        goto retry;
+    }
+    // a recycled payload may have been referenced, but only after an eviction
+    if (payload && read_seqcount_retry(&dev->seq, seq)) {
+        aesd_payload_put(payload->data);
+        goto retry;
+    }
+    rcu_read_unlock();
+
+    if (file->seq < first_seq) {
+        PDEBUG("reader lost %llu entries", (unsigned long long) (first_seq - file->seq));
+        file->lost += first_seq - file->seq;
+        this_cpu_add(dev->stats->lost, first_seq - file->seq);
+        file->seq = first_seq;
+        file->offset = 0;
+    }
+
+    return payload;
+}
+
+/**
+ * Returns the total size of the buffer without taking dev->lock.
+ */
+static size_t aesd_buffer_size(struct aesd_dev *dev)
+{
+    unsigned int seq;
+    size_t size;
+
+    rcu_read_lock();
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        size = aesd_circular_buffer_size(aesd_buffer(dev));
+    } while (read_seqcount_retry(&dev->seq, seq));
+    rcu_read_unlock();
+
+    return size;
+}
+
+/**
+ * Returns the sequence number of the next entry without taking dev->lock.
+ */
+static u64 aesd_buffer_next_seq(struct aesd_dev *dev)
+{
+    unsigned int seq;
+    u64 next_seq;
+
+    rcu_read_lock();
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        next_seq = aesd_buffer(dev)->next_seq;
+    } while (read_seqcount_retry(&dev->seq, seq));
+    rcu_read_unlock();
+
+    return next_seq;
+}
+
+/**
+ * Returns true if there is data to read at the cursor of file.
+ */
+static bool aesd_data_ready(struct aesd_file *file)
+{
+    return file->seq < aesd_buffer_next_seq(file->dev);
+}
+
+/**
+ * Copies up to count bytes from the cursor of file, crossing as many entry
+ * boundaries as needed, so that a whole buffer can be read with a single call.
+ * The cursor follows entries by sequence number, so evictions do not shift
+ * it; *pos is updated to match it. The copy callback returns the number of
+ * bytes it copied to the destination.
+ * Returns the number of bytes read, or -EFAULT if nothing could be copied.
+ */
+static ssize_t aesd_read_entries(struct aesd_file *file, loff_t *pos, size_t count,
+        size_t (*copy)(void *dst, size_t done, const char *src, size_t len), void *dst)
+{
+    struct aesd_payload *payload;
+    size_t entry_size = 0;
+    size_t done = 0, len, copied;
+    loff_t entry_start = 0;
     ssize_t retval = 0;
 
+    while (done < count) {
+        // readers do not take dev->lock, they only pin the entry they copy from
+        payload = aesd_cursor_get(file, &entry_size, &entry_start);
+        if (!payload) {
+            // no more data
+            break;
+        }
+
+        // read only up to the end of entry, then move to the next one
+        len = min(count - done, entry_size - file->offset);
+        copied = copy(dst, done, payload->data + file->offset, len);
+        aesd_payload_put(payload->data);
+
+        done += copied;
+        file->offset += copied;
+        *pos = entry_start + file->offset;
+        this_cpu_add(file->dev->stats->bytes_read, copied);
+        if (file->offset == entry_size) {
+            this_cpu_inc(file->dev->stats->lines_read);
+            file->seq++;
+            file->offset = 0;
+        }
+        if (copied < len) {
+            retval = -EFAULT;
+            break;
+        }
+    }
+
+    return done ? done : retval;
+}
+
+static size_t aesd_copy_to_user(void *dst, size_t done, const char *src, size_t len)
+{
+    return len - copy_to_user((char __user *) dst + done, src, len);
+}
+
+static size_t aesd_copy_to_iter(void *dst, size_t done, const char *src, size_t len)
+{
+    return copy_to_iter(src, len, dst);
+}
+
+/**
+ * In follow mode, waits until there is data at the cursor, unless nonblock is
+ * set. Returns 0 if data is available or the file is not in follow mode.
+ */
+static int aesd_wait_data(struct aesd_file *file, bool nonblock)
+{
+    struct aesd_dev *dev = file->dev;
+
+    if (!file->follow || aesd_data_ready(file)) {
+        return 0;
+    }
+    if (nonblock) {
+        return -EAGAIN;
+    }
+    if (wait_event_interruptible(dev->wq, aesd_data_ready(file))) {
+        return -ERESTARTSYS;
+    }
+    return 0;
+}
+
+ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
+                loff_t *f_pos)
+{
+    struct aesd_file *file = filp->private_data;
+    ssize_t retval;
+
     PDEBUG("read %zu bytes with offset %lld",count,*f_pos);
     /**
      * DONE: handle read
      */
-    if (mutex_lock_interruptible(&dev->lock)) {
-        return -ERESTARTSYS;
+    retval = aesd_wait_data(file, filp->f_flags & O_NONBLOCK);
+    if (!retval) {
+        retval = aesd_read_entries(file, f_pos, count, aesd_copy_to_user, (void __force *) buf);
     }
 
-    // find buffer entry and position in entry corresponding to f_pos
-    entry = aesd_circular_buffer_find_entry_offset_for_fpos(dev->buffer, *f_pos, &entry_pos);
-    if (!entry) {
-        // if no suitable pos exists simpy return 0
-        goto finalize;
+    trace_aesd_read(MINOR(file->dev->cdev.dev), count, retval, file->seq, file->offset);
+    return retval;
+}
+
+/**
+ * Vectored read, fills the segments of the iterator across entry boundaries.
+ */
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct aesd_file *file = iocb->ki_filp->private_data;
+
+    bool nonblock = (iocb->ki_flags & IOCB_NOWAIT) || (iocb->ki_filp->f_flags & O_NONBLOCK);
+    size_t count = iov_iter_count(to);
+    ssize_t retval;
+
+    PDEBUG("read_iter %zu bytes with offset %lld", count, iocb->ki_pos);
+
+    retval = aesd_wait_data(file, nonblock);
+    if (!retval) {
+        retval = aesd_read_entries(file, &iocb->ki_pos, count, aesd_copy_to_iter, to);
     }
 
-    // read only up to the end of entry
-    if (count > entry->size - entry_pos) {
-        count = entry->size - entry_pos;
+    trace_aesd_read(MINOR(file->dev->cdev.dev), count, retval, file->seq, file->offset);
+    return retval;
+}
+
+/**
+ * Position in the work in progress entry, to undo appends that follow it.
+ */
+struct aesd_wip_mark
+{
+    struct aesd_wip_chunk *last;
+    size_t used;
+    size_t size;
+};
+
+static void aesd_wip_mark(struct aesd_wip *wip, struct aesd_wip_mark *mark)
+{
+    mark->last = list_empty(&wip->chunks) ? NULL :
+        list_last_entry(&wip->chunks, struct aesd_wip_chunk, list);
+    mark->used = mark->last ? mark->last->used : 0;
+    mark->size = wip->size;
+}
+
+static void aesd_wip_rollback(struct aesd_wip *wip, const struct aesd_wip_mark *mark)
+{
+    struct aesd_wip_chunk *chunk;
+
+    while (!list_empty(&wip->chunks)) {
+        chunk = list_last_entry(&wip->chunks, struct aesd_wip_chunk, list);
+        if (chunk == mark->last) {
+            chunk->used = mark->used;
+            break;
+        }
+        list_del(&chunk->list);
+        kfree(chunk);
     }
+    wip->size = mark->size;
+}
 
-    if (copy_to_user(buf, entry->buffptr + entry_pos, count)) {
-        retval = -EFAULT;
-        goto finalize;
+/**
+ * Appends count bytes from user space to the work in progress entry, filling
+ * the last chunk before allocating new ones. On failure, the caller must roll
+ * back to a mark taken before the call.
+ */
+static int aesd_wip_append(struct aesd_wip *wip, const char __user *buf, size_t count)
+{
+    struct aesd_wip_chunk *chunk = NULL;
+    size_t len;
+
+    if (!list_empty(&wip->chunks)) {
+        chunk = list_last_entry(&wip->chunks, struct aesd_wip_chunk, list);
     }
-    *f_pos += count;
-    retval = count;
 
-  finalize:
-    mutex_unlock(&dev->lock);
-    return retval;
+    while (count > 0) {
+        if (!chunk || chunk->used == AESD_WIP_CHUNK_DATA) {
+            chunk = kmalloc(PAGE_SIZE, GFP_KERNEL);
+            if (!chunk) {
+                return -ENOMEM;
+            }
+            chunk->used = 0;
+            list_add_tail(&chunk->list, &wip->chunks);
+        }
+
+        len = min_t(size_t, count, AESD_WIP_CHUNK_DATA - chunk->used);
+        if (copy_from_user(chunk->data + chunk->used, buf, len)) {
+            return -EFAULT;
+        }
+        chunk->used += len;
+        wip->size += len;
+        buf += len;
+        count -= len;
+    }
+
+    return 0;
+}
+
+/**
+ * Copies the work in progress entry, followed by tail_size bytes of tail, into
+ * a new payload and empties it.
+ * Returns NULL if the payload could not be allocated (the entry is kept).
+ * This is the only copy of partial writes, hence it is linear in the size.
+ */
+static struct aesd_payload *aesd_wip_linearize(struct aesd_wip *wip,
+        const char *tail, size_t tail_size)
+{
+    struct aesd_wip_chunk *chunk, *next;
+    struct aesd_payload *payload;
+    size_t offset = 0;
+
+    payload = aesd_payload_alloc(wip->size + tail_size + 1);
+    if (!payload) {
+        return NULL;
+    }
+
+    list_for_each_entry_safe(chunk, next, &wip->chunks, list) {
+        memcpy(payload->data + offset, chunk->data, chunk->used);
+        offset += chunk->used;
+        list_del(&chunk->list);
+        kfree(chunk);
+    }
+    memcpy(payload->data + offset, tail, tail_size);
+    offset += tail_size;
+    payload->data[offset] = '\0';
+    wip->size = 0;
+
+    return payload;
+}
+
+/**
+ * Counts the newlines appended to the work in progress entry after mark.
+ */
+static size_t aesd_wip_count_lines(struct aesd_wip *wip, const struct aesd_wip_mark *mark)
+{
+    struct aesd_wip_chunk *chunk = mark->last ? mark->last :
+        list_first_entry(&wip->chunks, struct aesd_wip_chunk, list);
+    size_t from = mark->last ? mark->used : 0;
+    size_t nlines = 0;
+
+    list_for_each_entry_from(chunk, &wip->chunks, list) {
+        nlines += aesd_newline_count(chunk->data + from, chunk->used - from);
+        from = 0;
+    }
+    return nlines;
+}
+
+/**
+ * Sets the sizes of entries, at most max, from the newlines of the size bytes
+ * at data, found at offset pos of the written data. *line_start is the offset
+ * of the line being split and is updated.
+ * Returns the number of entries set.
+ */
+static size_t aesd_split_lines(const char *data, size_t size, size_t pos,
+        size_t *line_start, struct aesd_buffer_entry *entries, size_t max)
+{
+    size_t offsets[AESD_SCAN_BATCH];
+    size_t nlines = 0, found, index, from = 0;
+
+    do {
+        found = aesd_newline_scan(data + from, size - from, offsets,
+                                  min_t(size_t, max - nlines, ARRAY_SIZE(offsets)));
+        for (index = 0; index < found; ++index) {
+            entries[nlines++].size = pos + from + offsets[index] + 1 - *line_start;
+            *line_start = pos + from + offsets[index] + 1;
+        }
+        if (found) {
+            from += offsets[found - 1] + 1;
+        }
+    } while (found == ARRAY_SIZE(offsets) && nlines < max);
+
+    return nlines;
+}
+
+/**
+ * Sets the sizes of the first nlines entries to those of the lines completed
+ * by the bytes appended to the work in progress entry after mark. The first
+ * one includes the bytes written before.
+ */
+static void aesd_wip_split_lines(struct aesd_wip *wip, const struct aesd_wip_mark *mark,
+        struct aesd_buffer_entry *entries, size_t nlines)
+{
+    struct aesd_wip_chunk *chunk = mark->last ? mark->last :
+        list_first_entry(&wip->chunks, struct aesd_wip_chunk, list);
+    size_t from = mark->last ? mark->used : 0;
+    size_t pos = mark->size, line_start = 0, index = 0;
+
+    list_for_each_entry_from(chunk, &wip->chunks, list) {
+        if (index == nlines) {
+            break;
+        }
+        index += aesd_split_lines(chunk->data + from, chunk->used - from, pos,
+                                  &line_start, entries + index, nlines - index);
+        pos += chunk->used - from;
+        from = 0;
+    }
+}
+
+/**
+ * Copies the first lines of the work in progress entry into the payloads of
+ * entries, whose sizes are set, walking the chunks once. The entry is left
+ * untouched, see aesd_wip_consume.
+ */
+static void aesd_wip_copy_lines(struct aesd_wip *wip, struct aesd_buffer_entry *entries,
+        size_t nlines)
+{
+    struct aesd_wip_chunk *chunk = list_first_entry(&wip->chunks, struct aesd_wip_chunk, list);
+    size_t index, copied, len, from = 0;
+    char *data;
+
+    for (index = 0; index < nlines; ++index) {
+        data = (char *) entries[index].buffptr;
+        for (copied = 0; copied < entries[index].size; copied += len) {
+            if (from == chunk->used) {
+                chunk = list_next_entry(chunk, list);
+                from = 0;
+            }
+            len = min_t(size_t, entries[index].size - copied, chunk->used - from);
+            memcpy(data + copied, chunk->data + from, len);
+            from += len;
+        }
+        data[copied] = '\0';
+    }
+}
+
+/**
+ * Drops the first size bytes of the work in progress entry. The rest of the
+ * chunk holding the last one is moved to its start, so a write moves at
+ * most one chunk.
+ */
+static void aesd_wip_consume(struct aesd_wip *wip, size_t size)
+{
+    struct aesd_wip_chunk *chunk, *next;
+
+    wip->size -= size;
+    list_for_each_entry_safe(chunk, next, &wip->chunks, list) {
+        if (size < chunk->used) {
+            if (size) {
+                memmove(chunk->data, chunk->data + size, chunk->used - size);
+                chunk->used -= size;
+            }
+            break;
+        }
+        size -= chunk->used;
+        list_del(&chunk->list);
+        kfree(chunk);
+    }
+}
+
+static void aesd_wip_free(struct aesd_wip *wip)
+{
+    struct aesd_wip_chunk *chunk, *next;
+
+    list_for_each_entry_safe(chunk, next, &wip->chunks, list) {
+        list_del(&chunk->list);
+        kfree(chunk);
+    }
+    wip->size = 0;
+}
+
+/**
+ * Allocates the area exposed by mmap and fills in its header. The data ring
+ * holds the whole buffer if its size is capped by the max_bytes parameter,
+ * only the newest bytes otherwise.
+ */
+static int aesd_mmap_init(struct aesd_dev *dev)
+{
+    struct aesd_mmap_header *header;
+    size_t index_size = PAGE_ALIGN(aesd_max_capacity * sizeof(struct aesd_mmap_index));
+    size_t data_size = roundup_pow_of_two(max_t(unsigned long, aesd_max_bytes,
+                                                AESD_MMAP_DATA_SIZE));
+
+    dev->mmap_size = PAGE_SIZE + index_size + data_size;
+    dev->mmap_area = vmalloc_user(dev->mmap_size); // zeroed
+    if (!dev->mmap_area) {
+        return -ENOMEM;
+    }
+
+    header = dev->mmap_area;
+    header->magic = AESD_MMAP_MAGIC;
+    header->version = AESD_MMAP_VERSION;
+    header->max_entries = aesd_max_capacity;
+    header->capacity = aesd_capacity;
+    header->index_offset = PAGE_SIZE;
+    header->data_offset = PAGE_SIZE + index_size;
+    header->data_size = data_size;
+
+    return 0;
 }
 
+/**
+ * Copies the state of the buffer to the mmap header, in a seq section.
+ */
+static void aesd_mmap_header_update(struct aesd_dev *dev)
+{
+    struct aesd_mmap_header *header = dev->mmap_area;
+    struct aesd_circular_buffer *buffer = aesd_buffer(dev);
+
+    header->total_size = aesd_circular_buffer_size(buffer);
+    header->in_offs = buffer->in_offs;
+    header->out_offs = buffer->out_offs;
+    header->full = buffer->full;
+    header->capacity = buffer->capacity;
+}
+
+/**
+ * Mirrors in the mmap area the entry just added to the buffer at slot.
+ * Must be called with dev->lock held.
+ */
+static void aesd_mmap_commit(struct aesd_dev *dev, size_t slot, const struct aesd_buffer_entry *entry)
+{
+    struct aesd_mmap_header *header = dev->mmap_area;
+    struct aesd_mmap_index *index = dev->mmap_area + header->index_offset;
+    char *data = dev->mmap_area + header->data_offset;
+    size_t ring_size = header->data_size;
+    const char *src = entry->buffptr;
+    size_t len = entry->size;
+    size_t start, first;
+    u64 pos = header->head;
+
+    WRITE_ONCE(header->seq, header->seq + 1);
+    smp_wmb();
+
+    // only the tail of entries larger than the ring would survive anyway
+    if (len > ring_size) {
+        pos += len - ring_size;
+        src += len - ring_size;
+        len = ring_size;
+    }
+
+    // copy in at most two segments, wrapping around the end of the ring
+    start = pos & (ring_size - 1);
+    first = min(len, ring_size - start);
+    memcpy(data + start, src, first);
+    memcpy(data, src + first, len - first);
+
+    index[slot].offset = header->head;
+    index[slot].size = entry->size;
+    header->head += entry->size;
+    aesd_mmap_header_update(dev);
+
+    smp_wmb();
+    WRITE_ONCE(header->seq, header->seq + 1);
+}
+
+/**
+ * Rewrites the whole index after the buffer has been replaced. Entries are
+ * contiguous in the data ring, the newest ending at head, so their offsets
+ * are recomputed backwards. Must be called with dev->lock held.
+ */
+static void aesd_mmap_sync(struct aesd_dev *dev)
+{
+    struct aesd_mmap_header *header = dev->mmap_area;
+    struct aesd_mmap_index *index = dev->mmap_area + header->index_offset;
+    struct aesd_circular_buffer *buffer = aesd_buffer(dev);
+    size_t count = aesd_circular_buffer_count(buffer);
+    size_t slot = buffer->in_offs;
+    u64 pos = header->head;
+
+    WRITE_ONCE(header->seq, header->seq + 1);
+    smp_wmb();
+
+    while (count--) {
+        slot = (slot ? slot : buffer->capacity) - 1;
+        pos -= buffer->entries[slot].size;
+        index[slot].offset = pos;
+        index[slot].size = buffer->entries[slot].size;
+    }
+    aesd_mmap_header_update(dev);
+
+    smp_wmb();
+    WRITE_ONCE(header->seq, header->seq + 1);
+}
+
+/**
+ * Maps the header, index and data ring read-only, see aesd_ioctl.h.
+ */
+int aesd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+
+    PDEBUG("mmap");
+
+    if (vma->vm_flags & VM_WRITE) {
+        return -EPERM;
+    }
+
+    // prevent mprotect from making the mapping writable later
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+    return remap_vmalloc_range(vma, dev->mmap_area, vma->vm_pgoff);
+}
+
+/**
+ * Adds entries to the buffer, one per line, then wakes up readers. Must be
+ * called with dev->lock held.
+ */
+static void aesd_commit_lines(struct aesd_dev *dev, struct aesd_buffer_entry *entries,
+        size_t nlines)
+{
+    struct aesd_circular_buffer *buffer = aesd_buffer(dev);
+    const char *oldbuf;
+    size_t index, slot;
+
+    // entries may evict each other, so mirror each in mmap before the next
+    write_seqcount_begin(&dev->seq);
+    for (index = 0; index < nlines; ++index) {
+        slot = buffer->in_offs;
+        oldbuf = aesd_circular_buffer_add_entry(buffer, &entries[index]);
+        aesd_buffer_trim(dev, buffer);
+        aesd_mmap_commit(dev, slot, &entries[index]);
+        // readers still copying from the old entry hold their own reference
+        aesd_buffer_evicted(dev, oldbuf);
+        this_cpu_add(dev->stats->bytes_written, entries[index].size);
+    }
+    this_cpu_add(dev->stats->lines_written, nlines);
+    write_seqcount_end(&dev->seq);
+    wake_up_interruptible(&dev->wq);
+}
+
+/**
+ * Appends to the working entry, then commits each line the write completed
+ * as a separate entry. The bytes following the last newline stay in the
+ * working entry.
+ */
 ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
                 loff_t *f_pos)
 {
-    struct aesd_dev *dev = filp->private_data;
-    struct aesd_buffer_entry *wip_entry = &dev->wip_entry;
-    char* bptr;
-    const char* oldbuf;
-    uint8_t index;
-    
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    struct aesd_wip *wip = &dev->wip;
+    struct aesd_wip_mark mark;
+    struct aesd_buffer_entry stack_entries[AESD_WRITE_LINES];
+    struct aesd_buffer_entry *entries = stack_entries;
+    struct aesd_payload *payload;
+    size_t nlines, index, committed = 0;
+
     ssize_t retval = -ENOMEM;
 
     PDEBUG("write %zu bytes with offset %lld",count,*f_pos);
     /**
      * DONE: handle write
      */
+    if (count == 0) {
+        return 0;
+    }
 
-    if (mutex_lock_interruptible(&dev->lock)) {
+    if (aesd_lock(dev)) {
         return -ERESTARTSYS;
     }
 
-    // expand or allocate working entry buffer to accept new content
-    PDEBUG("alloc %zu(+1) bytes for entry", count + wip_entry->size);
-    bptr = kmalloc(wip_entry->size + count + 1, GFP_KERNEL);
-    if (!bptr) {
-        retval = -ENOMEM;
-        goto finalize;
+    // append to working entry, previously written bytes are not copied
+    aesd_wip_mark(wip, &mark);
+    retval = aesd_wip_append(wip, buf, count);
+    if (retval < 0) {
+        goto rollback;
     }
-    bptr[wip_entry->size + count] = '\0';
-
-    if (wip_entry->buffptr) {
-        memcpy(bptr, wip_entry->buffptr, wip_entry->size);
+    PDEBUG("working entry is %zu bytes", wip->size);
+
+    // payloads of all the completed lines are allocated before committing
+    // any, so that a failure leaves the device as before the write
+    nlines = aesd_wip_count_lines(wip, &mark);
+    if (nlines > AESD_WRITE_LINES) {
+        entries = kvmalloc_array(nlines, sizeof(*entries), GFP_KERNEL);
+        if (!entries) {
+            retval = -ENOMEM;
+            goto rollback;
+        }
     }
-
-    if (copy_from_user(bptr + wip_entry->size, buf, count)) {
-        retval = -EFAULT;
-        goto finalize;
+    aesd_wip_split_lines(wip, &mark, entries, nlines);
+    for (index = 0; index < nlines; ++index) {
+        payload = aesd_payload_alloc(entries[index].size + 1);
+        if (!payload) {
+            retval = -ENOMEM;
+            goto put_entries;
+        }
+        entries[index].buffptr = payload->data;
+        committed += entries[index].size;
     }
 
-    // update working entry
-    kfree(wip_entry->buffptr);
-    wip_entry->buffptr = bptr;
-    wip_entry->size += count;
-
-    // add working entry to buffer and free returned buffer, reset wip_entry
-    if (wip_entry->buffptr[wip_entry->size - 1] == '\n') {
-        PDEBUG("flush entry to buffer: %s", wip_entry->buffptr);
-        oldbuf = aesd_circular_buffer_add_entry(dev->buffer, wip_entry); 
-
-        PDEBUG("free old entry buffer: %s", oldbuf);
-        kfree(oldbuf);
-
-        wip_entry->buffptr = NULL;
-        wip_entry->size = 0;
+    if (nlines) {
+        PDEBUG("flush %zu lines of %zu bytes to buffer", nlines, committed);
+        aesd_wip_copy_lines(wip, entries, nlines);
+        aesd_wip_consume(wip, committed);
+        aesd_commit_lines(dev, entries, nlines);
     }
-    
+
     // Set f_pos to end of buffer, since we appended to end
-    *f_pos = aesd_circular_buffer_size(dev->buffer) - 1;
+    *f_pos = aesd_circular_buffer_size(aesd_buffer(dev)) - 1;
+    aesd_cursor_seek(file, *f_pos);
 
     retval = count;
+    goto free_entries;
 
-  finalize:
+  put_entries:
+    while (index-- > 0) {
+        aesd_payload_put(entries[index].buffptr);
+    }
+    committed = 0;
+  rollback:
+    aesd_wip_rollback(wip, &mark);
+  free_entries:
+    if (entries != stack_entries) {
+        kvfree(entries);
+    }
+    trace_aesd_write(MINOR(dev->cdev.dev), count, wip->size, committed);
     mutex_unlock(&dev->lock);
     return retval;
 }
 
 loff_t aesd_llseek(struct file *filp, loff_t off, int whence)
 {
-    struct aesd_dev *dev = filp->private_data;
-    loff_t buffer_size, new_pos;
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+
+    loff_t retval;
 
     PDEBUG("llseek");
 
-    if (mutex_lock_interruptible(&dev->lock)) {
-        return -ERESTARTSYS;
+    retval = fixed_size_llseek(filp, off, whence, aesd_buffer_size(dev));
+    if (retval >= 0) {
+        aesd_cursor_seek(file, retval);
     }
+    trace_aesd_seek(MINOR(dev->cdev.dev), off, whence, retval);
+    return retval;
+}
 
-    buffer_size = aesd_circular_buffer_size(dev->buffer);
-    new_pos = fixed_size_llseek(filp, off, whence, buffer_size);
-    
-    mutex_unlock(&dev->lock);
-    return new_pos;
+/**
+ * Reports the file readable if there is data past its position. Writes never
+ * block.
+ */
+__poll_t aesd_poll(struct file *filp, poll_table *wait)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+
+    poll_wait(filp, &dev->wq, wait);
+
+    if (aesd_data_ready(file)) {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+
+    return mask;
 }
 
 static long aesd_adjust_file_offset(struct file *filp, unsigned int write_cmd, unsigned int write_cmd_offset)
 {
-    struct aesd_dev *dev = filp->private_data;
-    struct aesd_circular_buffer *buffer = dev->buffer;
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    struct aesd_circular_buffer *buffer;
 
     struct aesd_buffer_entry *entry;
-    uint8_t current_pos, index;
-    size_t offset = 0;
+    size_t offset;
+    u64 target_seq = 0;
+    unsigned int seq;
 
-    long retval = 0;
+    long retval;
 
     PDEBUG("adjust_file_offset to (%d,%d)", write_cmd, write_cmd_offset);
 
-    // check valid write cmd 
-    if (write_cmd >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
-        return -EINVAL;
+    // compute write_cmd entry global offset in bytes, retrying if a writer
+    // modified the buffer meanwhile
+    rcu_read_lock();
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        buffer = aesd_buffer(dev);
+        offset = 0;
+        retval = 0;
+
+        // check valid write cmd, i.e. entry already written
+        if (write_cmd >= aesd_circular_buffer_count(buffer)) {
+            retval = -EINVAL;
+            continue;
+        }
+
+        // previous entries sizes are given by the entry offset, check if
+        // given offset is valid
+        entry = &buffer->entries[aesd_circular_buffer_pos(buffer, write_cmd)];
+        if (write_cmd_offset >= entry->size) { 
+            retval = -EINVAL;
+            continue;
+        }
+        offset = entry->offset - buffer->entries[buffer->out_offs].offset + write_cmd_offset;
+        target_seq = aesd_circular_buffer_entry_seq(buffer, entry);
+    } while (read_seqcount_retry(&dev->seq, seq));
+    rcu_read_unlock();
+
+    // pin the cursor to the entry found, not to its byte offset, which the
+    // next eviction shifts
+    if (!retval) {
+        filp->f_pos = offset;
+        file->seq = target_seq;
+        file->offset = write_cmd_offset;
     }
 
-    if (mutex_lock_interruptible(&dev->lock)) {
-        return -ERESTARTSYS;
+    trace_aesd_seek(MINOR(dev->cdev.dev), offset, SEEK_SET, retval ? retval : offset);
+    return retval;
+}
+
+/**
+ * Commits a batch of newline terminated lines, one entry per line, taking
+ * dev->lock once. Payloads are prepared before taking the lock, except for
+ * the first line which completes the partial write, if any.
+ */
+static long aesd_write_batch(struct file *filp, struct aesd_batch_write *batch)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    struct aesd_buffer_entry *entries = NULL;
+    struct aesd_payload *payload;
+    const char *line, *end;
+    size_t nlines, index, line_start = 0, wip_size;
+    char *data;
+    long retval;
+
+    PDEBUG("write batch of %llu bytes", (unsigned long long) batch->size);
+
+    batch->count = 0;
+    if (batch->size == 0) {
+        return 0;
+    }
+    if (batch->size > AESD_BATCH_MAX_SIZE) {
+        return -E2BIG;
     }
 
-    // compute write_cmd entry global offset in bytes
-    for (index = 0; index <= write_cmd; ++index) {
-        current_pos = (buffer->out_offs + index) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-        entry = &buffer->entry[current_pos];
+    data = kvmalloc(batch->size, GFP_KERNEL);
+    if (!data) {
+        return -ENOMEM;
+    }
+    if (copy_from_user(data, u64_to_user_ptr(batch->data), batch->size)) {
+        retval = -EFAULT;
+        goto free_data;
+    }
+    end = data + batch->size;
+    if (end[-1] != '\n') {
+        retval = -EINVAL;
+        goto free_data;
+    }
 
-        // entry not yet written
-        if (!entry->buffptr) {
-            retval = -EINVAL;
-            goto finalize;
+    nlines = aesd_newline_count(data, batch->size);
+    entries = kvmalloc_array(nlines, sizeof(*entries), GFP_KERNEL);
+    if (!entries) {
+        retval = -ENOMEM;
+        goto free_data;
+    }
+    aesd_split_lines(data, batch->size, 0, &line_start, entries, nlines);
+
+    // first line is done under the lock
+    entries[0].buffptr = NULL;
+    for (index = 1, line = data + entries[0].size; index < nlines; line += entries[index++].size) {
+        payload = aesd_payload_alloc(entries[index].size + 1);
+        if (!payload) {
+            retval = -ENOMEM;
+            goto put_entries;
+        }
+        memcpy(payload->data, line, entries[index].size);
+        payload->data[entries[index].size] = '\0';
+        entries[index].buffptr = payload->data;
+    }
+
+    if (aesd_lock(dev)) {
+        retval = -ERESTARTSYS;
+        goto put_entries;
+    }
+
+    wip_size = dev->wip.size;
+    payload = aesd_wip_linearize(&dev->wip, data, entries[0].size);
+    if (!payload) {
+        mutex_unlock(&dev->lock);
+        retval = -ENOMEM;
+        goto put_entries;
+    }
+    entries[0].size += wip_size;
+    entries[0].buffptr = payload->data;
+
+    aesd_commit_lines(dev, entries, nlines);
+    mutex_unlock(&dev->lock);
+
+    batch->count = nlines;
+    retval = 0;
+    goto free_entries;
+
+  put_entries:
+    while (index-- > 0) {
+        aesd_payload_put(entries[index].buffptr);
+    }
+  free_entries:
+    kvfree(entries);
+  free_data:
+    kvfree(data);
+    return retval;
+}
+
+/**
+ * Reads whole entries from the cursor of file, in follow mode waiting for the
+ * first one as read does. Data is packed in the user buffer and described by
+ * one descriptor per entry; the first one is partial if the file was left in
+ * the middle of an entry.
+ */
+static long aesd_read_batch(struct file *filp, struct aesd_batch_read *batch)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_entry_desc desc;
+    struct aesd_payload *payload;
+    struct aesd_entry_desc __user *descs = u64_to_user_ptr(batch->descs);
+    char __user *data = u64_to_user_ptr(batch->data);
+    size_t entry_size, done = 0, len;
+    loff_t entry_start;
+    long retval;
+
+    PDEBUG("read batch of %u entries", batch->max_entries);
+
+    batch->count = 0;
+    batch->size = 0;
+
+    retval = aesd_wait_data(file, filp->f_flags & O_NONBLOCK);
+    if (retval) {
+        return retval;
+    }
+
+    while (batch->count < batch->max_entries) {
+        payload = aesd_cursor_get(file, &entry_size, &entry_start);
+        if (!payload) {
+            break;
         }
 
-        if (index != write_cmd) { // previous entry, add size to offset
-            offset += entry->size;
-        } else { // requested entry, check if given offset is valid
-            if (write_cmd_offset >= entry->size) { 
-                retval = -EINVAL;
-                goto finalize;
+        len = entry_size - file->offset;
+        if (len > batch->data_size - done) {
+            aesd_payload_put(payload->data);
+            // not even one entry fits, let the caller know
+            if (!batch->count) {
+                retval = -EMSGSIZE;
             }
-            offset += write_cmd_offset;
+            break;
+        }
+
+        desc.seq = file->seq;
+        desc.size = len;
+        if (copy_to_user(data + done, payload->data + file->offset, len) ||
+            copy_to_user(&descs[batch->count], &desc, sizeof(desc))) {
+            aesd_payload_put(payload->data);
+            retval = -EFAULT;
+            break;
         }
+        aesd_payload_put(payload->data);
+
+        done += len;
+        this_cpu_add(file->dev->stats->bytes_read, len);
+        this_cpu_inc(file->dev->stats->lines_read);
+        batch->count++;
+        file->seq++;
+        file->offset = 0;
+        filp->f_pos = entry_start + entry_size;
     }
+    batch->size = done;
 
-    filp->f_pos = offset;
+    return batch->count ? 0 : retval;
+}
+
+/**
+ * Applies a new eviction policy. Entries are moved to a new buffer if the
+ * capacity changes, the newest ones first if they do not all fit.
+ */
+static long aesd_resize(struct file *filp, struct aesd_resize *resize)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    struct aesd_circular_buffer *buffer, *new_buffer = NULL;
+    struct aesd_buffer_entry *entry;
+    size_t count, index;
 
-  finalize:
+    PDEBUG("resize to %u entries, %llu bytes", resize->capacity,
+           (unsigned long long) resize->max_bytes);
+
+    if (resize->capacity > aesd_max_capacity) {
+        return -EINVAL;
+    }
+    if (resize->capacity && !(filp->f_mode & FMODE_WRITE)) {
+        return -EBADF;
+    }
+
+    // allocate before taking the lock, capacity may be large
+    if (resize->capacity) {
+        new_buffer = aesd_buffer_alloc(resize->capacity);
+        if (!new_buffer) {
+            return -ENOMEM;
+        }
+    }
+
+    if (aesd_lock(dev)) {
+        aesd_buffer_free(new_buffer);
+        return -ERESTARTSYS;
+    }
+    buffer = aesd_buffer(dev);
+
+    if (!resize->capacity) {
+        resize->capacity = buffer->capacity;
+        resize->max_bytes = dev->max_bytes;
+        mutex_unlock(&dev->lock);
+        return 0;
+    }
+
+    write_seqcount_begin(&dev->seq);
+    dev->max_bytes = resize->max_bytes;
+
+    // keep numbering entries where the old buffer did, for reader cursors
+    new_buffer->next_seq = aesd_circular_buffer_first_seq(buffer);
+
+    // evict what does not fit, then move the rest in order
+    count = aesd_circular_buffer_count(buffer);
+    while (count-- > new_buffer->capacity) {
+        aesd_buffer_evicted(dev, aesd_circular_buffer_remove_oldest(buffer));
+    }
+    index = buffer->out_offs;
+    for (count = aesd_circular_buffer_count(buffer); count > 0; --count) {
+        entry = &buffer->entries[index];
+        aesd_circular_buffer_add_entry(new_buffer, entry);
+        if (++index == buffer->capacity) {
+            index = 0;
+        }
+    }
+    aesd_buffer_trim(dev, new_buffer);
+    rcu_assign_pointer(dev->buffer, new_buffer);
+    write_seqcount_end(&dev->seq);
+
+    aesd_mmap_sync(dev);
     mutex_unlock(&dev->lock);
-    return retval;
+
+    // lockless readers may still be walking the old buffer
+    synchronize_rcu();
+    aesd_buffer_free(buffer);
+
+    return 0;
 }
 
 long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
-    struct aesd_dev *def = filp->private_data;
+    struct aesd_file *file = filp->private_data;
     long retval;
 
     PDEBUG("ioctl");
@@ -248,6 +1348,59 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
             retval = aesd_adjust_file_offset(filp, seekto.write_cmd, seekto.write_cmd_offset);
             break;
 
+        case AESDCHAR_IOCRESIZE:
+            struct aesd_resize resize;
+            if (copy_from_user(&resize, (const void __user *) arg, sizeof(resize))) {
+                return -EFAULT;
+            }
+            retval = aesd_resize(filp, &resize);
+            if (!retval && copy_to_user((void __user *) arg, &resize, sizeof(resize))) {
+                return -EFAULT;
+            }
+            break;
+
+        case AESDCHAR_IOCCURSOR:
+            struct aesd_cursor cursor;
+            cursor.seq = file->seq;
+            cursor.offset = file->offset;
+            cursor.lost = file->lost;
+            cursor.next_seq = aesd_buffer_next_seq(file->dev);
+            if (copy_to_user((void __user *) arg, &cursor, sizeof(cursor))) {
+                return -EFAULT;
+            }
+            retval = 0;
+            break;
+
+        case AESDCHAR_IOCWRITEBATCH:
+            struct aesd_batch_write batch_write;
+            if (!(filp->f_mode & FMODE_WRITE)) {
+                return -EBADF;
+            }
+            if (copy_from_user(&batch_write, (const void __user *) arg, sizeof(batch_write))) {
+                return -EFAULT;
+            }
+            retval = aesd_write_batch(filp, &batch_write);
+            if (!retval && copy_to_user((void __user *) arg, &batch_write, sizeof(batch_write))) {
+                return -EFAULT;
+            }
+            break;
+
+        case AESDCHAR_IOCREADBATCH:
+            struct aesd_batch_read batch_read;
+            if (copy_from_user(&batch_read, (const void __user *) arg, sizeof(batch_read))) {
+                return -EFAULT;
+            }
+            retval = aesd_read_batch(filp, &batch_read);
+            if (!retval && copy_to_user((void __user *) arg, &batch_read, sizeof(batch_read))) {
+                return -EFAULT;
+            }
+            break;
+
+        case AESDCHAR_IOCFOLLOW:
+            file->follow = arg != 0;
+            retval = 0;
+            break;
+
         default:
             return -ENOTTY;
     }
@@ -260,33 +1413,122 @@ struct file_operations aesd_fops = {
     .open =     aesd_open,
     .release =  aesd_release,
     .read =     aesd_read,
+    .read_iter = aesd_read_iter,
     .write =    aesd_write,
     .llseek =   aesd_llseek,
     .unlocked_ioctl = aesd_ioctl,
+    .mmap =     aesd_mmap,
+    .poll =     aesd_poll,
 };
 
-static int aesd_setup_cdev(struct aesd_dev *dev)
+/**
+ * Shows the counters of a device, in debugfs at aesdchar/aesdchar<minor>/stats.
+ */
+static int aesd_stats_show(struct seq_file *s, void *unused)
+{
+    struct aesd_dev *dev = s->private;
+    struct aesd_stats sum = { 0 }, *stats;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        stats = per_cpu_ptr(dev->stats, cpu);
+        sum.bytes_written += READ_ONCE(stats->bytes_written);
+        sum.lines_written += READ_ONCE(stats->lines_written);
+        sum.bytes_read += READ_ONCE(stats->bytes_read);
+        sum.lines_read += READ_ONCE(stats->lines_read);
+        sum.evictions += READ_ONCE(stats->evictions);
+        sum.lost += READ_ONCE(stats->lost);
+        sum.contended += READ_ONCE(stats->contended);
+    }
+
+    seq_printf(s, "bytes_written %llu\n", sum.bytes_written);
+    seq_printf(s, "lines_written %llu\n", sum.lines_written);
+    seq_printf(s, "bytes_read %llu\n", sum.bytes_read);
+    seq_printf(s, "lines_read %llu\n", sum.lines_read);
+    seq_printf(s, "evictions %llu\n", sum.evictions);
+    seq_printf(s, "lost %llu\n", sum.lost);
+    seq_printf(s, "contended %llu\n", sum.contended);
+    seq_printf(s, "wip_size %zu\n", READ_ONCE(dev->wip.size));
+    seq_printf(s, "buffer_size %zu\n", aesd_buffer_size(dev));
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(aesd_stats);
+
+static int aesd_setup_cdev(struct aesd_dev *dev, unsigned int index)
 {
-    int err, devno = MKDEV(aesd_major, aesd_minor);
+    int err, devno = MKDEV(aesd_major, aesd_minor + index);
 
     cdev_init(&dev->cdev, &aesd_fops);
     dev->cdev.owner = THIS_MODULE;
     dev->cdev.ops = &aesd_fops;
     err = cdev_add (&dev->cdev, devno, 1);
     if (err) {
-        printk(KERN_ERR "Error %d adding aesd cdev", err);
+        printk(KERN_ERR "Error %d adding aesd cdev %u", err, index);
     }
     return err;
 }
 
+/**
+ * Initializes the AESD specific portion of a device.
+ */
+static int aesd_dev_init(struct aesd_dev *dev)
+{
+    dev->max_bytes = aesd_max_bytes;
+
+    dev->stats = alloc_percpu(struct aesd_stats);
+    if (!dev->stats) {
+        return -ENOMEM;
+    }
+    dev->buffer = aesd_buffer_alloc(aesd_capacity);
+    if (!dev->buffer) {
+        printk(KERN_ERR "Could not allocate circular buffer");
+        free_percpu(dev->stats);
+        return -ENOMEM;
+    }
+    if (aesd_mmap_init(dev)) {
+        printk(KERN_ERR "Could not allocate mmap area");
+        aesd_buffer_free(dev->buffer);
+        free_percpu(dev->stats);
+        return -ENOMEM;
+    }
+    mutex_init(&dev->lock);
+    INIT_LIST_HEAD(&dev->wip.chunks);
+    init_waitqueue_head(&dev->wq);
+    seqcount_mutex_init(&dev->seq, &dev->lock);
+
+    return 0;
+}
+
+static void aesd_dev_cleanup(struct aesd_dev *dev)
+{
+    struct aesd_buffer_entry *entry;
+    size_t index;
+
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, dev->buffer, index){
+        aesd_payload_put(entry->buffptr);
+    }
+    aesd_buffer_free(dev->buffer);
 
+    aesd_wip_free(&dev->wip);
+    vfree(dev->mmap_area);
+    free_percpu(dev->stats);
+}
 
 int aesd_init_module(void)
 {
     dev_t dev = 0;
+    unsigned int index;
+    char name[24];
     int result;
 
-    result = alloc_chrdev_region(&dev, aesd_minor, 1,
+    if (!aesd_nr_devices || !aesd_capacity) {
+        printk(KERN_ERR "Number of devices and capacity must not be zero");
+        return -EINVAL;
+    }
+    aesd_max_capacity = max(aesd_max_capacity, aesd_capacity);
+
+    result = alloc_chrdev_region(&dev, aesd_minor, aesd_nr_devices,
             "aesdchar");
     aesd_major = MAJOR(dev);
     if (result < 0) {
@@ -294,52 +1536,80 @@ int aesd_init_module(void)
         return result;
     }
 
-    memset(&aesd_device,0,sizeof(struct aesd_dev));
-
     /**
      * DONE: initialize the AESD specific portion of the device
      */
-    aesd_device.buffer = kmalloc(sizeof(struct aesd_circular_buffer), GFP_KERNEL);
-    if (!aesd_device.buffer) {
-        printk(KERN_ERR "Could not allocate circular buffer");
-        return -ENOMEM;
+    aesd_payload_cache = kmem_cache_create("aesd_payload", AESD_PAYLOAD_CACHED, 0,
+                                           SLAB_TYPESAFE_BY_RCU, NULL);
+    if (!aesd_payload_cache) {
+        printk(KERN_ERR "Could not create payload cache");
+        result = -ENOMEM;
+        goto unregister;
+    }
+
+    aesd_devices = kcalloc(aesd_nr_devices, sizeof(struct aesd_dev), GFP_KERNEL);
+    if (!aesd_devices) {
+        result = -ENOMEM;
+        goto destroy_cache;
     }
-    aesd_circular_buffer_init(aesd_device.buffer);
-    mutex_init(&aesd_device.lock);
 
-    result = aesd_setup_cdev(&aesd_device);
-    if( result ) {
-        unregister_chrdev_region(dev, 1);
+    // debugfs is best effort, failures are not checked
+    aesd_debugfs_root = debugfs_create_dir("aesdchar", NULL);
+
+    for (index = 0; index < aesd_nr_devices; ++index) {
+        result = aesd_dev_init(&aesd_devices[index]);
+        if (result) {
+            goto cleanup_devices;
+        }
+        result = aesd_setup_cdev(&aesd_devices[index], index);
+        if (result) {
+            aesd_dev_cleanup(&aesd_devices[index]);
+            goto cleanup_devices;
+        }
+
+        snprintf(name, sizeof(name), "aesdchar%u", index);
+        aesd_devices[index].debugfs = debugfs_create_dir(name, aesd_debugfs_root);
+        debugfs_create_file("stats", 0444, aesd_devices[index].debugfs,
+                            &aesd_devices[index], &aesd_stats_fops);
     }
+
+    return 0;
+
+  cleanup_devices:
+    debugfs_remove_recursive(aesd_debugfs_root);
+    while (index-- > 0) {
+        cdev_del(&aesd_devices[index].cdev);
+        aesd_dev_cleanup(&aesd_devices[index]);
+    }
+    kfree(aesd_devices);
+  destroy_cache:
+    aesd_payload_pool_free();
+    kmem_cache_destroy(aesd_payload_cache);
+  unregister:
+    unregister_chrdev_region(dev, aesd_nr_devices);
     return result;
 }
 
 void aesd_cleanup_module(void)
 {
-    struct aesd_buffer_entry *entry;
-    uint8_t index;
-
     dev_t devno = MKDEV(aesd_major, aesd_minor);
-
-    cdev_del(&aesd_device.cdev);
+    unsigned int index;
 
     /**
      * DONE: cleanup AESD specific poritions here as necessary
      */
-    if (aesd_device.buffer) {
-        AESD_CIRCULAR_BUFFER_FOREACH(entry, aesd_device.buffer, index){
-            if (entry->buffptr) {
-                kfree(entry->buffptr);
-            }
-        }
-        kfree(aesd_device.buffer);
+    debugfs_remove_recursive(aesd_debugfs_root);
+    for (index = 0; index < aesd_nr_devices; ++index) {
+        cdev_del(&aesd_devices[index].cdev);
+        aesd_dev_cleanup(&aesd_devices[index]);
     }
+    kfree(aesd_devices);
 
-    if (aesd_device.wip_entry.buffptr) {
-        kfree(aesd_device.wip_entry.buffptr);
-    }
+    // waits for the grace period of released payloads
+    aesd_payload_pool_free();
+    kmem_cache_destroy(aesd_payload_cache);
 
-    unregister_chrdev_region(devno, 1);
+    unregister_chrdev_region(devno, aesd_nr_devices);
 }
 
 
@@ -0,0 +1,225 @@
+/*
+ * aesd-bench.c
+ *
+ *  @brief Multithreaded benchmark of the aesdchar driver built in userspace.
+ *  Writer threads append lines of a fixed size to the devices, round robin,
+ *  while reader threads follow them from the oldest entry, for a given time.
+ *  Reports throughput, and the entries readers lost to eviction.
+ *
+ *  Usage: aesd-bench [-w writers] [-r readers] [-d seconds] [-s line size]
+ *                    [-c capacity] [-D devices]
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aesd-uspace.h"
+#include "aesdchar.h"
+#include "aesd_ioctl.h"
+
+#define BENCH_READ_SIZE (64 * 1024)
+
+//
+// Declarations of objects with external linkage defined in other source files.
+//
+// ...main.c
+extern struct aesd_dev *aesd_devices;
+void aesd_param_devices(unsigned long);
+void aesd_param_capacity(unsigned long);
+int aesd_init_module(void);
+void aesd_cleanup_module(void);
+int aesd_open(struct inode *, struct file *);
+int aesd_release(struct inode *, struct file *);
+ssize_t aesd_read(struct file *, char *, size_t, loff_t *);
+ssize_t aesd_write(struct file *, const char *, size_t, loff_t *);
+long aesd_ioctl(struct file *, unsigned int, unsigned long);
+
+struct bench_thread {
+    pthread_t thread;
+    unsigned int index;
+    struct inode inode;
+    struct file filp;
+    unsigned long long ops;
+    unsigned long long bytes;
+    unsigned long long lost;
+};
+
+static unsigned int line_size = 64;
+static unsigned int nr_devices = 1;
+static volatile bool stop;
+
+static int bench_open(struct bench_thread *t, unsigned int minor)
+{
+    t->inode.i_cdev = &aesd_devices[minor].cdev;
+    t->filp.f_mode = FMODE_READ | FMODE_WRITE;
+    return aesd_open(&t->inode, &t->filp);
+}
+
+static void* bench_writer(void *arg)
+{
+    struct bench_thread *t = arg;
+    struct bench_thread files[nr_devices];
+    char *line = malloc(line_size);
+
+    if (!line) {
+        perror("malloc");
+        return NULL;
+    }
+    memset(line, 'a' + t->index % 26, line_size - 1);
+    line[line_size - 1] = '\n';
+
+    for (unsigned int minor = 0; minor < nr_devices; ++minor) {
+        memset(&files[minor], 0, sizeof(files[minor]));
+        bench_open(&files[minor], minor);
+    }
+
+    for (unsigned int minor = t->index % nr_devices; !stop; minor = (minor + 1) % nr_devices) {
+        ssize_t ret = aesd_write(&files[minor].filp, line, line_size, &files[minor].filp.f_pos);
+        if (ret < 0) {
+            fprintf(stderr, "aesd_write: %s\n", strerror(-ret));
+            break;
+        }
+        t->ops++;
+        t->bytes += ret;
+    }
+
+    for (unsigned int minor = 0; minor < nr_devices; ++minor) {
+        aesd_release(&files[minor].inode, &files[minor].filp);
+    }
+    free(line);
+    return NULL;
+}
+
+static void* bench_reader(void *arg)
+{
+    struct bench_thread *t = arg;
+    struct aesd_cursor cursor;
+    char *buf = malloc(BENCH_READ_SIZE);
+
+    if (!buf) {
+        perror("malloc");
+        return NULL;
+    }
+    bench_open(t, t->index % nr_devices);
+    t->filp.f_flags = O_NONBLOCK;
+    aesd_ioctl(&t->filp, AESDCHAR_IOCFOLLOW, 1);
+
+    while (!stop) {
+        ssize_t ret = aesd_read(&t->filp, buf, BENCH_READ_SIZE, &t->filp.f_pos);
+        if (ret == -EAGAIN) {
+            sched_yield();
+            continue;
+        }
+        if (ret < 0) {
+            fprintf(stderr, "aesd_read: %s\n", strerror(-ret));
+            break;
+        }
+        t->ops++;
+        t->bytes += ret;
+    }
+
+    if (!aesd_ioctl(&t->filp, AESDCHAR_IOCCURSOR, (unsigned long) &cursor)) {
+        t->lost = cursor.lost;
+    }
+    aesd_release(&t->inode, &t->filp);
+    free(buf);
+    return NULL;
+}
+
+static double elapsed(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int nr_writers = 1, nr_readers = 1, seconds = 2;
+    struct bench_thread *threads;
+    struct timespec start;
+    unsigned long long writes = 0, written = 0, reads = 0, read = 0, lost = 0;
+    double secs;
+    int opt, result;
+
+    while ((opt = getopt(argc, argv, "w:r:d:s:c:D:")) != -1) {
+        switch (opt) {
+            case 'w': nr_writers = strtoul(optarg, NULL, 10); break;
+            case 'r': nr_readers = strtoul(optarg, NULL, 10); break;
+            case 'd': seconds = strtoul(optarg, NULL, 10); break;
+            case 's': line_size = strtoul(optarg, NULL, 10); break;
+            case 'c': aesd_param_capacity(strtoul(optarg, NULL, 10)); break;
+            case 'D': nr_devices = strtoul(optarg, NULL, 10); break;
+            default:
+                fprintf(stderr, "Usage: %s [-w writers] [-r readers] [-d seconds] "
+                        "[-s line size] [-c capacity] [-D devices]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (!line_size || !nr_devices) {
+        fprintf(stderr, "Line size and number of devices must not be zero\n");
+        return EXIT_FAILURE;
+    }
+    aesd_param_devices(nr_devices);
+
+    result = aesd_init_module();
+    if (result) {
+        fprintf(stderr, "aesd_init_module: %s\n", strerror(-result));
+        return EXIT_FAILURE;
+    }
+
+    threads = calloc(nr_writers + nr_readers, sizeof(*threads));
+    if (!threads) {
+        perror("calloc");
+        aesd_cleanup_module();
+        return EXIT_FAILURE;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned int i = 0; i < nr_writers + nr_readers; ++i) {
+        threads[i].index = i < nr_writers ? i : i - nr_writers;
+        result = pthread_create(&threads[i].thread, NULL,
+                                i < nr_writers ? bench_writer : bench_reader, &threads[i]);
+        if (result) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(result));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    sleep(seconds);
+    stop = true;
+    for (unsigned int i = 0; i < nr_writers + nr_readers; ++i) {
+        // Readers are nonblocking, so every thread notices stop
+        pthread_join(threads[i].thread, NULL);
+    }
+    secs = elapsed(&start);
+
+    for (unsigned int i = 0; i < nr_writers; ++i) {
+        writes += threads[i].ops;
+        written += threads[i].bytes;
+    }
+    for (unsigned int i = nr_writers; i < nr_writers + nr_readers; ++i) {
+        reads += threads[i].ops;
+        read += threads[i].bytes;
+        lost += threads[i].lost;
+    }
+
+    printf("writers %u readers %u devices %u line size %u, %.2f s\n",
+           nr_writers, nr_readers, nr_devices, line_size, secs);
+    printf("writes    %12.0f /s  %10.2f MB/s\n", writes / secs, written / secs / 1e6);
+    printf("reads     %12.0f /s  %10.2f MB/s\n", reads / secs, read / secs / 1e6);
+    printf("lost      %12llu entries\n", lost);
+
+    free(threads);
+    aesd_cleanup_module();
+    return EXIT_SUCCESS;
+}
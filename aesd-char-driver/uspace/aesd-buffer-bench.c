@@ -0,0 +1,414 @@
+/*
+ * aesd-buffer-bench.c
+ *
+ *  @brief Micro-benchmark of the aesd_circular_buffer operations. Measures
+ *  add_entry (in steady state, evicting), find_entry_offset_for_fpos (with
+ *  sequential and random positions) and size, for several capacities and
+ *  entry size distributions. For the byte ring storage mode, measures
+ *  add_bytes, and reading the whole history with bulk copies, against reading
+ *  it entry by entry from separately allocated payloads. Reports ns/op, and
+ *  cache misses and instructions per op from perf_event_open when the
+ *  counters are available (see /proc/sys/kernel/perf_event_paranoid), "-"
+ *  otherwise.
+ *
+ *  Usage: aesd-buffer-bench [-n ops] [-c capacity]
+ */
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aesd-circular-buffer.h"
+
+#define BENCH_POSITIONS 65536 // precomputed fpos, a power of two
+#define BENCH_MAX_ENTRY 4096
+#define BENCH_RING_PER_ENTRY 512 // ring bytes per entry of capacity
+#define BENCH_READ_CHUNK (64 * 1024) // bytes per bulk copy, as a read call
+
+static const size_t capacities[] = { 10, 64, 1024, 65536 };
+
+struct bench_dist {
+    const char *name;
+    size_t (*size)(void);
+};
+
+struct bench_counters {
+    int misses_fd;
+    int instructions_fd;
+};
+
+struct bench_result {
+    double ns;
+    double misses;
+    double instructions;
+};
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+static char payload[BENCH_MAX_ENTRY];
+static size_t positions[BENCH_POSITIONS];
+static volatile size_t sink;
+
+static uint64_t rng(void)
+{
+    // xorshift64
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static size_t size_fixed(void)
+{
+    return 64;
+}
+
+static size_t size_uniform(void)
+{
+    return 1 + rng() % 512;
+}
+
+static size_t size_skewed(void)
+{
+    // mostly short lines, with the occasional large one
+    return rng() % 10 ? 32 : BENCH_MAX_ENTRY;
+}
+
+static const struct bench_dist dists[] = {
+    { "fixed64", size_fixed },
+    { "uniform", size_uniform },
+    { "skewed", size_skewed },
+};
+
+static int perf_open(uint32_t type, uint64_t config)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void perf_start(int fd)
+{
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+static double perf_stop(int fd, size_t ops)
+{
+    uint64_t count;
+
+    if (fd < 0) {
+        return -1;
+    }
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+        return -1;
+    }
+    return (double) count / ops;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bench_begin(struct bench_counters *counters, uint64_t *start)
+{
+    perf_start(counters->misses_fd);
+    perf_start(counters->instructions_fd);
+    *start = now_ns();
+}
+
+static void bench_end(struct bench_counters *counters, uint64_t start, size_t ops,
+                      struct bench_result *result)
+{
+    result->ns = (double) (now_ns() - start) / ops;
+    result->misses = perf_stop(counters->misses_fd, ops);
+    result->instructions = perf_stop(counters->instructions_fd, ops);
+}
+
+static void add_entries(struct aesd_circular_buffer *buffer, const struct bench_dist *dist,
+                        size_t count)
+{
+    struct aesd_buffer_entry entry = { .buffptr = payload };
+
+    while (count-- > 0) {
+        entry.size = dist->size();
+        sink += (size_t) aesd_circular_buffer_add_entry(buffer, &entry);
+    }
+}
+
+static void add_entries_ring(struct aesd_circular_buffer *buffer, const struct bench_dist *dist,
+                             size_t count)
+{
+    while (count-- > 0) {
+        aesd_circular_buffer_add_bytes(buffer, payload, dist->size());
+    }
+}
+
+static void bench_add(struct aesd_circular_buffer *buffer, const struct bench_dist *dist,
+                      size_t ops, struct bench_counters *counters, struct bench_result *result)
+{
+    static size_t sizes[BENCH_POSITIONS];
+    struct aesd_buffer_entry entry = { .buffptr = payload };
+    uint64_t start;
+
+    // sizes are drawn beforehand, not to time the generator
+    for (size_t i = 0; i < BENCH_POSITIONS; ++i) {
+        sizes[i] = dist->size();
+    }
+
+    bench_begin(counters, &start);
+    for (size_t i = 0; i < ops; ++i) {
+        entry.size = sizes[i & (BENCH_POSITIONS - 1)];
+        sink += (size_t) aesd_circular_buffer_add_entry(buffer, &entry);
+    }
+    bench_end(counters, start, ops, result);
+}
+
+static void bench_add_bytes(struct aesd_circular_buffer *buffer, const struct bench_dist *dist,
+                            size_t ops, struct bench_counters *counters,
+                            struct bench_result *result)
+{
+    static size_t sizes[BENCH_POSITIONS];
+    uint64_t start;
+
+    for (size_t i = 0; i < BENCH_POSITIONS; ++i) {
+        sizes[i] = dist->size();
+    }
+
+    bench_begin(counters, &start);
+    for (size_t i = 0; i < ops; ++i) {
+        sink += aesd_circular_buffer_add_bytes(buffer, payload, sizes[i & (BENCH_POSITIONS - 1)]);
+    }
+    bench_end(counters, start, ops, result);
+}
+
+/**
+ * Fills a buffer of the pointer storage mode with payloads allocated one by
+ * one, as the driver does.
+ */
+static void add_allocated(struct aesd_circular_buffer *buffer, const struct bench_dist *dist,
+                          size_t count)
+{
+    struct aesd_buffer_entry entry;
+    char *data;
+
+    while (count-- > 0) {
+        entry.size = dist->size();
+        data = malloc(entry.size);
+        if (!data) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        memset(data, 'a', entry.size);
+        entry.buffptr = data;
+        free((char *) aesd_circular_buffer_add_entry(buffer, &entry));
+    }
+}
+
+/**
+ * Reads the whole history of buffer, at least ops entries in total, either
+ * entry by entry or with bulk copies from the ring. Results are per entry.
+ */
+static void bench_read(struct aesd_circular_buffer *buffer, size_t ops,
+                       struct bench_counters *counters, struct bench_result *result)
+{
+    size_t count = aesd_circular_buffer_count(buffer);
+    size_t total = aesd_circular_buffer_size(buffer);
+    size_t rounds = ops / count + 1;
+    struct aesd_buffer_entry *entry;
+    char *dst = malloc(total);
+    uint64_t start;
+
+    if (!dst) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    bench_begin(counters, &start);
+    for (size_t round = 0; round < rounds; ++round) {
+        if (buffer->ring) {
+            for (size_t done = 0; done < total; ) {
+                done += aesd_circular_buffer_copy(buffer, done, dst + done, BENCH_READ_CHUNK);
+            }
+        } else {
+            for (size_t i = 0, done = 0; i < count; ++i) {
+                entry = &buffer->entries[aesd_circular_buffer_pos(buffer, i)];
+                memcpy(dst + done, entry->buffptr, entry->size);
+                done += entry->size;
+            }
+        }
+        sink += dst[round % total];
+    }
+    bench_end(counters, start, rounds * count, result);
+
+    free(dst);
+}
+
+static void bench_find(struct aesd_circular_buffer *buffer, size_t ops,
+                       struct bench_counters *counters, struct bench_result *result)
+{
+    struct aesd_buffer_entry *entry;
+    size_t entry_offset;
+    uint64_t start;
+
+    bench_begin(counters, &start);
+    for (size_t i = 0; i < ops; ++i) {
+        entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer,
+                    positions[i & (BENCH_POSITIONS - 1)], &entry_offset);
+        sink += (size_t) entry + entry_offset;
+    }
+    bench_end(counters, start, ops, result);
+}
+
+static void bench_size(struct aesd_circular_buffer *buffer, size_t ops,
+                       struct bench_counters *counters, struct bench_result *result)
+{
+    uint64_t start;
+
+    bench_begin(counters, &start);
+    for (size_t i = 0; i < ops; ++i) {
+        sink += aesd_circular_buffer_size(buffer);
+        __asm__ volatile("" ::: "memory"); // size must be read again
+    }
+    bench_end(counters, start, ops, result);
+}
+
+static void print_result(const char *op, size_t capacity, const char *dist,
+                         const struct bench_result *result)
+{
+    printf("%-12s %9zu %-8s %10.2f", op, capacity, dist, result->ns);
+    if (result->misses >= 0) {
+        printf(" %12.4f", result->misses);
+    } else {
+        printf(" %12s", "-");
+    }
+    if (result->instructions >= 0) {
+        printf(" %12.1f\n", result->instructions);
+    } else {
+        printf(" %12s\n", "-");
+    }
+}
+
+static void bench_capacity(size_t capacity, size_t ops, struct bench_counters *counters)
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry *entries, *entry;
+    struct bench_result result;
+    size_t total, index, ring_size = 1;
+    char *ring;
+
+    while (ring_size < capacity * BENCH_RING_PER_ENTRY) {
+        ring_size <<= 1;
+    }
+    entries = calloc(capacity, sizeof(*entries));
+    ring = malloc(ring_size);
+    if (!entries || !ring) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t d = 0; d < sizeof(dists) / sizeof(dists[0]); ++d) {
+        aesd_circular_buffer_init_storage(&buffer, entries, capacity);
+
+        // fill first, so that every timed add evicts as in steady state
+        add_entries(&buffer, &dists[d], capacity);
+        bench_add(&buffer, &dists[d], ops, counters, &result);
+        print_result("add_entry", capacity, dists[d].name, &result);
+
+        total = aesd_circular_buffer_size(&buffer);
+
+        // a reader going through the whole buffer, one line at a time
+        for (size_t i = 0, pos = 0; i < BENCH_POSITIONS; ++i) {
+            positions[i] = pos;
+            pos = (pos + 80) % total;
+        }
+        bench_find(&buffer, ops, counters, &result);
+        print_result("find_seq", capacity, dists[d].name, &result);
+
+        for (size_t i = 0; i < BENCH_POSITIONS; ++i) {
+            positions[i] = rng() % total;
+        }
+        bench_find(&buffer, ops, counters, &result);
+        print_result("find_random", capacity, dists[d].name, &result);
+
+        bench_size(&buffer, ops, counters, &result);
+        print_result("size", capacity, dists[d].name, &result);
+
+        aesd_circular_buffer_init_storage(&buffer, entries, capacity);
+        add_allocated(&buffer, &dists[d], capacity);
+        bench_read(&buffer, ops, counters, &result);
+        print_result("read_entries", capacity, dists[d].name, &result);
+        AESD_CIRCULAR_BUFFER_FOREACH(entry, &buffer, index) {
+            free((char *) entry->buffptr);
+        }
+
+        aesd_circular_buffer_init_ring(&buffer, entries, capacity, ring, ring_size);
+        add_entries_ring(&buffer, &dists[d], capacity);
+        bench_add_bytes(&buffer, &dists[d], ops, counters, &result);
+        print_result("add_bytes", capacity, dists[d].name, &result);
+        bench_read(&buffer, ops, counters, &result);
+        print_result("read_ring", capacity, dists[d].name, &result);
+    }
+
+    free(ring);
+    free(entries);
+}
+
+int main(int argc, char **argv)
+{
+    struct bench_counters counters;
+    size_t ops = 1000000, capacity = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:c:")) != -1) {
+        switch (opt) {
+            case 'n': ops = strtoul(optarg, NULL, 10); break;
+            case 'c': capacity = strtoul(optarg, NULL, 10); break;
+            default:
+                fprintf(stderr, "Usage: %s [-n ops] [-c capacity]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (!ops) {
+        fprintf(stderr, "Number of ops must not be zero\n");
+        return EXIT_FAILURE;
+    }
+
+    counters.misses_fd = perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    counters.instructions_fd = perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    if (counters.misses_fd < 0 || counters.instructions_fd < 0) {
+        fprintf(stderr, "perf_event_open: %s, counters not reported\n", strerror(errno));
+    }
+
+    printf("%-12s %9s %-8s %10s %12s %12s\n",
+           "op", "capacity", "sizes", "ns/op", "misses/op", "insns/op");
+    if (capacity) {
+        bench_capacity(capacity, ops, &counters);
+    } else {
+        for (size_t c = 0; c < sizeof(capacities) / sizeof(capacities[0]); ++c) {
+            bench_capacity(capacities[c], ops, &counters);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,168 @@
+/*
+ * aesd-buffer-stress.c
+ *
+ *  @brief Stress test of aesd_concurrent_buffer. Producer threads push
+ *  entries pointing to payloads they have just written, and a consumer pops
+ *  them, checking that every payload is intact, that entries of a producer
+ *  come out in order, and that none is lost or duplicated. With one producer,
+ *  aesd_concurrent_buffer_push_single is used. Build aesd-buffer-stress-tsan
+ *  to run it under ThreadSanitizer, which also checks the memory ordering.
+ *
+ *  Usage: aesd-buffer-stress [-p producers] [-n entries per producer] [-c capacity]
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aesd-concurrent-buffer.h"
+
+struct stress_payload {
+    unsigned int producer;
+    size_t index;
+    size_t check;
+};
+
+struct stress_producer {
+    pthread_t thread;
+    unsigned int id;
+};
+
+static struct aesd_concurrent_buffer buffer;
+static unsigned int nr_producers = 4;
+static size_t nr_entries = 1000000;
+
+static size_t stress_check(unsigned int producer, size_t index)
+{
+    return (index * 0x9e3779b97f4a7c15ULL) ^ producer;
+}
+
+static void* stress_producer(void *arg)
+{
+    struct stress_producer *producer = arg;
+    struct aesd_buffer_entry entry;
+    struct stress_payload *payload;
+    bool pushed;
+
+    for (size_t index = 0; index < nr_entries; ++index) {
+        payload = malloc(sizeof(*payload));
+        if (!payload) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        payload->producer = producer->id;
+        payload->index = index;
+        payload->check = stress_check(producer->id, index);
+
+        entry.buffptr = (const char *) payload;
+        entry.size = sizeof(*payload);
+        entry.offset = index;
+        do {
+            pushed = nr_producers == 1 ?
+                aesd_concurrent_buffer_push_single(&buffer, &entry) :
+                aesd_concurrent_buffer_push(&buffer, &entry);
+            if (!pushed) {
+                sched_yield();
+            }
+        } while (!pushed);
+    }
+
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    struct aesd_concurrent_slot *slots;
+    struct stress_producer *producers;
+    struct stress_payload *payload;
+    struct aesd_buffer_entry entry;
+    struct timespec start, end;
+    size_t capacity = 1024, popped = 0, *next;
+    double secs;
+    int opt, result;
+
+    while ((opt = getopt(argc, argv, "p:n:c:")) != -1) {
+        switch (opt) {
+            case 'p': nr_producers = strtoul(optarg, NULL, 10); break;
+            case 'n': nr_entries = strtoul(optarg, NULL, 10); break;
+            case 'c': capacity = strtoul(optarg, NULL, 10); break;
+            default:
+                fprintf(stderr, "Usage: %s [-p producers] [-n entries per producer] "
+                        "[-c capacity]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (!nr_producers) {
+        fprintf(stderr, "Number of producers must not be zero\n");
+        return EXIT_FAILURE;
+    }
+
+    slots = calloc(capacity, sizeof(*slots));
+    producers = calloc(nr_producers, sizeof(*producers));
+    next = calloc(nr_producers, sizeof(*next));
+    if (!slots || !producers || !next) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+    if (aesd_concurrent_buffer_init(&buffer, slots, capacity) < 0) {
+        fprintf(stderr, "Capacity must be a power of two\n");
+        return EXIT_FAILURE;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned int i = 0; i < nr_producers; ++i) {
+        producers[i].id = i;
+        result = pthread_create(&producers[i].thread, NULL, stress_producer, &producers[i]);
+        if (result) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(result));
+            return EXIT_FAILURE;
+        }
+    }
+
+    while (popped < nr_producers * nr_entries) {
+        if (!aesd_concurrent_buffer_pop(&buffer, &entry)) {
+            sched_yield();
+            continue;
+        }
+        payload = (struct stress_payload *) entry.buffptr;
+
+        if (entry.size != sizeof(*payload) || payload->producer >= nr_producers ||
+            payload->index != entry.offset ||
+            payload->check != stress_check(payload->producer, payload->index)) {
+            fprintf(stderr, "corrupted entry after %zu pops\n", popped);
+            return EXIT_FAILURE;
+        }
+        if (payload->index != next[payload->producer]) {
+            fprintf(stderr, "producer %u: got entry %zu, expected %zu\n",
+                    payload->producer, payload->index, next[payload->producer]);
+            return EXIT_FAILURE;
+        }
+        next[payload->producer]++;
+        popped++;
+        free(payload);
+    }
+
+    for (unsigned int i = 0; i < nr_producers; ++i) {
+        pthread_join(producers[i].thread, NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    if (aesd_concurrent_buffer_count(&buffer) != 0 ||
+        aesd_concurrent_buffer_pop(&buffer, &entry)) {
+        fprintf(stderr, "entries left after all were popped\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("producers %u entries %zu capacity %zu: %.2f s, %.0f entries/s, OK\n",
+           nr_producers, popped, capacity, secs, popped / secs);
+
+    free(next);
+    free(producers);
+    free(slots);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,300 @@
+/*
+ * aesd-harness.c
+ *
+ *  @brief Runs the file operations of the aesdchar driver, built in userspace,
+ *  from a script read on standard input, one command per line:
+ *
+ *    open <fd> [minor] [nonblock]     close <fd>
+ *    write <fd> <text>                read <fd> <count>
+ *    lseek <fd> <off> <set|cur|end>   seekto <fd> <write_cmd> <offset>
+ *    follow <fd> <0|1>                resize <fd> <capacity> <max_bytes>
+ *    cursor <fd>                      stats <minor>
+ *
+ *  Text may contain the escapes \n, \t and \\. Every command prints its
+ *  result on standard output, so that runs can be compared with a reference.
+ *  Lines starting with # are comments.
+ *
+ *  Usage: aesd-harness [-D devices] [-c capacity] [-b max_bytes] < script
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "aesd-uspace.h"
+#include "aesdchar.h"
+#include "aesd_ioctl.h"
+
+#define HARNESS_FILES 16
+#define HARNESS_LINE 4096
+
+//
+// Declarations of objects with external linkage defined in other source files.
+//
+// ...main.c
+extern struct aesd_dev *aesd_devices;
+void aesd_param_devices(unsigned long);
+void aesd_param_capacity(unsigned long);
+void aesd_param_max_bytes(unsigned long);
+int aesd_init_module(void);
+void aesd_cleanup_module(void);
+int aesd_open(struct inode *, struct file *);
+int aesd_release(struct inode *, struct file *);
+ssize_t aesd_read(struct file *, char *, size_t, loff_t *);
+ssize_t aesd_write(struct file *, const char *, size_t, loff_t *);
+loff_t aesd_llseek(struct file *, loff_t, int);
+long aesd_ioctl(struct file *, unsigned int, unsigned long);
+int aesd_stats_print(void *);
+
+struct harness_file {
+    bool open;
+    struct inode inode;
+    struct file filp;
+};
+
+static struct harness_file files[HARNESS_FILES];
+static unsigned long nr_devices = 1;
+
+//
+// Replaces escapes in place, returns the resulting length.
+//
+static size_t unescape(char *text)
+{
+    char *in = text, *out = text;
+
+    while (*in) {
+        if (in[0] == '\\' && in[1]) {
+            switch (in[1]) {
+                case 'n': *out++ = '\n'; break;
+                case 't': *out++ = '\t'; break;
+                default: *out++ = in[1]; break;
+            }
+            in += 2;
+        } else {
+            *out++ = *in++;
+        }
+    }
+    return out - text;
+}
+
+static void print_escaped(const char *data, size_t size)
+{
+    putchar('"');
+    for (size_t i = 0; i < size; ++i) {
+        switch (data[i]) {
+            case '\n': fputs("\\n", stdout); break;
+            case '\t': fputs("\\t", stdout); break;
+            case '\\': fputs("\\\\", stdout); break;
+            default: putchar(data[i]); break;
+        }
+    }
+    putchar('"');
+}
+
+static void print_result(const char *cmd, long long ret)
+{
+    if (ret < 0) {
+        printf("%s: %s\n", cmd, strerror(-ret));
+    } else {
+        printf("%s: %lld\n", cmd, ret);
+    }
+}
+
+//
+// Returns the open file of the fd argument, or NULL after reporting an error.
+//
+static struct harness_file *get_file(const char *cmd, const char *arg)
+{
+    long fd = arg ? strtol(arg, NULL, 10) : -1;
+
+    if (fd < 0 || fd >= HARNESS_FILES || !files[fd].open) {
+        printf("%s: bad fd\n", cmd);
+        return NULL;
+    }
+    return &files[fd];
+}
+
+static void run_command(char *line)
+{
+    char *rest = NULL;
+    char *cmd = strtok_r(line, " ", &rest);
+    char *arg = strtok_r(NULL, " ", &rest);
+    struct harness_file *hf;
+    long long ret;
+
+    if (!cmd || cmd[0] == '#') {
+        return;
+    }
+
+    if (!strcmp(cmd, "open")) {
+        long fd = arg ? strtol(arg, NULL, 10) : -1;
+        char *minor = strtok_r(NULL, " ", &rest);
+        char *flags = strtok_r(NULL, " ", &rest);
+        unsigned long index = minor ? strtoul(minor, NULL, 10) : 0;
+
+        if (fd < 0 || fd >= HARNESS_FILES || files[fd].open || index >= nr_devices) {
+            printf("open: bad fd or minor\n");
+            return;
+        }
+        hf = &files[fd];
+        memset(hf, 0, sizeof(*hf));
+        hf->inode.i_cdev = &aesd_devices[index].cdev;
+        hf->filp.f_mode = FMODE_READ | FMODE_WRITE;
+        hf->filp.f_flags = flags && !strcmp(flags, "nonblock") ? O_NONBLOCK : 0;
+        ret = aesd_open(&hf->inode, &hf->filp);
+        hf->open = ret == 0;
+        print_result(cmd, ret);
+
+    } else if (!strcmp(cmd, "close")) {
+        if ((hf = get_file(cmd, arg))) {
+            print_result(cmd, aesd_release(&hf->inode, &hf->filp));
+            hf->open = false;
+        }
+
+    } else if (!strcmp(cmd, "write")) {
+        if ((hf = get_file(cmd, arg))) {
+            char *text = rest ? rest : "";
+            size_t size = unescape(text);
+            print_result(cmd, aesd_write(&hf->filp, text, size, &hf->filp.f_pos));
+        }
+
+    } else if (!strcmp(cmd, "read")) {
+        if ((hf = get_file(cmd, arg))) {
+            char *count = strtok_r(NULL, " ", &rest);
+            size_t size = count ? strtoul(count, NULL, 10) : 0;
+            char *buf = malloc(size + 1);
+            if (!buf) {
+                printf("read: %s\n", strerror(errno));
+                return;
+            }
+            ret = aesd_read(&hf->filp, buf, size, &hf->filp.f_pos);
+            if (ret < 0) {
+                print_result(cmd, ret);
+            } else {
+                printf("read: %lld ", ret);
+                print_escaped(buf, ret);
+                putchar('\n');
+            }
+            free(buf);
+        }
+
+    } else if (!strcmp(cmd, "lseek")) {
+        if ((hf = get_file(cmd, arg))) {
+            char *off = strtok_r(NULL, " ", &rest);
+            char *whence = strtok_r(NULL, " ", &rest);
+            int w = !whence || !strcmp(whence, "set") ? SEEK_SET :
+                    !strcmp(whence, "cur") ? SEEK_CUR : SEEK_END;
+            print_result(cmd, aesd_llseek(&hf->filp, off ? strtoll(off, NULL, 10) : 0, w));
+        }
+
+    } else if (!strcmp(cmd, "seekto")) {
+        if ((hf = get_file(cmd, arg))) {
+            char *write_cmd = strtok_r(NULL, " ", &rest);
+            char *offset = strtok_r(NULL, " ", &rest);
+            struct aesd_seekto seekto = {
+                .write_cmd = write_cmd ? strtoul(write_cmd, NULL, 10) : 0,
+                .write_cmd_offset = offset ? strtoul(offset, NULL, 10) : 0,
+            };
+            ret = aesd_ioctl(&hf->filp, AESDCHAR_IOCSEEKTO, (unsigned long) &seekto);
+            print_result(cmd, ret ? ret : hf->filp.f_pos);
+        }
+
+    } else if (!strcmp(cmd, "follow")) {
+        if ((hf = get_file(cmd, arg))) {
+            char *on = strtok_r(NULL, " ", &rest);
+            print_result(cmd, aesd_ioctl(&hf->filp, AESDCHAR_IOCFOLLOW,
+                                         on ? strtoul(on, NULL, 10) : 1));
+        }
+
+    } else if (!strcmp(cmd, "resize")) {
+        if ((hf = get_file(cmd, arg))) {
+            char *capacity = strtok_r(NULL, " ", &rest);
+            char *max_bytes = strtok_r(NULL, " ", &rest);
+            struct aesd_resize resize = {
+                .capacity = capacity ? strtoul(capacity, NULL, 10) : 0,
+                .max_bytes = max_bytes ? strtoull(max_bytes, NULL, 10) : 0,
+            };
+            ret = aesd_ioctl(&hf->filp, AESDCHAR_IOCRESIZE, (unsigned long) &resize);
+            if (ret < 0) {
+                print_result(cmd, ret);
+            } else {
+                printf("resize: capacity %u max_bytes %llu\n", resize.capacity,
+                       (unsigned long long) resize.max_bytes);
+            }
+        }
+
+    } else if (!strcmp(cmd, "cursor")) {
+        if ((hf = get_file(cmd, arg))) {
+            struct aesd_cursor cursor;
+            ret = aesd_ioctl(&hf->filp, AESDCHAR_IOCCURSOR, (unsigned long) &cursor);
+            if (ret < 0) {
+                print_result(cmd, ret);
+            } else {
+                printf("cursor: seq %llu offset %llu lost %llu next_seq %llu\n",
+                       (unsigned long long) cursor.seq, (unsigned long long) cursor.offset,
+                       (unsigned long long) cursor.lost, (unsigned long long) cursor.next_seq);
+            }
+        }
+
+    } else if (!strcmp(cmd, "stats")) {
+        unsigned long index = arg ? strtoul(arg, NULL, 10) : 0;
+        if (index >= nr_devices) {
+            printf("stats: bad minor\n");
+            return;
+        }
+        aesd_stats_print(&aesd_devices[index]);
+
+    } else {
+        printf("%s: unknown command\n", cmd);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    char line[HARNESS_LINE];
+    int opt, result;
+
+    while ((opt = getopt(argc, argv, "D:c:b:")) != -1) {
+        switch (opt) {
+            case 'D':
+                nr_devices = strtoul(optarg, NULL, 10);
+                aesd_param_devices(nr_devices);
+                break;
+            case 'c':
+                aesd_param_capacity(strtoul(optarg, NULL, 10));
+                break;
+            case 'b':
+                aesd_param_max_bytes(strtoul(optarg, NULL, 10));
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-D devices] [-c capacity] [-b max_bytes] < script\n",
+                        argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    result = aesd_init_module();
+    if (result) {
+        fprintf(stderr, "aesd_init_module: %s\n", strerror(-result));
+        return EXIT_FAILURE;
+    }
+
+    while (fgets(line, sizeof(line), stdin)) {
+        line[strcspn(line, "\n")] = '\0';
+        run_command(line);
+    }
+
+    for (size_t fd = 0; fd < HARNESS_FILES; ++fd) {
+        if (files[fd].open) {
+            aesd_release(&files[fd].inode, &files[fd].filp);
+        }
+    }
+    aesd_cleanup_module();
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,180 @@
+/*
+ * aesd-newline-bench.c
+ *
+ *  @brief Checks and measures the line splitting kernels of aesd-newline.c.
+ *  Every kernel supported by the cpu is first compared to a byte loop on
+ *  random buffers, at all alignments and with batches of offsets of every
+ *  size, then timed splitting a buffer of lines of the given average length
+ *  into all its lines, as the driver and aesdsocket do, against a memchr loop.
+ *  Reports GB/s.
+ *
+ *  Usage: aesd-newline-bench [-s buffer size] [-l average line length] [-n rounds]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aesd-newline.h"
+
+#define BENCH_CHECK_SIZE 1024
+#define BENCH_CHECK_ROUNDS 20000
+#define BENCH_BATCH 32 // offsets per scan call, as in the driver
+
+static const char *kernels[] = { "scalar", "sse2", "avx2" };
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+static volatile size_t sink;
+
+static uint64_t rng(void)
+{
+    // xorshift64
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Fills size bytes of data with lines of average length line_len, other bytes
+ * taking all values but '\n', including the ones above 0x80.
+ */
+static void fill(char *data, size_t size, size_t line_len)
+{
+    for (size_t i = 0; i < size; ++i) {
+        char c = rng();
+        data[i] = rng() % line_len == 0 ? '\n' : c == '\n' ? '\n' + 0x80 : c;
+    }
+}
+
+static int check(const char *name)
+{
+    static char data[BENCH_CHECK_SIZE + 64];
+    static size_t expected[BENCH_CHECK_SIZE], offsets[BENCH_CHECK_SIZE];
+
+    for (int round = 0; round < BENCH_CHECK_ROUNDS; ++round) {
+        size_t start = rng() % 64, size = rng() % BENCH_CHECK_SIZE;
+        size_t nlines = 0, max, found;
+
+        fill(data, start + size, 1 + rng() % 64);
+        for (size_t i = 0; i < size; ++i) {
+            if (data[start + i] == '\n') {
+                expected[nlines++] = i;
+            }
+        }
+
+        max = rng() % (nlines + 2);
+        found = aesd_newline_scan(data + start, size, offsets, max);
+        if (aesd_newline_count(data + start, size) != nlines ||
+            found != (max < nlines ? max : nlines) ||
+            memcmp(offsets, expected, found * sizeof(offsets[0]))) {
+            fprintf(stderr, "%s: wrong result for %zu bytes at alignment %zu\n",
+                    name, size, start);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static size_t split_memchr(const char *data, size_t size)
+{
+    const char *line = data, *end = data + size, *newline;
+    size_t nlines = 0;
+
+    while ((newline = memchr(line, '\n', end - line))) {
+        sink = newline - line + 1;
+        line = newline + 1;
+        nlines++;
+    }
+    return nlines;
+}
+
+static size_t split_scan(const char *data, size_t size)
+{
+    size_t offsets[BENCH_BATCH];
+    size_t nlines = 0, from = 0, found;
+
+    do {
+        found = aesd_newline_scan(data + from, size - from, offsets, BENCH_BATCH);
+        for (size_t i = 0; i < found; ++i) {
+            sink = offsets[i];
+        }
+        nlines += found;
+        if (found) {
+            from += offsets[found - 1] + 1;
+        }
+    } while (found == BENCH_BATCH);
+    return nlines;
+}
+
+static void run(const char *name, size_t (*split)(const char *, size_t),
+        const char *data, size_t size, int rounds, size_t nlines)
+{
+    double start = now();
+
+    for (int round = 0; round < rounds; ++round) {
+        if (split(data, size) != nlines) {
+            fprintf(stderr, "%s: wrong number of lines\n", name);
+            exit(EXIT_FAILURE);
+        }
+    }
+    printf("%-8s %8.2f GB/s\n", name, (double) size * rounds / (now() - start) / 1e9);
+}
+
+int main(int argc, char **argv)
+{
+    size_t size = 1024 * 1024, line_len = 64, nlines;
+    int rounds = 1000, opt;
+    char *data;
+
+    while ((opt = getopt(argc, argv, "s:l:n:")) != -1) {
+        switch (opt) {
+            case 's': size = strtoul(optarg, NULL, 10); break;
+            case 'l': line_len = strtoul(optarg, NULL, 10); break;
+            case 'n': rounds = strtoul(optarg, NULL, 10); break;
+            default:
+                fprintf(stderr, "Usage: %s [-s buffer size] [-l average line length] "
+                        "[-n rounds]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (!line_len) {
+        fprintf(stderr, "Line length must not be zero\n");
+        return EXIT_FAILURE;
+    }
+
+    data = malloc(size);
+    if (!data) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    fill(data, size, line_len);
+    nlines = split_memchr(data, size);
+
+    printf("default kernel %s, %zu bytes, %zu lines\n", aesd_newline_kernel(), size, nlines);
+    run("memchr", split_memchr, data, size, rounds, nlines);
+    for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); ++i) {
+        if (aesd_newline_select(kernels[i]) < 0) {
+            printf("%-8s unsupported\n", kernels[i]);
+            continue;
+        }
+        if (check(kernels[i]) < 0) {
+            return EXIT_FAILURE;
+        }
+        run(kernels[i], split_scan, data, size, rounds, nlines);
+    }
+
+    free(data);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,224 @@
+/*
+ * aesd-uspace.c
+ *
+ *  @brief RCU and slab caches of the userspace build of the aesdchar driver.
+ *
+ *  Each thread that enters a read side critical section registers a counter,
+ *  which is odd while the thread is inside. A grace period ends once every
+ *  counter that was odd when it began has changed. Frees deferred with
+ *  kfree_rcu, and objects of slab caches (which are type safe, as with
+ *  SLAB_TYPESAFE_BY_RCU), are queued and released in batches after a grace
+ *  period by a background thread, as call_rcu callbacks are in the kernel.
+ */
+
+#include "aesd-uspace.h"
+
+#define RCU_BATCH 256 // deferred frees released at once
+
+struct rcu_reader {
+    unsigned long ctr;
+    unsigned int nesting;
+    struct rcu_reader *next;
+};
+
+static __thread struct rcu_reader *rcu_self;
+static struct rcu_reader *rcu_readers;
+static pthread_mutex_t rcu_readers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t rcu_key;
+static pthread_once_t rcu_once = PTHREAD_ONCE_INIT;
+
+static struct rcu_head *rcu_pending;
+static size_t rcu_npending;
+static pthread_mutex_t rcu_pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rcu_pending_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t rcu_thread_once = PTHREAD_ONCE_INIT;
+
+static void rcu_unregister(void *data)
+{
+    struct rcu_reader *reader = data, **link;
+
+    pthread_mutex_lock(&rcu_readers_lock);
+    for (link = &rcu_readers; *link; link = &(*link)->next) {
+        if (*link == reader) {
+            *link = reader->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&rcu_readers_lock);
+    free(reader);
+}
+
+static void rcu_key_create(void)
+{
+    pthread_key_create(&rcu_key, rcu_unregister);
+}
+
+static struct rcu_reader *rcu_register(void)
+{
+    struct rcu_reader *reader = calloc(1, sizeof(*reader));
+
+    if (!reader) {
+        abort();
+    }
+    pthread_once(&rcu_once, rcu_key_create);
+    pthread_setspecific(rcu_key, reader);
+
+    pthread_mutex_lock(&rcu_readers_lock);
+    reader->next = rcu_readers;
+    rcu_readers = reader;
+    pthread_mutex_unlock(&rcu_readers_lock);
+
+    return reader;
+}
+
+void rcu_read_lock(void)
+{
+    struct rcu_reader *reader = rcu_self;
+
+    if (!reader) {
+        reader = rcu_self = rcu_register();
+    }
+    if (reader->nesting++ == 0) {
+        // Pairs with the fence of synchronize_rcu: either it sees us inside,
+        // or we see what was unpublished before it.
+        __atomic_store_n(&reader->ctr, reader->ctr + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+}
+
+void rcu_read_unlock(void)
+{
+    struct rcu_reader *reader = rcu_self;
+
+    if (--reader->nesting == 0) {
+        __atomic_store_n(&reader->ctr, reader->ctr + 1, __ATOMIC_RELEASE);
+    }
+}
+
+void synchronize_rcu(void)
+{
+    struct rcu_reader *reader;
+    unsigned long ctr;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    // Readers only come and go with the lock, the ones registered later
+    // cannot hold references from before the grace period.
+    pthread_mutex_lock(&rcu_readers_lock);
+    for (reader = rcu_readers; reader; reader = reader->next) {
+        if (reader == rcu_self) {
+            continue;
+        }
+        ctr = __atomic_load_n(&reader->ctr, __ATOMIC_ACQUIRE);
+        while ((ctr & 1) && __atomic_load_n(&reader->ctr, __ATOMIC_ACQUIRE) == ctr) {
+            sched_yield();
+        }
+    }
+    pthread_mutex_unlock(&rcu_readers_lock);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/**
+ * Frees the deferred objects queued so far, after a grace period.
+ */
+static void rcu_reclaim(void)
+{
+    struct rcu_head *head, *next;
+
+    pthread_mutex_lock(&rcu_pending_lock);
+    head = rcu_pending;
+    rcu_pending = NULL;
+    rcu_npending = 0;
+    pthread_mutex_unlock(&rcu_pending_lock);
+
+    if (!head) {
+        return;
+    }
+    synchronize_rcu();
+    for (; head; head = next) {
+        next = head->next;
+        free(head->ptr);
+    }
+}
+
+void rcu_barrier(void)
+{
+    rcu_reclaim();
+}
+
+static void *rcu_thread(void *unused)
+{
+    for (;;) {
+        pthread_mutex_lock(&rcu_pending_lock);
+        while (rcu_npending < RCU_BATCH) {
+            pthread_cond_wait(&rcu_pending_cond, &rcu_pending_lock);
+        }
+        pthread_mutex_unlock(&rcu_pending_lock);
+        rcu_reclaim();
+    }
+    return NULL;
+}
+
+static void rcu_thread_start(void)
+{
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, rcu_thread, NULL) || pthread_detach(thread)) {
+        abort();
+    }
+}
+
+static void rcu_defer(void *ptr, struct rcu_head *head)
+{
+    pthread_once(&rcu_thread_once, rcu_thread_start);
+
+    head->ptr = ptr;
+    pthread_mutex_lock(&rcu_pending_lock);
+    head->next = rcu_pending;
+    rcu_pending = head;
+    if (++rcu_npending == RCU_BATCH) {
+        pthread_cond_signal(&rcu_pending_cond);
+    }
+    pthread_mutex_unlock(&rcu_pending_lock);
+}
+
+void aesd_uspace_free_rcu(void *ptr, struct rcu_head *head)
+{
+    rcu_defer(ptr, head);
+}
+
+/**
+ * Objects of a cache are preceded by a hidden rcu_head, so that freeing one
+ * does not overwrite what lockless readers may still look at.
+ */
+struct kmem_cache *kmem_cache_create(const char *name, unsigned int size, unsigned int align,
+                                     unsigned long flags, void (*ctor)(void *))
+{
+    struct kmem_cache *cache = malloc(sizeof(*cache));
+
+    if (cache) {
+        cache->size = size;
+    }
+    return cache;
+}
+
+void *kmem_cache_alloc(struct kmem_cache *cache, int gfp)
+{
+    struct rcu_head *head = malloc(sizeof(*head) + cache->size);
+
+    return head ? head + 1 : NULL;
+}
+
+void kmem_cache_free(struct kmem_cache *cache, void *obj)
+{
+    struct rcu_head *head = (struct rcu_head *) obj - 1;
+
+    rcu_defer(head, head);
+}
+
+void kmem_cache_destroy(struct kmem_cache *cache)
+{
+    rcu_barrier();
+    free(cache);
+}
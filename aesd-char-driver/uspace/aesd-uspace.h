@@ -0,0 +1,473 @@
+/*
+ * aesd-uspace.h
+ *
+ *  @brief Userspace implementation of the subset of the kernel API used by
+ *  the aesdchar driver, so that main.c builds unchanged as a library for the
+ *  harness and the benchmark. Locks map to pthreads, user copies to memcpy,
+ *  and RCU to per thread reader counters (see aesd-uspace.c). Registration
+ *  of the char devices, debugfs, tracepoints and mmap are no-ops.
+ */
+
+#ifndef AESD_CHAR_DRIVER_AESD_USPACE_H_
+#define AESD_CHAR_DRIVER_AESD_USPACE_H_
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/* types and annotations */
+typedef unsigned char u8;
+typedef unsigned int u32;
+typedef unsigned long long u64;
+typedef unsigned int fmode_t;
+typedef unsigned int __poll_t;
+#define __user
+#define __force
+#define __rcu
+#define __percpu
+
+#define container_of(ptr, type, member) \
+    ((type *) ((char *) (ptr) - offsetof(type, member)))
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define min_t(t, a, b) min((t) (a), (t) (b))
+#define max_t(t, a, b) max((t) (a), (t) (b))
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define struct_size(p, member, n) (sizeof(*(p)) + sizeof((p)->member[0]) * (n))
+#define u64_to_user_ptr(x) ((void *) (uintptr_t) (x))
+
+static inline unsigned long roundup_pow_of_two(unsigned long n)
+{
+    return n > 1 ? 1UL << (sizeof(long) * 8 - __builtin_clzl(n - 1)) : 1;
+}
+
+#define READ_ONCE(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define WRITE_ONCE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define smp_wmb() __atomic_thread_fence(__ATOMIC_RELEASE)
+#define smp_rmb() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+
+#define PAGE_SIZE 4096UL
+#define PAGE_ALIGN(x) (((x) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+#define ERESTARTSYS 512
+
+/* module */
+#define THIS_MODULE NULL
+#define MODULE_AUTHOR(x)
+#define MODULE_LICENSE(x)
+#define MODULE_PARM_DESC(name, desc)
+// Module parameters are set with aesd_param_<name>() before aesd_init_module
+#define module_param_named(name, var, type, perm) \
+    void aesd_param_##name(unsigned long value) { var = value; }
+#define module_init(fn)
+#define module_exit(fn)
+
+#define KERN_ERR "aesdchar: "
+#define KERN_WARNING "aesdchar: "
+#define KERN_DEBUG "aesdchar: "
+#define printk(fmt, args...) fprintf(stderr, fmt, ## args)
+
+/* memory */
+#define GFP_KERNEL 0
+#define kmalloc(size, gfp) malloc(size)
+#define kzalloc(size, gfp) calloc(1, size)
+#define kcalloc(n, size, gfp) calloc(n, size)
+#define kfree(p) free((void *) (p))
+#define kvmalloc(size, gfp) malloc(size)
+#define kvmalloc_array(n, size, gfp) calloc(n, size)
+#define kvfree(p) free((void *) (p))
+#define vmalloc_user(size) calloc(1, size)
+#define vfree(p) free(p)
+
+/* lists */
+struct list_head {
+    struct list_head *next, *prev;
+};
+#define LIST_HEAD_INIT(name) { &(name), &(name) }
+#define LIST_HEAD(name) struct list_head name = LIST_HEAD_INIT(name)
+
+static inline void INIT_LIST_HEAD(struct list_head *list)
+{
+    list->next = list->prev = list;
+}
+
+static inline void __list_add(struct list_head *entry, struct list_head *prev, struct list_head *next)
+{
+    next->prev = entry;
+    entry->next = next;
+    entry->prev = prev;
+    prev->next = entry;
+}
+
+static inline void list_add(struct list_head *entry, struct list_head *head)
+{
+    __list_add(entry, head, head->next);
+}
+
+static inline void list_add_tail(struct list_head *entry, struct list_head *head)
+{
+    __list_add(entry, head->prev, head);
+}
+
+static inline void list_del(struct list_head *entry)
+{
+    entry->next->prev = entry->prev;
+    entry->prev->next = entry->next;
+}
+
+static inline int list_empty(const struct list_head *head)
+{
+    return head->next == head;
+}
+
+#define list_entry(ptr, type, member) container_of(ptr, type, member)
+#define list_first_entry(head, type, member) list_entry((head)->next, type, member)
+#define list_last_entry(head, type, member) list_entry((head)->prev, type, member)
+#define list_first_entry_or_null(head, type, member) \
+    (list_empty(head) ? NULL : list_first_entry(head, type, member))
+#define list_next_entry(pos, member) list_entry((pos)->member.next, __typeof__(*(pos)), member)
+#define list_for_each_entry_from(pos, head, member) \
+    for (; &pos->member != (head); pos = list_next_entry(pos, member))
+#define list_for_each_entry_safe(pos, n, head, member) \
+    for (pos = list_first_entry(head, __typeof__(*pos), member), \
+         n = list_next_entry(pos, member); \
+         &pos->member != (head); \
+         pos = n, n = list_next_entry(n, member))
+
+/* locking */
+struct mutex {
+    pthread_mutex_t m;
+};
+#define mutex_init(l) pthread_mutex_init(&(l)->m, NULL)
+#define mutex_lock_interruptible(l) pthread_mutex_lock(&(l)->m)
+#define mutex_trylock(l) (pthread_mutex_trylock(&(l)->m) == 0)
+#define mutex_unlock(l) pthread_mutex_unlock(&(l)->m)
+#define lockdep_is_held(l) 1
+
+typedef struct {
+    pthread_mutex_t m;
+} spinlock_t;
+#define DEFINE_SPINLOCK(name) spinlock_t name = { PTHREAD_MUTEX_INITIALIZER }
+#define spin_lock(l) pthread_mutex_lock(&(l)->m)
+#define spin_unlock(l) pthread_mutex_unlock(&(l)->m)
+
+/* busy wait hint, as the kernel cpu_relax */
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ volatile("yield" ::: "memory");
+#else
+    sched_yield();
+#endif
+}
+
+typedef struct {
+    unsigned int sequence;
+} seqcount_mutex_t;
+#define seqcount_mutex_init(s, l) ((s)->sequence = 0)
+
+static inline unsigned int read_seqcount_begin(seqcount_mutex_t *s)
+{
+    unsigned int seq;
+
+    while ((seq = __atomic_load_n(&s->sequence, __ATOMIC_ACQUIRE)) & 1) {
+        cpu_relax();
+    }
+    return seq;
+}
+
+static inline int read_seqcount_retry(seqcount_mutex_t *s, unsigned int seq)
+{
+    smp_rmb();
+    return __atomic_load_n(&s->sequence, __ATOMIC_RELAXED) != seq;
+}
+
+static inline void write_seqcount_begin(seqcount_mutex_t *s)
+{
+    __atomic_store_n(&s->sequence, s->sequence + 1, __ATOMIC_RELAXED);
+    smp_wmb();
+}
+
+static inline void write_seqcount_end(seqcount_mutex_t *s)
+{
+    smp_wmb();
+    __atomic_store_n(&s->sequence, s->sequence + 1, __ATOMIC_RELAXED);
+}
+
+/* reference counts */
+struct kref {
+    int refcount;
+};
+
+static inline void kref_init(struct kref *ref)
+{
+    __atomic_store_n(&ref->refcount, 1, __ATOMIC_RELAXED);
+}
+
+static inline bool kref_get_unless_zero(struct kref *ref)
+{
+    int count = __atomic_load_n(&ref->refcount, __ATOMIC_RELAXED);
+
+    do {
+        if (count == 0) {
+            return false;
+        }
+    } while (!__atomic_compare_exchange_n(&ref->refcount, &count, count + 1, true,
+                                          __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+    return true;
+}
+
+static inline int kref_put(struct kref *ref, void (*release)(struct kref *))
+{
+    if (__atomic_sub_fetch(&ref->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        release(ref);
+        return 1;
+    }
+    return 0;
+}
+
+/* rcu, see aesd-uspace.c */
+struct rcu_head {
+    struct rcu_head *next;
+    void *ptr;
+};
+void rcu_read_lock(void);
+void rcu_read_unlock(void);
+void synchronize_rcu(void);
+void rcu_barrier(void);
+void aesd_uspace_free_rcu(void *ptr, struct rcu_head *head);
+#define rcu_dereference_check(p, c) __atomic_load_n(&(p), __ATOMIC_CONSUME)
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+#define kfree_rcu(ptr, field) aesd_uspace_free_rcu(ptr, &(ptr)->field)
+
+/* slab caches, freed objects are type safe as with SLAB_TYPESAFE_BY_RCU */
+#define SLAB_TYPESAFE_BY_RCU 0
+struct kmem_cache {
+    size_t size;
+};
+struct kmem_cache *kmem_cache_create(const char *name, unsigned int size, unsigned int align,
+                                     unsigned long flags, void (*ctor)(void *));
+void *kmem_cache_alloc(struct kmem_cache *cache, int gfp);
+void kmem_cache_free(struct kmem_cache *cache, void *obj);
+void kmem_cache_destroy(struct kmem_cache *cache);
+
+/* per cpu counters, a single instance updated atomically */
+#define alloc_percpu(type) ((type *) calloc(1, sizeof(type)))
+#define free_percpu(p) free(p)
+#define per_cpu_ptr(p, cpu) ((void) (cpu), (p))
+#define for_each_possible_cpu(cpu) for ((cpu) = 0; (cpu) < 1; (cpu)++)
+#define this_cpu_add(var, value) __atomic_add_fetch(&(var), (value), __ATOMIC_RELAXED)
+#define this_cpu_inc(var) this_cpu_add(var, 1)
+
+/* wait queues */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} wait_queue_head_t;
+
+static inline void init_waitqueue_head(wait_queue_head_t *wq)
+{
+    pthread_mutex_init(&wq->lock, NULL);
+    pthread_cond_init(&wq->cond, NULL);
+}
+
+static inline void wake_up_interruptible(wait_queue_head_t *wq)
+{
+    pthread_mutex_lock(&wq->lock);
+    pthread_cond_broadcast(&wq->cond);
+    pthread_mutex_unlock(&wq->lock);
+}
+
+// The condition is checked with the queue lock held, and wakers take it, so
+// that no wake up is lost.
+#define wait_event_interruptible(wq, condition) ({ \
+    pthread_mutex_lock(&(wq).lock); \
+    while (!(condition)) { \
+        pthread_cond_wait(&(wq).cond, &(wq).lock); \
+    } \
+    pthread_mutex_unlock(&(wq).lock); \
+    0; \
+})
+
+/* char devices and files */
+#define MINORBITS 20
+#define MKDEV(ma, mi) (((dev_t) (ma) << MINORBITS) | (mi))
+#undef major
+#undef minor
+#define MAJOR(dev) ((unsigned int) ((dev) >> MINORBITS))
+#define MINOR(dev) ((unsigned int) ((dev) & ((1U << MINORBITS) - 1)))
+
+struct file_operations;
+
+struct cdev {
+    dev_t dev;
+    void *owner;
+    const struct file_operations *ops;
+};
+
+static inline void cdev_init(struct cdev *cdev, const struct file_operations *fops)
+{
+    cdev->ops = fops;
+}
+
+static inline int cdev_add(struct cdev *cdev, dev_t dev, unsigned int count)
+{
+    cdev->dev = dev;
+    return 0;
+}
+
+static inline void cdev_del(struct cdev *cdev)
+{
+}
+
+static inline int alloc_chrdev_region(dev_t *dev, unsigned int minor, unsigned int count,
+                                      const char *name)
+{
+    *dev = MKDEV(1, minor);
+    return 0;
+}
+
+static inline void unregister_chrdev_region(dev_t dev, unsigned int count)
+{
+}
+
+#define FMODE_READ 0x1
+#define FMODE_WRITE 0x2
+#define FMODE_PREAD 0x8
+#define FMODE_PWRITE 0x10
+
+struct inode {
+    struct cdev *i_cdev;
+};
+
+struct file {
+    void *private_data;
+    loff_t f_pos;
+    unsigned int f_flags;
+    fmode_t f_mode;
+};
+
+#define IOCB_NOWAIT 0x1
+
+struct kiocb {
+    struct file *ki_filp;
+    loff_t ki_pos;
+    int ki_flags;
+};
+
+struct iov_iter {
+    char *buf;
+    size_t count;
+};
+
+static inline size_t iov_iter_count(const struct iov_iter *iter)
+{
+    return iter->count;
+}
+
+static inline size_t copy_to_iter(const void *src, size_t len, struct iov_iter *iter)
+{
+    len = min(len, iter->count);
+    memcpy(iter->buf, src, len);
+    iter->buf += len;
+    iter->count -= len;
+    return len;
+}
+
+static inline unsigned long copy_to_user(void *dst, const void *src, size_t len)
+{
+    memcpy(dst, src, len);
+    return 0;
+}
+
+static inline unsigned long copy_from_user(void *dst, const void *src, size_t len)
+{
+    memcpy(dst, src, len);
+    return 0;
+}
+
+static inline loff_t fixed_size_llseek(struct file *filp, loff_t off, int whence, loff_t size)
+{
+    switch (whence) {
+        case SEEK_SET: break;
+        case SEEK_CUR: off += filp->f_pos; break;
+        case SEEK_END: off += size; break;
+        default: return -EINVAL;
+    }
+    if (off < 0 || off > size) {
+        return -EINVAL;
+    }
+    filp->f_pos = off;
+    return off;
+}
+
+typedef struct {
+    int unused;
+} poll_table;
+#define poll_wait(filp, wq, table) ((void) (wq))
+
+/* mmap is not supported, there is no user address space to map to */
+#define LINUX_VERSION_CODE 0x060000
+#define KERNEL_VERSION(a, b, c) (((a) << 16) + ((b) << 8) + (c))
+#define VM_WRITE 0x2
+#define VM_MAYWRITE 0x20
+
+struct vm_area_struct {
+    unsigned long vm_flags;
+    unsigned long vm_pgoff;
+};
+
+static inline int remap_vmalloc_range(struct vm_area_struct *vma, void *addr, unsigned long pgoff)
+{
+    return -ENODEV;
+}
+
+struct file_operations {
+    void *owner;
+    int (*open)(struct inode *, struct file *);
+    int (*release)(struct inode *, struct file *);
+    ssize_t (*read)(struct file *, char *, size_t, loff_t *);
+    ssize_t (*read_iter)(struct kiocb *, struct iov_iter *);
+    ssize_t (*write)(struct file *, const char *, size_t, loff_t *);
+    loff_t (*llseek)(struct file *, loff_t, int);
+    long (*unlocked_ioctl)(struct file *, unsigned int, unsigned long);
+    int (*mmap)(struct file *, struct vm_area_struct *);
+    __poll_t (*poll)(struct file *, poll_table *);
+};
+
+/* debugfs, stats files are printed to stdout with aesd_stats_print() */
+struct dentry;
+#define debugfs_create_dir(name, parent) ((struct dentry *) NULL)
+#define debugfs_create_file(name, mode, parent, data, fops) ((void) (fops))
+#define debugfs_remove_recursive(dentry) ((void) (dentry))
+
+struct seq_file {
+    void *private;
+};
+#define seq_printf(s, fmt, args...) printf(fmt, ## args)
+#define DEFINE_SHOW_ATTRIBUTE(name) \
+    static const struct file_operations name##_fops; \
+    int name##_print(void *data) \
+    { \
+        struct seq_file s = { .private = data }; \
+        return name##_show(&s, NULL); \
+    }
+
+/* tracepoints */
+#define trace_aesd_write(args...) do { } while (0)
+#define trace_aesd_read(args...) do { } while (0)
+#define trace_aesd_seek(args...) do { } while (0)
+
+#endif /* AESD_CHAR_DRIVER_AESD_USPACE_H_ */
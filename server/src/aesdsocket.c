@@ -1,20 +1,18 @@
 #include <errno.h>
-#include <fcntl.h>
-#include <netdb.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/queue.h>
 #include <syslog.h>
 #include <unistd.h>
 
 //
 // Defs and constants.
 #define PORT "9000"
-#define BACKLOG 10
+#define MAX_SOCKETS 16   // Maximum number of listening sockets.
+#define REAP_INTERVAL_MS 100
 
 #ifndef USE_AESD_CHAR_DEVICE
 const char* TMPFILE = "/var/tmp/aesdsocketdata";
@@ -33,45 +31,169 @@ int sig_setexit(int);
 void* timer_handler(void*);
 //
 // ...socket.c
-int sock_create(const char*, const char*);
-int sock_gethost(int, char*, size_t);
+struct sock_opts;
+struct sock_opts* sock_opts_new(const char*);
+struct sock_opts* sock_opts_copy(const struct sock_opts*);
+int sock_opts_set(struct sock_opts*, const char*);
+int sock_create(const char*, const char*, const struct sock_opts*, int*, size_t);
+int sock_create_unix(const char*);
 //
 // ...utils.c
 void usage(void);
+char* path_absolute(const char*);
 int daemonize(void);
 //
+// ...listener.c
+extern bool lst_failed;
+struct listener;
+struct listener* lst_start(int, pthread_mutex_t*, const struct sock_opts*, void* (*)(void*));
+void lst_stop(struct listener*);
+//
+// ...shmring.c
+void* shm_handler(void*);
+//
+// ...store.c
+int store_open(const char*);
+void store_close(void);
+//
+// ...affinity.c
+int aff_parse(const char*);
+int aff_attr_init(pthread_attr_t*, const char*, int);
+void aff_free(void);
+//
+// ...task.c
+int task_start(int);
+void task_stop(void);
+//
 // ...connection.c
-struct cl_entry {
-    int descriptor;
-    bool is_active;
-    pthread_t thread;
-    pthread_mutex_t* io_mutex;
-    SLIST_ENTRY(cl_entry) entries;
-};
-SLIST_HEAD(cl_head, cl_entry);
 void* conn_handler(void*);
+void conn_wait(long);
+int conn_reap(bool);
 
 //
 // Main program.
 //
 int main(int argc, char** argv) {
     bool daemon_mode = false; // Wether to daemonize the program.
-    int error; // Used for error handling throughout the program.
+#ifndef USE_AESD_CHAR_DEVICE
+    int error; // Used for error handling of the timer thread.
+#endif
     
     openlog("aesdsocket", LOG_PERROR, LOG_USER);
 
-    if (argc > 2) {
+    // Parse options. The profile selected with -p and modified with -o applies
+    // to the addresses given with the following -l options. If no address is
+    // given, the server listens on all interfaces with the last profile.
+    struct sock_opts* profiles[argc + 1]; // All allocated profiles.
+    int nprofiles = 0;
+    struct sock_opts* sock_opts = NULL; // Profile being configured.
+    bool sock_opts_used = false; // Wether it is already bound to addresses.
+
+    const char* addresses[argc + 1];
+    const struct sock_opts* address_opts[argc + 1];
+    int naddresses = 0;
+
+    const char* unix_paths[argc + 1]; // Unix domain sockets (-u and -m).
+    char* unix_paths_absolute[argc + 1]; // Relative ones made absolute.
+    void* (*unix_handlers[argc + 1])(void*);
+    int nunix_paths = 0;
+
+    bool compress = false; // Wether to store the file in compressed chunks.
+    int nworkers = 0; // Task scheduler workers, 0 for a thread per connection.
+
+    int opt;
+    while ((opt = getopt(argc, argv, "dp:o:l:u:m:za:w:")) != -1) {
+        switch (opt) {
+            case 'd':
+                daemon_mode = true;
+                break;
+            case 'p':
+                sock_opts = sock_opts_new(optarg);
+                if (!sock_opts) {
+                    exit(-1);
+                }
+                profiles[nprofiles++] = sock_opts;
+                sock_opts_used = false;
+                break;
+            case 'o':
+                // Do not modify the profile of previously given addresses.
+                if (!sock_opts || sock_opts_used) {
+                    sock_opts = sock_opts ? sock_opts_copy(sock_opts) : sock_opts_new(NULL);
+                    if (!sock_opts) {
+                        exit(-1);
+                    }
+                    profiles[nprofiles++] = sock_opts;
+                    sock_opts_used = false;
+                }
+                if (sock_opts_set(sock_opts, optarg) < 0) {
+                    exit(-1);
+                }
+                break;
+            case 'l':
+                if (!sock_opts) {
+                    sock_opts = sock_opts_new(NULL);
+                    if (!sock_opts) {
+                        exit(-1);
+                    }
+                    profiles[nprofiles++] = sock_opts;
+                }
+                addresses[naddresses] = optarg;
+                address_opts[naddresses++] = sock_opts;
+                sock_opts_used = true;
+                break;
+            case 'u':
+                unix_handlers[nunix_paths] = conn_handler;
+                unix_paths[nunix_paths++] = optarg;
+                break;
+            case 'm':
+                unix_handlers[nunix_paths] = shm_handler;
+                unix_paths[nunix_paths++] = optarg;
+                break;
+            case 'z':
+#ifdef USE_AESD_CHAR_DEVICE
+                syslog(LOG_ERR, "-z: not supported with %s", TMPFILE);
+                exit(-1);
+#endif
+                compress = true;
+                break;
+            case 'w':
+#ifdef USE_AESD_CHAR_DEVICE
+                syslog(LOG_ERR, "-w: not supported with %s", TMPFILE);
+                exit(-1);
+#endif
+                nworkers = atoi(optarg);
+                if (nworkers < 1) {
+                    syslog(LOG_ERR, "-w %s: invalid number of workers", optarg);
+                    exit(-1);
+                }
+                break;
+            case 'a':
+                if (aff_parse(optarg) < 0) {
+                    exit(-1);
+                }
+                break;
+            default:
+                usage();
+                exit(-1);
+        }
+    }
+
+    if (optind < argc) {
         // Too many args.
         usage();
         exit(-1);
-    } else if (argc == 2) {
-        if (strcmp(argv[1], "-d") != 0) {
-            // Invalid option.
-            usage();
-            exit(-1);
-        }
+    }
 
-        daemon_mode = true;
+    if (naddresses == 0) {
+        if (!sock_opts) {
+            sock_opts = sock_opts_new(NULL);
+            if (!sock_opts) {
+                exit(-1);
+            }
+            profiles[nprofiles++] = sock_opts;
+        }
+        addresses[naddresses] = NULL; // All interfaces, IPv4 and IPv6.
+        address_opts[naddresses++] = sock_opts;
     }
 
     // Register SIGINT and SIGTERM as (graceful) exit signals.
@@ -82,42 +204,64 @@ int main(int argc, char** argv) {
         exit(-1);
     }
 
-    // Create socket for accepting connections on port PORT. If the socket is
-    // successfully created, daemonize the process, then start listening for 
-    // incoming connections and log socket address to syslog.
-    int sock_fd = sock_create(NULL, PORT);
-    if (sock_fd < 0) {
-        exit(-1);
-    }
+    // Create and bind sockets for accepting connections on port PORT, one for
+    // each address. If all sockets are successfully created, daemonize the 
+    // process, then start listening for incoming connections.
+    int sock_fds[MAX_SOCKETS];
+    const struct sock_opts* sock_fd_opts[MAX_SOCKETS];
+    void* (*sock_fd_handlers[MAX_SOCKETS])(void*);
+    int nsockets = 0;
 
-    if (daemon_mode) {
-        if (daemonize() < 0) {
+    for (int i = 0; i < naddresses; ++i) {
+        int count = sock_create(addresses[i], PORT, address_opts[i],
+                                sock_fds + nsockets, MAX_SOCKETS - nsockets);
+        if (count < 0) {
             exit(-1);
         }
+        for (int j = 0; j < count; ++j) {
+            sock_fd_handlers[nsockets] = conn_handler;
+            sock_fd_opts[nsockets++] = address_opts[i];
+        }
     }
 
-    if (listen(sock_fd, BACKLOG) < 0) {
-        syslog(LOG_ERR, "listen: %s", strerror(errno));
-        exit(-1);
-    }
-    syslog(LOG_INFO, "Server listening on port %s", PORT);
+    // Unix domain sockets share the protocol, but not the TCP tuning options.
+    // Relative paths are made absolute first, since daemonize changes the
+    // working directory and they are unlinked on exit.
+    for (int i = 0; i < nunix_paths; ++i) {
+        unix_paths_absolute[i] = NULL;
+        if (unix_paths[i][0] != '@' && unix_paths[i][0] != '/') {
+            unix_paths_absolute[i] = path_absolute(unix_paths[i]);
+            if (!unix_paths_absolute[i]) {
+                exit(-1);
+            }
+            unix_paths[i] = unix_paths_absolute[i];
+        }
 
-    // Set socket as nonblocking to avoid stalling while waiting connections.
-    int flags = fcntl(sock_fd, F_GETFL, 0);
-    if (flags < 0) {
-        syslog(LOG_ERR, "fcntl: %s", strerror(errno));
-        exit(-1);
+        if (nsockets == MAX_SOCKETS) {
+            syslog(LOG_ERR, "too many listening sockets");
+            exit(-1);
+        }
+        sock_fds[nsockets] = sock_create_unix(unix_paths[i]);
+        if (sock_fds[nsockets] < 0) {
+            exit(-1);
+        }
+        sock_fd_handlers[nsockets] = unix_handlers[i];
+        sock_fd_opts[nsockets++] = NULL;
     }
 
-    flags |= O_NONBLOCK;
-    if (fcntl(sock_fd, F_SETFL, flags) < 0) {
-        syslog(LOG_ERR, "fcntl: %s", strerror(errno));
-        exit(-1);
+    if (daemon_mode) {
+        if (daemonize() < 0) {
+            exit(-1);
+        }
     }
 
     // Create mutex to synchronize writes to file.
     pthread_mutex_t write_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+    if (compress && store_open(TMPFILE) < 0) {
+        exit(-1);
+    }
+
 #ifndef USE_AESD_CHAR_DEVICE
     // Block SIGALRM on master thread and all subsequently spawned threads,
     // then spawn a dedicated thread with a timer
@@ -132,101 +276,66 @@ int main(int argc, char** argv) {
     }
 
     pthread_t timer_thread;
-    if (pthread_create(&timer_thread, NULL, timer_handler, (void*)&write_mutex) < 0) {
-        syslog(LOG_ERR, "pthread_create: %s", strerror(errno));
+    pthread_attr_t timer_attr;
+    if (aff_attr_init(&timer_attr, "timer", -1) < 0) {
+        exit(-1);
+    }
+    error = pthread_create(&timer_thread, &timer_attr, timer_handler, (void*)&write_mutex);
+    pthread_attr_destroy(&timer_attr);
+    if (error != 0) {
+        syslog(LOG_ERR, "pthread_create: %s", strerror(error));
         exit(-1);
     }
 #endif
 
-    // Keep accepting connections until receiving either a SIGINT or a SIGTERM.
-    // After accepting a new connection dispatch a thread that handles it, then
-    // loop on all active threads to check if someone has finished.
-    struct cl_head head;
-    SLIST_INIT(&head);
-    struct cl_entry* tail = NULL;
+    // Start one accept thread for each socket. All of them dispatch accepted
+    // connections to the same connection engine, while the main thread joins
+    // terminated connections until receiving either a SIGINT or a SIGTERM.
+    struct listener* listeners[MAX_SOCKETS];
+    int nlisteners = 0;
 
     bool abort = false; // Used skip to connection/program finalization.
 
-    while(!abort && !sig_exit) {
-        int conn_fd = accept(sock_fd, NULL, NULL);
-        if (conn_fd < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-                syslog(LOG_ERR, "accept: %s", strerror(errno));
+    if (nworkers > 0 && task_start(nworkers) < 0) {
+        abort = true;
+    }
+
+    for (int i = 0; !abort && i < nsockets; ++i) {
+        listeners[nlisteners] = lst_start(sock_fds[i], &write_mutex, sock_fd_opts[i],
+                                         sock_fd_handlers[i]);
+        if (!listeners[nlisteners]) {
             abort = true;
             break;
         }
+        nlisteners++;
+    }
+    syslog(LOG_INFO, "Server listening on port %s", PORT);
 
-        // Only if new connection was established, create new thread to handle
-        // it, and add it to the list.
-        if (conn_fd > 0) {
-            struct cl_entry* connection = malloc(sizeof(struct cl_entry));
-            connection->descriptor = conn_fd;
-            connection->is_active = true;
-            connection->io_mutex = &write_mutex;
-            error = pthread_create(&connection->thread, NULL, conn_handler, (void*)connection);
-            if (error < 0 && error != EAGAIN) {
-                syslog(LOG_ERR, "pthread_create: %s", strerror(errno));
-                abort = true;
-            }
-            
-            if (tail) {
-                SLIST_INSERT_AFTER(tail, connection, entries);
-            } else {
-                SLIST_INSERT_HEAD(&head, connection, entries);
-            }
-            tail = connection;
-        }
-
-        // Loop and join threads that completed execution.
-        struct cl_entry* previous = NULL;
-        struct cl_entry* current = SLIST_FIRST(&head);
-
-        while(current) {
-            if (!current->is_active) {
-                int* retval;
-                error = pthread_join(current->thread, (void**)&retval);
-                if (error < 0) {
-                    syslog(LOG_ERR, "pthread_join: %s", strerror(error));
-                    abort = true;
-                }
-                if (*retval < 0) {
-                    syslog(LOG_ERR, "thread execution finished with error");
-                    abort = true;
-                }
-
-                SLIST_REMOVE(&head, current, cl_entry, entries);
-                free(current);
+    while (!abort && !sig_exit) {
+        conn_wait(REAP_INTERVAL_MS);
 
-                // Set new current. If previous exists then set it as its next,
-                // otherwise it means that first elem was removed, and we set
-                // new current as the new first element.
-                if (previous) {
-                    current = SLIST_NEXT(previous, entries);
-                } else {
-                    current = SLIST_FIRST(&head);
-                }
-            } else {
-                // No elimination happened, set previous as current, then get
-                // the new current.
-                previous = current;
-                current = SLIST_NEXT(current, entries);
-            }
-        } // End join loop.
+        if (conn_reap(false) < 0 || lst_failed) {
+            abort = true;
+        }
     }
 
-    // Join all remaining threads (keep removing first element until empty).
-    while (!SLIST_EMPTY(&head)) {
-        struct cl_entry* connection = SLIST_FIRST(&head);
-        int* retval;
-        error = pthread_join(connection->thread, (void**)&retval);
-        if (error < 0) {
-            syslog(LOG_ERR, "pthread_join: %s", strerror(error));
-        }
-        if (*retval < 0) {
-            syslog(LOG_ERR, "thread execution finished with error");
-            abort = true;
+    // Stop listeners and the task scheduler, then join all remaining
+    // connection threads.
+    for (int i = 0; i < nlisteners; ++i) {
+        lst_stop(listeners[i]);
+    }
+    task_stop();
+    for (int i = nlisteners; i < nsockets; ++i) {
+        close(sock_fds[i]);
+    }
+    for (int i = 0; i < nunix_paths; ++i) {
+        if (unix_paths[i][0] != '@' && unlink(unix_paths[i]) < 0) {
+            syslog(LOG_ERR, "unlink: %s: %s", unix_paths[i], strerror(errno));
         }
-        SLIST_REMOVE_HEAD(&head, entries);
-        free(connection);
+    }
+
+    if (conn_reap(true) < 0) {
+        abort = true;
     }
 
 #ifndef USE_AESD_CHAR_DEVICE
@@ -242,6 +351,7 @@ int main(int argc, char** argv) {
     }
 
     // Remove temporary file (not for /dev/aesdchar).
+    store_close();
     error = remove(TMPFILE);
     if (error < 0) {
         syslog(LOG_ERR, "remove: %s: %s", TMPFILE, strerror(errno));
@@ -249,7 +359,13 @@ int main(int argc, char** argv) {
 #endif
 
     // Finalize program.
-    close(sock_fd);
+    for (int i = 0; i < nprofiles; ++i) {
+        free(profiles[i]);
+    }
+    for (int i = 0; i < nunix_paths; ++i) {
+        free(unix_paths_absolute[i]);
+    }
+    aff_free();
     closelog();
 
     if (abort && !sig_exit) return -1;
@@ -0,0 +1,336 @@
+#define _GNU_SOURCE // cpu_set_t, pthread_attr_setaffinity_np
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <syslog.h>
+
+//
+// Placement of threads on CPUs (option -a).
+//
+// Each thread role (accept threads of listeners, connection threads and the
+// timer thread) can be pinned to a set of CPUs, given as a list or as a NUMA
+// node. Threads are pinned from their creation, so that their stack and the
+// buffers they allocate are placed on their node by the kernel on first touch.
+// With steering, a connection thread is also restricted to the node of the CPU
+// that processed the incoming traffic of its socket (SO_INCOMING_CPU), i.e.
+// the node of the NIC queue, so that received data is not read across nodes.
+//
+#define AFF_NODE_PATH "/sys/devices/system/node"
+#define AFF_LISTSIZE 1024 // Longest CPU list read from sysfs.
+
+//
+// CPU sets of the thread roles, used only if set.
+//
+static struct {
+    const char* name;
+    bool set;
+    cpu_set_t cpus;
+} aff_roles[] = {
+    { "accept" },
+    { "conn" },
+    { "timer" },
+};
+
+//
+// NUMA topology, loaded when steering is enabled.
+//
+static bool aff_steer = false;
+static int aff_cpu_node[CPU_SETSIZE];
+static cpu_set_t* aff_node_cpus = NULL;
+static int aff_nnodes = 0;
+
+//
+// Parses a CPU list such as "0-3,8,10-11" into set.
+// On success, returns 0. On failure, returns -1.
+//
+static int aff_parse_cpus(const char* list, cpu_set_t* set) {
+    CPU_ZERO(set);
+
+    while (*list && *list != '\n') {
+        char* end;
+        unsigned long first = strtoul(list, &end, 10);
+        unsigned long last = first;
+        if (end == list) {
+            return -1;
+        }
+        if (*end == '-') {
+            list = end + 1;
+            last = strtoul(list, &end, 10);
+            if (end == list) {
+                return -1;
+            }
+        }
+        if (first > last || last >= CPU_SETSIZE) {
+            return -1;
+        }
+        for (unsigned long cpu = first; cpu <= last; ++cpu) {
+            CPU_SET(cpu, set);
+        }
+
+        list = end;
+        if (*list == ',') {
+            list++;
+        } else if (*list && *list != '\n') {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+//
+// Reads the CPUs of a NUMA node from sysfs.
+// On success, returns 0. On failure, returns -1.
+//
+static int aff_read_node(int node, cpu_set_t* set) {
+    char path[64];
+    char list[AFF_LISTSIZE];
+
+    snprintf(path, sizeof(path), AFF_NODE_PATH "/node%d/cpulist", node);
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        syslog(LOG_ERR, "fopen: %s: %s", path, strerror(errno));
+        return -1;
+    }
+    char* read = fgets(list, sizeof(list), file);
+    fclose(file);
+
+    if (!read || aff_parse_cpus(list, set) < 0) {
+        syslog(LOG_ERR, "%s: cannot parse CPU list", path);
+        return -1;
+    }
+    return 0;
+}
+
+//
+// Loads the node of each CPU. Without NUMA support in the kernel, every CPU
+// is left without node and steering does nothing.
+// On success, returns 0. On failure, returns -1.
+//
+static int aff_load_nodes(void) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        aff_cpu_node[cpu] = -1;
+    }
+
+    DIR* dir = opendir(AFF_NODE_PATH);
+    if (!dir) {
+        syslog(LOG_INFO, "opendir: %s: %s, not steering", AFF_NODE_PATH, strerror(errno));
+        return 0;
+    }
+
+    int retval = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir))) {
+        int node;
+        char extra;
+        if (sscanf(entry->d_name, "node%d%c", &node, &extra) != 1 || node < 0) {
+            continue;
+        }
+
+        if (node >= aff_nnodes) {
+            cpu_set_t* node_cpus = realloc(aff_node_cpus, (node + 1) * sizeof(*node_cpus));
+            if (!node_cpus) {
+                syslog(LOG_ERR, "realloc: %s", strerror(errno));
+                retval = -1;
+                break;
+            }
+            for (int i = aff_nnodes; i <= node; ++i) {
+                CPU_ZERO(&node_cpus[i]);
+            }
+            aff_node_cpus = node_cpus;
+            aff_nnodes = node + 1;
+        }
+
+        if (aff_read_node(node, &aff_node_cpus[node]) < 0) {
+            retval = -1;
+            break;
+        }
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &aff_node_cpus[node])) {
+                aff_cpu_node[cpu] = node;
+            }
+        }
+    }
+
+    closedir(dir);
+    return retval;
+}
+
+//
+// Parses an argument of option -a: either "steer", or "role=cpus" where role
+// is accept, conn or timer, and cpus a CPU list or "node<N>".
+// On success, returns 0. On failure, returns -1.
+//
+int aff_parse(const char* spec) {
+    if (strcmp(spec, "steer") == 0) {
+        if (!aff_steer && aff_load_nodes() < 0) {
+            return -1;
+        }
+        aff_steer = true;
+        return 0;
+    }
+
+    const char* equal = strchr(spec, '=');
+    size_t nroles = sizeof(aff_roles) / sizeof(aff_roles[0]);
+    size_t role;
+    for (role = 0; equal && role < nroles; ++role) {
+        if (strlen(aff_roles[role].name) == (size_t) (equal - spec) &&
+            strncmp(spec, aff_roles[role].name, equal - spec) == 0) {
+            break;
+        }
+    }
+    if (!equal || role == nroles) {
+        syslog(LOG_ERR, "-a %s: unknown thread role", spec);
+        return -1;
+    }
+
+    const char* cpus = equal + 1;
+    cpu_set_t* set = &aff_roles[role].cpus;
+    int node;
+    char extra;
+    if (sscanf(cpus, "node%d%c", &node, &extra) == 1) {
+        if (node < 0 || aff_read_node(node, set) < 0) {
+            return -1;
+        }
+    } else if (aff_parse_cpus(cpus, set) < 0) {
+        syslog(LOG_ERR, "-a %s: invalid CPU list", spec);
+        return -1;
+    }
+
+    // Threads could not be created on a set without any usable CPU.
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        syslog(LOG_ERR, "sched_getaffinity: %s", strerror(errno));
+        return -1;
+    }
+    CPU_AND(set, set, &allowed);
+    if (CPU_COUNT(set) == 0) {
+        syslog(LOG_ERR, "-a %s: no usable CPU", spec);
+        return -1;
+    }
+
+    aff_roles[role].set = true;
+    return 0;
+}
+
+//
+// Returns the CPUs configured for a role, or NULL if the role is not pinned.
+//
+static const cpu_set_t* aff_role_cpus(const char* role) {
+    size_t nroles = sizeof(aff_roles) / sizeof(aff_roles[0]);
+    for (size_t i = 0; i < nroles; ++i) {
+        if (aff_roles[i].set && strcmp(aff_roles[i].name, role) == 0) {
+            return &aff_roles[i].cpus;
+        }
+    }
+    return NULL;
+}
+
+//
+// Returns the NUMA node of the CPU that processed the incoming traffic of a
+// connection, or -1 if steering is disabled or the CPU is unknown. The CPU is
+// -1 for sockets without traffic from a NIC, e.g. Unix domain sockets.
+//
+int aff_conn_node(int conn_fd) {
+    int cpu = -1;
+    socklen_t cpu_size = sizeof(cpu);
+
+    if (!aff_steer || conn_fd < 0 ||
+        getsockopt(conn_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &cpu_size) < 0 ||
+        cpu < 0 || cpu >= CPU_SETSIZE) {
+        return -1;
+    }
+    return aff_cpu_node[cpu];
+}
+
+//
+// Stores in nodes, up to max of them, the nodes having CPUs allowed for the
+// given role, among which threads of the role are spread when steering.
+// Returns the number of nodes stored, 0 if steering is disabled.
+//
+int aff_steer_nodes(const char* role, int* nodes, int max) {
+    const cpu_set_t* cpus = aff_role_cpus(role);
+    cpu_set_t allowed;
+    int count = 0;
+
+    if (!aff_steer) {
+        return 0;
+    }
+    if (!cpus) {
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+            syslog(LOG_ERR, "sched_getaffinity: %s", strerror(errno));
+            return 0;
+        }
+        cpus = &allowed;
+    }
+
+    for (int node = 0; node < aff_nnodes && count < max; ++node) {
+        cpu_set_t node_cpus;
+        CPU_AND(&node_cpus, cpus, &aff_node_cpus[node]);
+        if (CPU_COUNT(&node_cpus) > 0) {
+            nodes[count++] = node;
+        }
+    }
+    return count;
+}
+
+//
+// Initializes the attributes of a thread of the given role ("accept", "conn"
+// or "timer"), pinning it to the CPUs configured for the role, restricted to
+// those of the given node unless it is -1 or none of them is allowed for the
+// role. The caller destroys the attributes.
+// On success, returns 0. On failure, returns -1.
+//
+int aff_attr_init_node(pthread_attr_t* attr, const char* role, int node) {
+    int error = pthread_attr_init(attr);
+    if (error != 0) {
+        syslog(LOG_ERR, "pthread_attr_init: %s", strerror(error));
+        return -1;
+    }
+
+    const cpu_set_t* cpus = aff_role_cpus(role);
+    cpu_set_t node_cpus;
+    if (node >= 0 && node < aff_nnodes) {
+        if (cpus) {
+            CPU_AND(&node_cpus, cpus, &aff_node_cpus[node]);
+        } else {
+            node_cpus = aff_node_cpus[node];
+        }
+        if (CPU_COUNT(&node_cpus) > 0) {
+            cpus = &node_cpus;
+        }
+    }
+
+    if (cpus && (error = pthread_attr_setaffinity_np(attr, sizeof(*cpus), cpus)) != 0) {
+        syslog(LOG_ERR, "pthread_attr_setaffinity_np: %s", strerror(error));
+        pthread_attr_destroy(attr);
+        return -1;
+    }
+
+    return 0;
+}
+
+//
+// Initializes the attributes of a thread of the given role. A connection
+// thread is given its socket, to steer it to the node of its traffic; other
+// threads are given -1. The caller destroys the attributes.
+// On success, returns 0. On failure, returns -1.
+//
+int aff_attr_init(pthread_attr_t* attr, const char* role, int conn_fd) {
+    return aff_attr_init_node(attr, role, aff_conn_node(conn_fd));
+}
+
+//
+// Releases the NUMA topology.
+//
+void aff_free(void) {
+    free(aff_node_cpus);
+    aff_node_cpus = NULL;
+    aff_nnodes = 0;
+}
@@ -4,18 +4,26 @@
 #include <netdb.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/queue.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 #include "../../aesd-char-driver/aesd_ioctl.h"
 
-#define CONN_BUFSIZE 256
+#define CONN_BUFSIZE 4096 // Replay chunk, reads may span several entries.
+#define CONN_TASK_CHUNK (64 * 1024) // Replay bytes sent per task step.
 
 // Name of the file
 extern const char* TMPFILE;
+//
+// Global variables.
+extern bool sig_exit;
 
 //
 // Declarations of objects with external linkage defined in other source files.
@@ -24,9 +32,41 @@ extern const char* TMPFILE;
 int sock_gethost(int, char*, size_t);
 char* sock_getline(int, size_t*);
 int sock_putchars(int, char*, size_t);
+struct sock_opts;
+void sock_cork(int, const struct sock_opts*, bool);
+struct sock_reader;
+struct sock_reader* sock_reader_new(void);
+void sock_reader_free(struct sock_reader*);
+int sock_reader_recv(struct sock_reader*, int, bool);
+char* sock_reader_take(struct sock_reader*, size_t*);
+//
+// ...store.c
+extern bool store_enabled;
+int store_append(const char*, size_t);
+int store_replay(int);
+size_t store_size(void);
+ssize_t store_read(char*, size_t, size_t);
 //
 // ...utils.c
 int putchars(int, char*, size_t);
+//
+// ...affinity.c
+int aff_attr_init(pthread_attr_t*, const char*, int);
+int aff_conn_node(int);
+//
+// ...task.c
+extern bool task_enabled;
+struct task;
+struct task* task_new(void (*)(void*), void*, int);
+void task_free(struct task*);
+int task_submit(struct task*);
+int task_defer(struct task*);
+int task_wait(struct task*, int, uint32_t);
+//
+// ...subscribe.c
+extern const char* SUB_COMMAND;
+void sub_publish(const char*, size_t);
+int sub_serve(int, const char*);
 
 //
 // Connection management
@@ -37,11 +77,89 @@ struct cl_entry {
     bool is_active;
     pthread_t thread;
     pthread_mutex_t* io_mutex;
+    const struct sock_opts* sock_opts;
     SLIST_ENTRY(cl_entry) entries;
 };
 //
 // ...connections linked list head
 SLIST_HEAD(cl_head, cl_entry);
+//
+// ...list of connections handled by the engine, shared by all listeners. The
+// condition is signalled whenever a connection terminates.
+static struct cl_head conn_list = SLIST_HEAD_INITIALIZER(conn_list);
+static pthread_mutex_t conn_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t conn_list_cond = PTHREAD_COND_INITIALIZER;
+//
+// ...connection of the packet protocol run as a task (option -w) instead of a
+// thread: the packet is received, then the replay is sent in steps of
+// CONN_TASK_CHUNK bytes, each one a task run, without blocking on the socket.
+struct conn_task {
+    struct task* task;
+    int descriptor; // -1 once handed over to a subscriber thread.
+    int fd; // Data file, -1 with the compressed store.
+    pthread_mutex_t* io_mutex;
+    const struct sock_opts* sock_opts;
+    char host[NI_MAXHOST];
+    struct sock_reader* reader; // NULL once the packet is received.
+    size_t replay_pos;
+    size_t replay_end;
+    char* chunk;
+    size_t chunk_size;
+    size_t chunk_sent;
+    LIST_ENTRY(conn_task) entries;
+};
+LIST_HEAD(ct_head, conn_task);
+//
+// ...connection tasks in progress, and whether one of them terminated with
+// error since the last reap. Both are protected by the list mutex.
+static struct ct_head conn_tasks = LIST_HEAD_INITIALIZER(conn_tasks);
+static bool conn_tasks_failed = false;
+
+//
+// Appends a buffer of one or more packets to the file, serializing writers
+// with the given mutex, then publishes them to subscribers while still holding
+// it. This is the append path shared by all transports and the timer. With
+// the compressed store (-z), fd is unused and the store takes the buffer.
+// On success, returns 0. On failure, returns -1.
+//
+int conn_append(int fd, pthread_mutex_t* io_mutex, char* buffer, size_t bufsize) {
+    int error;
+
+    if ((error = pthread_mutex_lock(io_mutex))) {
+        syslog(LOG_ERR, "pthread_mutex_lock: %s", strerror(error));
+        return -1;
+    }
+
+    int write_status = store_enabled ? store_append(buffer, bufsize) :
+                                       putchars(fd, buffer, bufsize);
+    if (write_status == 0) {
+        sub_publish(buffer, bufsize);
+    }
+
+    if ((error = pthread_mutex_unlock(io_mutex))) {
+        syslog(LOG_ERR, "pthread_mutex_unlock: %s", strerror(error));
+    }
+
+    if (error != 0 || write_status < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+//
+// Marks a connection as terminated with the given outcome, wakes up the
+// reaper, then exits the calling connection thread.
+//
+void conn_finish(struct cl_entry* connection, bool abort) {
+    pthread_mutex_lock(&conn_list_mutex);
+    connection->is_active = false;
+    connection->descriptor = abort ? -1 : 0; // Reuse as storage for retval.
+    pthread_cond_signal(&conn_list_cond);
+    pthread_mutex_unlock(&conn_list_mutex);
+
+    pthread_exit(&connection->descriptor);
+}
 
 //
 // Takes socket file descriptor associated to an incoming connection, and a
@@ -53,7 +171,9 @@ void* conn_handler(void* handler_arg) {
     // Recover arguments structure.
     struct cl_entry* connection = (struct cl_entry*) handler_arg;
     bool abort = false;
+#ifdef USE_AESD_CHAR_DEVICE
     int error;
+#endif
 
     char conn_host[NI_MAXHOST];
     if (sock_gethost(connection->descriptor, conn_host, sizeof(conn_host)) < 0) {
@@ -79,8 +199,20 @@ void* conn_handler(void* handler_arg) {
         abort = true;
         goto cleanup_fd;
     }
+    if (packet_size == 0) {
+        syslog(LOG_INFO, "%s closed before ending a packet", conn_host);
+        goto cleanup;
+    }
     syslog(LOG_INFO, "received %zu bytes from %s", packet_size, conn_host);
-    
+
+    // Subscribers get pushed new lines instead of a replay of the file.
+    if (strcmp(packet, SUB_COMMAND) == 0) {
+        if (sub_serve(connection->descriptor, conn_host) < 0) {
+            abort = true;
+        }
+        goto cleanup;
+    }
+
 #ifdef USE_AESD_CHAR_DEVICE
     if (strncmp(packet, "AESDCHAR_IOCSEEKTO:", 19) == 0) {
 
@@ -117,17 +249,7 @@ void* conn_handler(void* handler_arg) {
     } else {
 #endif
 
-        if ((error = pthread_mutex_lock(connection->io_mutex))) {
-            syslog(LOG_ERR, "pthread_mutex_lock: %s", strerror(error));
-        }
-
-        int write_status = putchars(fd, packet, packet_size);
-
-        if ((error = pthread_mutex_unlock(connection->io_mutex))) {
-            syslog(LOG_ERR, "pthread_mutex_unlock: %s", strerror(error));
-        }
-
-        if (error != 0 || write_status < 0) {
+        if (conn_append(fd, connection->io_mutex, packet, packet_size) < 0) {
             abort = true;
             goto cleanup;
         }
@@ -144,9 +266,21 @@ void* conn_handler(void* handler_arg) {
     } // end else
 #endif
 
-    // Send the whole content of the file to the connected client.
+    // Send the whole content of the file to the connected client. The socket
+    // is corked meanwhile, so that chunks are coalesced in full frames.
     char buffer[CONN_BUFSIZE];
 
+    sock_cork(connection->descriptor, connection->sock_opts, true);
+
+    if (store_enabled) {
+        if (store_replay(connection->descriptor) < 0) {
+            abort = true;
+            goto cleanup;
+        }
+        sock_cork(connection->descriptor, connection->sock_opts, false);
+        goto cleanup;
+    }
+
     ssize_t bytes_read;
     while ((bytes_read = read(fd, buffer, sizeof(buffer))) > 0) {
         if (sock_putchars(connection->descriptor, buffer, bytes_read) < 0) {
@@ -155,6 +289,8 @@ void* conn_handler(void* handler_arg) {
         }
     }
 
+    sock_cork(connection->descriptor, connection->sock_opts, false);
+
     if (bytes_read < 0) {
         syslog(LOG_ERR, "read: %s", strerror(errno));
         abort = true;
@@ -178,7 +314,402 @@ void* conn_handler(void* handler_arg) {
     }
     syslog(LOG_INFO, "Closed connection from %s", conn_host);
 
-    connection->is_active = false;
-    connection->descriptor = abort ? -1 : 0; // Reuse as storage for retval.
-    pthread_exit(&connection->descriptor);
+    conn_finish(connection, abort);
+    return NULL;
+}
+
+//
+// Creates a new thread that handles the given accepted connection with the
+// given handler, and adds it to the list of connections.
+// On success, returns 0. On failure, closes the connection and returns -1.
+//
+static int conn_spawn(int conn_fd, pthread_mutex_t* io_mutex, const struct sock_opts* sock_opts,
+                      void* (*handler)(void*)) {
+    struct cl_entry* connection = malloc(sizeof(struct cl_entry));
+    if (!connection) {
+        syslog(LOG_ERR, "malloc: %s", strerror(errno));
+        close(conn_fd);
+        return -1;
+    }
+    connection->descriptor = conn_fd;
+    connection->is_active = true;
+    connection->io_mutex = io_mutex;
+    connection->sock_opts = sock_opts;
+
+    pthread_attr_t attr;
+    if (aff_attr_init(&attr, "conn", conn_fd) < 0) {
+        close(conn_fd);
+        free(connection);
+        return -1;
+    }
+
+    pthread_mutex_lock(&conn_list_mutex);
+    int error = pthread_create(&connection->thread, &attr, handler, (void*)connection);
+    if (error == 0) {
+        SLIST_INSERT_HEAD(&conn_list, connection, entries);
+    }
+    pthread_mutex_unlock(&conn_list_mutex);
+    pthread_attr_destroy(&attr);
+
+    if (error != 0) {
+        syslog(LOG_ERR, "pthread_create: %s", strerror(error));
+        close(conn_fd);
+        free(connection);
+        // Running out of threads is transient, drop only this connection.
+        return error == EAGAIN ? 0 : -1;
+    }
+
+    return 0;
+}
+
+//
+// Thread of a subscriber whose packet was received by a connection task. The
+// subscription lasts as long as the connection, so it is not run as a task.
+//
+static void* conn_sub_handler(void* handler_arg) {
+    struct cl_entry* connection = (struct cl_entry*) handler_arg;
+    bool abort = false;
+
+    char conn_host[NI_MAXHOST];
+    if (sock_gethost(connection->descriptor, conn_host, sizeof(conn_host)) < 0) {
+        strcpy(conn_host, "_gethost_failed_");
+    }
+
+    if (sub_serve(connection->descriptor, conn_host) < 0) {
+        abort = true;
+    }
+
+    if (close(connection->descriptor) < 0) {
+        syslog(LOG_ERR, "close: %s", strerror(errno));
+        abort = true;
+    }
+    syslog(LOG_INFO, "Closed connection from %s", conn_host);
+
+    conn_finish(connection, abort);
+    return NULL;
+}
+
+static void conn_task_free(struct conn_task* ct) {
+    if (ct->reader) {
+        sock_reader_free(ct->reader);
+    }
+    if (ct->task) {
+        task_free(ct->task);
+    }
+    free(ct->chunk);
+    free(ct);
+}
+
+//
+// Closes the connection of a task, then frees it. An outcome of abort is
+// reported by the next conn_reap.
+//
+static void conn_task_finish(struct conn_task* ct, bool abort) {
+    if (ct->fd >= 0 && close(ct->fd) < 0) {
+        syslog(LOG_ERR, "close: %s", strerror(errno));
+        abort = true;
+    }
+    if (ct->descriptor >= 0) {
+        if (close(ct->descriptor) < 0) {
+            syslog(LOG_ERR, "close: %s", strerror(errno));
+            abort = true;
+        }
+        syslog(LOG_INFO, "Closed connection from %s", ct->host);
+    }
+
+    pthread_mutex_lock(&conn_list_mutex);
+    LIST_REMOVE(ct, entries);
+    if (abort) {
+        conn_tasks_failed = true;
+        pthread_cond_signal(&conn_list_cond);
+    }
+    pthread_mutex_unlock(&conn_list_mutex);
+
+    conn_task_free(ct);
+}
+
+//
+// Sends the next step of the replay: a chunk of at most CONN_TASK_CHUNK bytes,
+// resuming where the previous step stopped. Once the chunk is sent, the next
+// step is deferred behind the tasks already queued, so that short requests
+// are served in between and idle workers can take over.
+// Returns 1 when the replay is complete, 0 when the task is queued again or
+// waits for the socket, or -1 on failure.
+//
+static int conn_task_send(struct conn_task* ct) {
+    if (ct->chunk_sent == ct->chunk_size) {
+        size_t size = ct->replay_end - ct->replay_pos;
+        size = size < CONN_TASK_CHUNK ? size : CONN_TASK_CHUNK;
+
+        ssize_t bytes_read = 0;
+        if (size > 0) {
+            bytes_read = store_enabled ? store_read(ct->chunk, size, ct->replay_pos) :
+                                         pread(ct->fd, ct->chunk, size, ct->replay_pos);
+        }
+        if (bytes_read < 0) {
+            if (!store_enabled) {
+                syslog(LOG_ERR, "pread: %s", strerror(errno));
+            }
+            return -1;
+        }
+        if (bytes_read == 0) {
+            sock_cork(ct->descriptor, ct->sock_opts, false);
+            return 1;
+        }
+        ct->replay_pos += bytes_read;
+        ct->chunk_size = bytes_read;
+        ct->chunk_sent = 0;
+    }
+
+    while (ct->chunk_sent < ct->chunk_size) {
+        ssize_t bytes_sent = send(ct->descriptor, ct->chunk + ct->chunk_sent,
+                                  ct->chunk_size - ct->chunk_sent, MSG_NOSIGNAL|MSG_DONTWAIT);
+        if (bytes_sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return task_wait(ct->task, ct->descriptor, EPOLLOUT) < 0 ? -1 : 0;
+        }
+        if (bytes_sent < 0) {
+            if (!sig_exit) // Log error only if not handling exit signal.
+                syslog(LOG_ERR, "send: %s", strerror(errno));
+            return -1;
+        }
+        ct->chunk_sent += bytes_sent;
+    }
+
+    if (ct->replay_pos == ct->replay_end) {
+        sock_cork(ct->descriptor, ct->sock_opts, false);
+        return 1;
+    }
+    return task_defer(ct->task) < 0 ? -1 : 0;
+}
+
+//
+// Receives what the socket holds of the packet. Once it is complete, appends
+// it to the file and starts the replay of the content up to it, or hands the
+// connection over to a subscriber thread.
+// Returns 1 when the connection is done with, 0 when the task is queued again
+// or waits for the socket, or -1 on failure.
+//
+static int conn_task_recv(struct conn_task* ct) {
+    int status = sock_reader_recv(ct->reader, ct->descriptor, false);
+    if (status < 0) {
+        return -1;
+    }
+    if (status == 0) {
+        return task_wait(ct->task, ct->descriptor, EPOLLIN) < 0 ? -1 : 0;
+    }
+
+    size_t packet_size;
+    char* packet = sock_reader_take(ct->reader, &packet_size);
+    ct->reader = NULL;
+    if (packet_size == 0) {
+        syslog(LOG_INFO, "%s closed before ending a packet", ct->host);
+        free(packet);
+        return 1;
+    }
+    syslog(LOG_INFO, "received %zu bytes from %s", packet_size, ct->host);
+
+    if (strcmp(packet, SUB_COMMAND) == 0) {
+        free(packet);
+        int conn_fd = ct->descriptor;
+        ct->descriptor = -1;
+        return conn_spawn(conn_fd, ct->io_mutex, ct->sock_opts, conn_sub_handler) < 0 ? -1 : 1;
+    }
+
+    int write_status = conn_append(ct->fd, ct->io_mutex, packet, packet_size);
+    free(packet);
+    if (write_status < 0) {
+        return -1;
+    }
+    syslog(LOG_INFO, "bytes written to %s", TMPFILE);
+
+    // Replay the content up to the packet, even if more is appended meanwhile.
+    if (store_enabled) {
+        ct->replay_end = store_size();
+    } else {
+        off_t end = lseek(ct->fd, 0, SEEK_END);
+        if (end == (off_t) -1) {
+            syslog(LOG_ERR, "lseek: %s", strerror(errno));
+            return -1;
+        }
+        ct->replay_end = end;
+    }
+
+    ct->chunk = malloc(CONN_TASK_CHUNK);
+    if (!ct->chunk) {
+        syslog(LOG_ERR, "malloc: %s", strerror(errno));
+        return -1;
+    }
+
+    sock_cork(ct->descriptor, ct->sock_opts, true);
+    return conn_task_send(ct);
+}
+
+static void conn_task_run(void* task_arg) {
+    struct conn_task* ct = (struct conn_task*) task_arg;
+
+    int status = ct->reader ? conn_task_recv(ct) : conn_task_send(ct);
+    if (status != 0) {
+        conn_task_finish(ct, status < 0);
+    }
+}
+
+//
+// Submits the given accepted connection of the packet protocol to the task
+// scheduler, as the equivalent of a conn_handler thread.
+// On success, returns 0. On failure, closes the connection and returns -1.
+//
+static int conn_submit(int conn_fd, pthread_mutex_t* io_mutex, const struct sock_opts* sock_opts) {
+    struct conn_task* ct = calloc(1, sizeof(struct conn_task));
+    if (!ct) {
+        syslog(LOG_ERR, "calloc: %s", strerror(errno));
+        close(conn_fd);
+        return -1;
+    }
+    ct->descriptor = conn_fd;
+    ct->fd = -1;
+    ct->io_mutex = io_mutex;
+    ct->sock_opts = sock_opts;
+
+    if (sock_gethost(conn_fd, ct->host, sizeof(ct->host)) < 0) {
+        strcpy(ct->host, "_gethost_failed_");
+    }
+    syslog(LOG_INFO, "Accepted connection from %s", ct->host);
+
+    if (!store_enabled) {
+        ct->fd = open(TMPFILE, O_RDWR|O_APPEND|O_CREAT, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+        if (ct->fd < 0) {
+            syslog(LOG_ERR, "open: %s", strerror(errno));
+            goto cleanup;
+        }
+    }
+
+    ct->reader = sock_reader_new();
+    ct->task = task_new(conn_task_run, ct, aff_conn_node(conn_fd));
+    if (!ct->reader || !ct->task) {
+        goto cleanup;
+    }
+
+    pthread_mutex_lock(&conn_list_mutex);
+    LIST_INSERT_HEAD(&conn_tasks, ct, entries);
+    pthread_mutex_unlock(&conn_list_mutex);
+
+    if (task_submit(ct->task) < 0) {
+        conn_task_finish(ct, false);
+        return -1;
+    }
+    return 0;
+
+  cleanup:
+    if (ct->fd >= 0) {
+        close(ct->fd);
+    }
+    close(conn_fd);
+    conn_task_free(ct);
+    return -1;
+}
+
+//
+// Handles the given accepted connection with the given handler (conn_handler
+// for the packet protocol), on its own thread, or as a task when the task
+// scheduler is enabled. Can be called concurrently by many listeners.
+// On success, returns 0. On failure, closes the connection and returns -1.
+//
+int conn_dispatch(int conn_fd, pthread_mutex_t* io_mutex, const struct sock_opts* sock_opts,
+                  void* (*handler)(void*)) {
+    if (task_enabled && handler == conn_handler) {
+        return conn_submit(conn_fd, io_mutex, sock_opts);
+    }
+    return conn_spawn(conn_fd, io_mutex, sock_opts, handler);
+}
+
+//
+// Waits until a connection terminates, or at most timeout_ms milliseconds.
+//
+void conn_wait(long timeout_ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&conn_list_mutex);
+    bool finished = conn_tasks_failed;
+    struct cl_entry* current;
+    SLIST_FOREACH(current, &conn_list, entries) {
+        finished = finished || !current->is_active;
+    }
+    if (!finished) {
+        pthread_cond_timedwait(&conn_list_cond, &conn_list_mutex, &deadline);
+    }
+    pthread_mutex_unlock(&conn_list_mutex);
+}
+
+//
+// Joins threads of terminated connections and removes them from the list. If
+// all is true, waits for every connection instead, and closes the connections
+// of the tasks left by the scheduler, which must be stopped.
+// On success, returns 0. If some thread or task finished with error, returns -1.
+//
+int conn_reap(bool all) {
+    int retval = 0;
+    int error;
+
+    pthread_mutex_lock(&conn_list_mutex);
+
+    struct cl_entry* previous = NULL;
+    struct cl_entry* current = SLIST_FIRST(&conn_list);
+
+    while (current) {
+        if (!all && current->is_active) {
+            // No elimination happened, set previous as current, then get
+            // the new current.
+            previous = current;
+            current = SLIST_NEXT(current, entries);
+            continue;
+        }
+
+        // Unlink before joining, so that the list is not held while waiting.
+        if (previous) {
+            SLIST_NEXT(previous, entries) = SLIST_NEXT(current, entries);
+        } else {
+            SLIST_REMOVE_HEAD(&conn_list, entries);
+        }
+        pthread_mutex_unlock(&conn_list_mutex);
+
+        int* retval_ptr;
+        error = pthread_join(current->thread, (void**)&retval_ptr);
+        if (error != 0) {
+            syslog(LOG_ERR, "pthread_join: %s", strerror(error));
+            retval = -1;
+        } else if (*retval_ptr < 0) {
+            syslog(LOG_ERR, "thread execution finished with error");
+            retval = -1;
+        }
+        free(current);
+
+        // Set new current. If previous exists then set it as its next,
+        // otherwise it means that first elem was removed, and we set
+        // new current as the new first element.
+        pthread_mutex_lock(&conn_list_mutex);
+        current = previous ? SLIST_NEXT(previous, entries) : SLIST_FIRST(&conn_list);
+    }
+
+    if (conn_tasks_failed) {
+        syslog(LOG_ERR, "task execution finished with error");
+        conn_tasks_failed = false;
+        retval = -1;
+    }
+
+    while (all && !LIST_EMPTY(&conn_tasks)) {
+        struct conn_task* ct = LIST_FIRST(&conn_tasks);
+        pthread_mutex_unlock(&conn_list_mutex);
+        conn_task_finish(ct, false);
+        pthread_mutex_lock(&conn_list_mutex);
+    }
+
+    pthread_mutex_unlock(&conn_list_mutex);
+    return retval;
 }
@@ -0,0 +1,162 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <syslog.h>
+#include <unistd.h>
+
+//
+// Defs and constants.
+#define BACKLOG 10
+#define LST_POLL_MS 100 // Interval for checking exit flag while idle.
+//
+// Global variables.
+extern bool sig_exit;
+bool lst_failed = false; // Set when a listener stops because of an error.
+
+//
+// Declarations of objects with external linkage defined in other source files.
+//
+// ...socket.c
+struct sock_opts;
+int sock_gethost(int, char*, size_t);
+void sock_tune(int, const struct sock_opts*);
+void sock_opts_report(int, const struct sock_opts*);
+//
+// ...connection.c
+int conn_dispatch(int, pthread_mutex_t*, const struct sock_opts*, void* (*)(void*));
+//
+// ...affinity.c
+int aff_attr_init(pthread_attr_t*, const char*, int);
+
+//
+// Listening socket together with its own accept thread. Every listener feeds
+// accepted connections to the same connection engine, each with the handler
+// of the listener transport.
+//
+struct listener {
+    int descriptor;
+    char host[NI_MAXHOST];
+    pthread_t thread;
+    bool stop;
+    pthread_mutex_t* io_mutex;
+    const struct sock_opts* sock_opts;
+    void* (*handler)(void*);
+};
+
+//
+// Accept loop of a listener. Waits for incoming connections (checking the exit
+// flag periodically), tunes accepted sockets and dispatches them.
+//
+static void* lst_handler(void* handler_arg) {
+    struct listener* lst = (struct listener*) handler_arg;
+    struct pollfd pfd = { .fd = lst->descriptor, .events = POLLIN };
+
+    while (!sig_exit && !lst->stop) {
+        int ready = poll(&pfd, 1, LST_POLL_MS);
+        if (ready < 0 && errno != EINTR) {
+            syslog(LOG_ERR, "poll: %s", strerror(errno));
+            lst_failed = true;
+            break;
+        }
+        if (ready <= 0) {
+            continue;
+        }
+
+        int conn_fd = accept(lst->descriptor, NULL, NULL);
+        if (conn_fd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ||
+                errno == ECONNABORTED) {
+                continue;
+            }
+            syslog(LOG_ERR, "accept: %s", strerror(errno));
+            lst_failed = true;
+            break;
+        }
+
+        sock_tune(conn_fd, lst->sock_opts);
+
+        if (conn_dispatch(conn_fd, lst->io_mutex, lst->sock_opts, lst->handler) < 0) {
+            lst_failed = true;
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+//
+// Starts listening on a bound socket, then spawns its accept thread. On
+// success, returns the listener. On failure, returns a NULL pointer.
+//
+struct listener* lst_start(int sock_fd, pthread_mutex_t* io_mutex,
+                           const struct sock_opts* sock_opts, void* (*handler)(void*)) {
+    struct listener* lst = malloc(sizeof(*lst));
+    if (!lst) {
+        syslog(LOG_ERR, "malloc: %s", strerror(errno));
+        return NULL;
+    }
+    lst->descriptor = sock_fd;
+    lst->stop = false;
+    lst->io_mutex = io_mutex;
+    lst->sock_opts = sock_opts;
+    lst->handler = handler;
+
+    if (sock_gethost(sock_fd, lst->host, sizeof(lst->host)) < 0) {
+        strcpy(lst->host, "_gethost_failed_");
+    }
+
+    if (listen(sock_fd, BACKLOG) < 0) {
+        syslog(LOG_ERR, "listen: %s", strerror(errno));
+        goto cleanup;
+    }
+
+    // Set socket as nonblocking, so that a connection reset between poll and
+    // accept does not stall the accept thread.
+    int flags = fcntl(sock_fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(sock_fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        syslog(LOG_ERR, "fcntl: %s", strerror(errno));
+        goto cleanup;
+    }
+
+    pthread_attr_t attr;
+    if (aff_attr_init(&attr, "accept", -1) < 0) {
+        goto cleanup;
+    }
+    int error = pthread_create(&lst->thread, &attr, lst_handler, lst);
+    pthread_attr_destroy(&attr);
+    if (error != 0) {
+        syslog(LOG_ERR, "pthread_create: %s", strerror(error));
+        goto cleanup;
+    }
+
+    syslog(LOG_INFO, "Server listening on %s", lst->host);
+    sock_opts_report(sock_fd, sock_opts);
+    return lst;
+
+  cleanup:
+    free(lst);
+    return NULL;
+}
+
+//
+// Stops the accept thread of a listener and waits for it to terminate, then
+// closes the socket and frees the listener.
+//
+void lst_stop(struct listener* lst) {
+    lst->stop = true;
+    int error = pthread_join(lst->thread, NULL);
+    if (error != 0) {
+        syslog(LOG_ERR, "pthread_join: %s", strerror(error));
+    }
+
+    if (close(lst->descriptor) < 0) {
+        syslog(LOG_ERR, "close: %s", strerror(errno));
+    }
+    free(lst);
+}
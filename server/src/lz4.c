@@ -0,0 +1,216 @@
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+//
+// Compressor and decompressor for the LZ4 block format.
+//
+// The output is a standard LZ4 block (no frame header), so it can be inspected
+// with any LZ4 implementation given the uncompressed size. The compressor is a
+// greedy single-pass matcher over a hash table of 4-byte sequences, which is
+// what makes the format fast: repetitive input such as timestamps and
+// structured log lines compresses several-fold at hundreds of MB/s.
+//
+// A block is a series of sequences, each made of a token (literal length in
+// the high nibble, match length - LZ4_MINMATCH in the low one, 15 meaning more
+// length bytes follow), the literals, a 2-byte little endian match offset and
+// the extra match length bytes. The last sequence has literals only, and the
+// format requires the last LZ4_LASTLITERALS bytes to be literals, with the
+// last match starting at least LZ4_MFLIMIT bytes before the end.
+//
+#define LZ4_MINMATCH 4
+#define LZ4_MFLIMIT 12
+#define LZ4_LASTLITERALS 5
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_HASH_BITS 12
+#define LZ4_SKIP_TRIGGER 6 // Misses before the search step grows, log2.
+
+static uint32_t lz4_read32(const uint8_t* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t lz4_hash(uint32_t sequence) {
+    return (sequence * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+//
+// Writes the extra bytes of a length that did not fit in its token nibble.
+//
+static uint8_t* lz4_put_length(uint8_t* op, size_t length) {
+    while (length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = (uint8_t) length;
+    return op;
+}
+
+//
+// Returns the largest size a block compressed from size bytes can take.
+//
+size_t lz4_bound(size_t size) {
+    return size + size / 255 + 16;
+}
+
+//
+// Compresses src_size bytes of src to dst, which has room for dst_capacity
+// bytes. On success, returns the compressed size. If the output does not fit,
+// returns 0, which is also how incompressible input can be detected by passing
+// a capacity smaller than src_size.
+//
+size_t lz4_compress(const char* src, size_t src_size, char* dst, size_t dst_capacity) {
+    const uint8_t* base = (const uint8_t*) src;
+    const uint8_t* ip = base;
+    const uint8_t* anchor = base;
+    const uint8_t* end = base + src_size;
+    uint8_t* op = (uint8_t*) dst;
+    uint8_t* op_end = op + dst_capacity;
+    uint32_t table[1 << LZ4_HASH_BITS];
+
+    memset(table, 0, sizeof(table));
+
+    if (src_size > LZ4_MFLIMIT) {
+        const uint8_t* match_limit = end - LZ4_MFLIMIT;
+        const uint8_t* extend_limit = end - LZ4_LASTLITERALS;
+        unsigned int misses = 0;
+
+        while (ip < match_limit) {
+            uint32_t sequence = lz4_read32(ip);
+            uint32_t h = lz4_hash(sequence);
+            const uint8_t* ref = base + table[h];
+            table[h] = (uint32_t) (ip - base);
+
+            if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || lz4_read32(ref) != sequence) {
+                // Move faster through input that does not compress.
+                ip += 1 + (misses++ >> LZ4_SKIP_TRIGGER);
+                continue;
+            }
+            misses = 0;
+
+            uint16_t offset = (uint16_t) (ip - ref);
+            const uint8_t* match_end = ip + LZ4_MINMATCH;
+            ref += LZ4_MINMATCH;
+            while (match_end < extend_limit && *match_end == *ref) {
+                match_end++;
+                ref++;
+            }
+
+            size_t literals = ip - anchor;
+            size_t match_length = match_end - ip - LZ4_MINMATCH;
+            if ((size_t) (op_end - op) < 1 + literals / 255 + 1 + literals + 2 +
+                                         match_length / 255 + 1) {
+                return 0;
+            }
+
+            uint8_t* token = op++;
+            *token = (literals < 15 ? literals : 15) << 4;
+            if (literals >= 15) {
+                op = lz4_put_length(op, literals - 15);
+            }
+            memcpy(op, anchor, literals);
+            op += literals;
+
+            *op++ = offset & 0xff;
+            *op++ = offset >> 8;
+
+            *token |= match_length < 15 ? match_length : 15;
+            if (match_length >= 15) {
+                op = lz4_put_length(op, match_length - 15);
+            }
+
+            ip = match_end;
+            anchor = ip;
+        }
+    }
+
+    // Last sequence, literals only.
+    size_t literals = end - anchor;
+    if ((size_t) (op_end - op) < 1 + literals / 255 + 1 + literals) {
+        return 0;
+    }
+    *op++ = (literals < 15 ? literals : 15) << 4;
+    if (literals >= 15) {
+        op = lz4_put_length(op, literals - 15);
+    }
+    memcpy(op, anchor, literals);
+    op += literals;
+
+    return op - (uint8_t*) dst;
+}
+
+//
+// Decompresses the block of src_size bytes at src to dst, which has room for
+// dst_capacity bytes. Malformed input is detected, never read or written out
+// of bounds. On success, returns the decompressed size. On failure, returns -1.
+//
+ssize_t lz4_decompress(const char* src, size_t src_size, char* dst, size_t dst_capacity) {
+    const uint8_t* ip = (const uint8_t*) src;
+    const uint8_t* end = ip + src_size;
+    uint8_t* op = (uint8_t*) dst;
+    uint8_t* op_end = op + dst_capacity;
+    uint8_t byte;
+
+    while (ip < end) {
+        uint8_t token = *ip++;
+
+        size_t literals = token >> 4;
+        if (literals == 15) {
+            do {
+                if (ip == end) {
+                    return -1;
+                }
+                byte = *ip++;
+                literals += byte;
+            } while (byte == 255);
+        }
+        if (literals > (size_t) (end - ip) || literals > (size_t) (op_end - op)) {
+            return -1;
+        }
+        memcpy(op, ip, literals);
+        ip += literals;
+        op += literals;
+
+        if (ip == end) {
+            break; // Last sequence.
+        }
+
+        if (end - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t) (op - (uint8_t*) dst)) {
+            return -1;
+        }
+
+        size_t match_length = token & 15;
+        if (match_length == 15) {
+            do {
+                if (ip == end) {
+                    return -1;
+                }
+                byte = *ip++;
+                match_length += byte;
+            } while (byte == 255);
+        }
+        match_length += LZ4_MINMATCH;
+        if (match_length > (size_t) (op_end - op)) {
+            return -1;
+        }
+
+        // Matches may overlap their output, e.g. a run of one repeated byte.
+        const uint8_t* ref = op - offset;
+        if (offset >= match_length) {
+            memcpy(op, ref, match_length);
+            op += match_length;
+        } else {
+            while (match_length-- > 0) {
+                *op++ = *ref++;
+            }
+        }
+    }
+
+    return op - (uint8_t*) dst;
+}
@@ -0,0 +1,332 @@
+#define _GNU_SOURCE // memfd_create
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <syslog.h>
+#include <unistd.h>
+
+//
+// Shared-memory ring transport.
+//
+// A client connects to the Unix socket of a shm listener and receives, in a
+// single message with one data byte, two file descriptors via SCM_RIGHTS: a
+// memfd holding a struct shm_ring, and an eventfd used to wake the server.
+// The client maps the memfd (its size is given by fstat) and writes packets,
+// i.e. newline terminated strings, as a byte stream into the ring:
+//
+//   head = ring->head; tail = atomic_load_acquire(&ring->tail);
+//   if (ring->capacity - (head - tail) < len) -> full, retry later;
+//   copy len bytes to ring->data[head % capacity], wrapping around the end;
+//   atomic_store_release(&ring->head, head + len);
+//   atomic_thread_fence(seq_cst);
+//   if (atomic_load(&ring->tail) == head) -> write 1 to the eventfd.
+//
+// That is, the eventfd is only written when the ring transitions from empty,
+// while the server drains it. Closing the socket detaches the client; data
+// still in the ring is consumed before the server closes its side.
+//
+#define SHM_RING_MAGIC 0x52445341 // "ASDR"
+#define SHM_RING_VERSION 1
+#define SHM_RING_CAPACITY (1 << 20) // Data bytes, must be a power of two.
+#define SHM_POLL_MS 100 // Interval for checking exit flag while idle.
+#define SHM_CACHELINE 64
+
+struct shm_ring {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t capacity;
+    // Total bytes written, only modified by the producer (client).
+    _Alignas(SHM_CACHELINE) uint64_t head;
+    // Total bytes consumed, only modified by the consumer (server).
+    _Alignas(SHM_CACHELINE) uint64_t tail;
+    _Alignas(SHM_CACHELINE) char data[];
+};
+
+// Name of the file
+extern const char* TMPFILE;
+//
+// Global variables.
+extern bool sig_exit;
+
+//
+// Declarations of objects with external linkage defined in other source files.
+//
+// ...socket.c
+int sock_gethost(int, char*, size_t);
+//
+// ...connection.c
+struct cl_entry {
+    int descriptor;
+    bool is_active;
+    pthread_t thread;
+    pthread_mutex_t* io_mutex;
+    const struct sock_opts* sock_opts;
+    SLIST_ENTRY(cl_entry) entries;
+};
+int conn_append(int, pthread_mutex_t*, char*, size_t);
+void conn_finish(struct cl_entry*, bool);
+
+//
+// Sends the ring memfd and the eventfd to the client.
+// On success, returns 0. On failure, returns -1.
+//
+static int shm_sendfds(int sock_fd, int mem_fd, int event_fd) {
+    char byte = 0;
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+
+    union { // Ensures proper alignment of control message buffer.
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+    int fds[2] = { mem_fd, event_fd };
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(sock_fd, &msg, MSG_NOSIGNAL) < 0) {
+        syslog(LOG_ERR, "sendmsg: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+//
+// Creates the ring in a sealed memfd and maps it. On success, returns the
+// mapped ring and stores the memfd in mem_fd. On failure, returns NULL.
+//
+static struct shm_ring* shm_create(int* mem_fd) {
+    size_t size = sizeof(struct shm_ring) + SHM_RING_CAPACITY;
+
+    int fd = memfd_create("aesdsocket-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        syslog(LOG_ERR, "memfd_create: %s", strerror(errno));
+        return NULL;
+    }
+
+    if (ftruncate(fd, size) < 0) {
+        syslog(LOG_ERR, "ftruncate: %s", strerror(errno));
+        goto cleanup;
+    }
+
+    // The client must not be able to resize the ring under our feet.
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+        syslog(LOG_ERR, "fcntl: %s", strerror(errno));
+        goto cleanup;
+    }
+
+    struct shm_ring* ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ring == MAP_FAILED) {
+        syslog(LOG_ERR, "mmap: %s", strerror(errno));
+        goto cleanup;
+    }
+
+    ring->magic = SHM_RING_MAGIC;
+    ring->version = SHM_RING_VERSION;
+    ring->capacity = SHM_RING_CAPACITY;
+    ring->head = 0;
+    ring->tail = 0;
+
+    *mem_fd = fd;
+    return ring;
+
+  cleanup:
+    close(fd);
+    return NULL;
+}
+
+//
+// Moves all data available in the ring to the pending buffer, then appends
+// the complete packets found there to the file, keeping the trailing partial
+// packet (if any) for the next round.
+// On success, returns 0. On failure, returns -1.
+//
+static int shm_drain(struct shm_ring* ring, int fd, pthread_mutex_t* io_mutex,
+                     uint64_t* consumed, char** pending, size_t* length, size_t* capacity) {
+    // Only head is trusted from shared memory (and validated), the capacity
+    // and tail could have been overwritten by a misbehaving client.
+    uint64_t tail = *consumed;
+    uint64_t head;
+
+    while ((head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) != tail) {
+        uint64_t count = head - tail;
+        if (count > SHM_RING_CAPACITY) {
+            syslog(LOG_ERR, "shm ring corrupted by client");
+            return -1;
+        }
+
+        if (*length + count > *capacity) {
+            size_t new_capacity = 2 * (*length + count);
+            char* new_pending = realloc(*pending, new_capacity);
+            if (!new_pending) {
+                syslog(LOG_ERR, "realloc: %s", strerror(errno));
+                return -1;
+            }
+            *pending = new_pending;
+            *capacity = new_capacity;
+        }
+
+        // Copy in at most two segments, as data may wrap around the end.
+        uint64_t start = tail & (SHM_RING_CAPACITY - 1);
+        uint64_t first = count < SHM_RING_CAPACITY - start ? count : SHM_RING_CAPACITY - start;
+        memcpy(*pending + *length, ring->data + start, first);
+        memcpy(*pending + *length + first, ring->data, count - first);
+        *length += count;
+        tail = head;
+
+        // Release space to the producer, then check head again. The fence
+        // pairs with the one of the producer, so that either we see its new
+        // head, or it sees the ring empty and writes the eventfd.
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+    *consumed = tail;
+
+    // Append all complete packets at once.
+    char* last_newline = *length > 0 ? memrchr(*pending, '\n', *length) : NULL;
+    if (!last_newline) {
+        return 0;
+    }
+
+    size_t packets_size = last_newline - *pending + 1;
+    if (conn_append(fd, io_mutex, *pending, packets_size) < 0) {
+        return -1;
+    }
+
+    *length -= packets_size;
+    memmove(*pending, *pending + packets_size, *length);
+    return 0;
+}
+
+//
+// Handler of connections accepted by a shm listener. Creates a ring for the
+// client and hands it over, then consumes packets written to the ring until
+// the client disconnects. Packets are appended to the file as conn_handler
+// does, but nothing is sent back.
+//
+void* shm_handler(void* handler_arg) {
+    struct cl_entry* connection = (struct cl_entry*) handler_arg;
+    bool abort = false;
+
+    char conn_host[NI_MAXHOST];
+    if (sock_gethost(connection->descriptor, conn_host, sizeof(conn_host)) < 0) {
+        strcpy(conn_host, "_gethost_failed_");
+    }
+    syslog(LOG_INFO, "Accepted shm ring client from %s", conn_host);
+
+    char* pending = NULL; // Partial packet carried between drains.
+    size_t length = 0, capacity = 0;
+    uint64_t consumed = 0; // Private copy of the ring tail.
+
+    int fd = open(TMPFILE, O_WRONLY|O_APPEND|O_CREAT, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+    if (fd < 0) {
+        syslog(LOG_ERR, "open: %s", strerror(errno));
+        abort = true;
+        goto finalize;
+    }
+
+    int mem_fd;
+    struct shm_ring* ring = shm_create(&mem_fd);
+    if (!ring) {
+        abort = true;
+        goto cleanup_fd;
+    }
+
+    int event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (event_fd < 0) {
+        syslog(LOG_ERR, "eventfd: %s", strerror(errno));
+        abort = true;
+        goto cleanup_ring;
+    }
+
+    if (shm_sendfds(connection->descriptor, mem_fd, event_fd) < 0) {
+        abort = true;
+        goto cleanup;
+    }
+
+    // Sleep until either the client signals new data, or it disconnects.
+    struct pollfd pfds[2] = {
+        { .fd = event_fd, .events = POLLIN },
+        { .fd = connection->descriptor, .events = POLLIN },
+    };
+    bool detached = false;
+
+    while (!detached && !sig_exit) {
+        int ready = poll(pfds, 2, SHM_POLL_MS);
+        if (ready < 0 && errno != EINTR) {
+            syslog(LOG_ERR, "poll: %s", strerror(errno));
+            abort = true;
+            break;
+        }
+
+        if (pfds[0].revents & POLLIN) {
+            uint64_t events;
+            if (read(event_fd, &events, sizeof(events)) < 0 && errno != EAGAIN) {
+                syslog(LOG_ERR, "read: %s", strerror(errno));
+                abort = true;
+                break;
+            }
+        }
+
+        // Clients send nothing on the socket, so readability means hangup.
+        if (pfds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            detached = true;
+        }
+
+        if (shm_drain(ring, fd, connection->io_mutex, &consumed,
+                      &pending, &length, &capacity) < 0) {
+            abort = true;
+            break;
+        }
+    }
+
+    if (length > 0) {
+        syslog(LOG_WARNING, "discarding %zu bytes of incomplete packet from %s",
+               length, conn_host);
+    }
+
+  cleanup:
+    close(event_fd);
+
+  cleanup_ring:
+    munmap(ring, sizeof(struct shm_ring) + SHM_RING_CAPACITY);
+    close(mem_fd);
+
+  cleanup_fd:
+    free(pending);
+    if (close(fd) < 0) {
+        syslog(LOG_ERR, "close: %s", strerror(errno));
+        abort = true;
+    }
+
+  finalize:
+    if (close(connection->descriptor) < 0) {
+        syslog(LOG_ERR, "close: %s", strerror(errno));
+        abort = true;
+    }
+    syslog(LOG_INFO, "Detached shm ring client from %s", conn_host);
+
+    conn_finish(connection, abort);
+    return NULL;
+}
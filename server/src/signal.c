@@ -22,8 +22,8 @@ extern bool sig_exit;
 //
 // Declarations of objects with external linkage defined in other source files.
 //
-// ...utils.c
-int putchars(int, char*, size_t);
+// ...connection.c
+int conn_append(int, pthread_mutex_t*, char*, size_t);
 
 //
 // Handler to update flag when signal is received.
@@ -136,20 +136,8 @@ void* timer_handler(void* arg) {
             goto cleanup;
         }
         
-        error = pthread_mutex_lock(io_mutex);
-        int write_status = 0;
-        if (error == 0) {
-            write_status = putchars(fd, now_str, DATESIZE);
-
-            error = pthread_mutex_unlock(io_mutex);
-            if (error != 0) {
-                syslog(LOG_ERR, "pthread_mutex_unlock: %s", strerror(error));
-            }
-        } else {
-            syslog(LOG_ERR, "pthread_mutex_lock: %s", strerror(error));
-        }
-
-        if (error != 0 || write_status < 0) {
+        // Same append path as client packets, so subscribers get timestamps.
+        if (conn_append(fd, io_mutex, now_str, DATESIZE) < 0) {
             abort = true;
             goto cleanup;
         }
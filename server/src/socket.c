@@ -1,28 +1,212 @@
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
 
+#include <stddef.h>
 #include <stdio.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <unistd.h>
+#include "../../aesd-char-driver/aesd-newline.h"
 
 // 
 // Contants.
 const size_t SOCK_READBUFSIZE = 64;
+#define SOCK_SCANBATCH 16 // Newlines found per scan of received data.
 //
 // Global variables.
 extern bool sig_exit;
 
 //
-// Creates a TCP socket that listens on the given port on all net interfaces.
-// Returns the socket file descriptor. If socket_addr is not NULL, it is used 
-// to return a dynamically allocated string containing the socket address.
+// Socket options profile. Options related to the listening socket (buffer
+// sizes, deferred accept, fast open) are applied by sock_create, the others
+// are applied to each accepted socket by sock_tune, and cork is used by
+// sock_cork to batch multi-chunk replays. A value of -1 leaves the option
+// untouched, i.e. at the system default.
 //
-int sock_create(const char* node, const char* service) {
+struct sock_opts {
+    char profile[16];
+    int nodelay;      // TCP_NODELAY (0/1).
+    int cork;         // TCP_CORK around replays (0/1).
+    int sndbuf;       // SO_SNDBUF (bytes).
+    int rcvbuf;       // SO_RCVBUF (bytes).
+    int busy_poll;    // SO_BUSY_POLL (microseconds).
+    int defer_accept; // TCP_DEFER_ACCEPT (seconds).
+    int fastopen;     // TCP_FASTOPEN (pending requests queue length).
+};
+
+//
+// Predefined profiles. The first one is used when no profile is specified.
+//
+static const struct sock_opts sock_profiles[] = {
+    { "balanced",    1,  1, -1,      -1,      -1, -1, -1 },
+    { "latency",     1,  0, -1,      -1,      50, -1, 16 },
+    { "throughput",  0,  1, 1 << 20, 1 << 20, -1,  1, -1 },
+    { "system",     -1, -1, -1,      -1,      -1, -1, -1 },
+};
+
+//
+// Returns a dynamically allocated copy of the profile with the given name, or
+// of the default profile if name is NULL. Returns NULL if no such profile.
+//
+struct sock_opts* sock_opts_new(const char* name) {
+    size_t nprofiles = sizeof(sock_profiles) / sizeof(sock_profiles[0]);
+
+    for (size_t i = 0; i < nprofiles; ++i) {
+        if (!name || strcmp(name, sock_profiles[i].profile) == 0) {
+            struct sock_opts* opts = malloc(sizeof(*opts));
+            if (!opts) {
+                syslog(LOG_ERR, "malloc: %s", strerror(errno));
+                return NULL;
+            }
+            *opts = sock_profiles[i];
+            return opts;
+        }
+    }
+
+    syslog(LOG_ERR, "unknown socket profile: %s", name);
+    return NULL;
+}
+
+//
+// Returns a dynamically allocated copy of the given profile, or NULL on error.
+//
+struct sock_opts* sock_opts_copy(const struct sock_opts* opts) {
+    struct sock_opts* copy = malloc(sizeof(*copy));
+    if (!copy) {
+        syslog(LOG_ERR, "malloc: %s", strerror(errno));
+        return NULL;
+    }
+    *copy = *opts;
+    return copy;
+}
+
+//
+// Overrides a single option of the profile given a "name=value" string.
+// On success, returns 0. On failure, returns -1.
+//
+int sock_opts_set(struct sock_opts* opts, const char* option) {
+    struct { const char* name; int* value; } fields[] = {
+        { "nodelay",      &opts->nodelay },
+        { "cork",         &opts->cork },
+        { "sndbuf",       &opts->sndbuf },
+        { "rcvbuf",       &opts->rcvbuf },
+        { "busy_poll",    &opts->busy_poll },
+        { "defer_accept", &opts->defer_accept },
+        { "fastopen",     &opts->fastopen },
+    };
+    size_t nfields = sizeof(fields) / sizeof(fields[0]);
+
+    const char* equal = strchr(option, '=');
+    if (!equal) {
+        syslog(LOG_ERR, "invalid socket option: %s", option);
+        return -1;
+    }
+
+    for (size_t i = 0; i < nfields; ++i) {
+        size_t namelen = strlen(fields[i].name);
+        if ((size_t)(equal - option) != namelen ||
+            strncmp(option, fields[i].name, namelen) != 0) {
+            continue;
+        }
+
+        char* end = NULL;
+        long value = strtol(equal + 1, &end, 0);
+        if (end == equal + 1 || *end != '\0' || value < -1 || value > INT_MAX) {
+            syslog(LOG_ERR, "invalid value for socket option: %s", option);
+            return -1;
+        }
+        *fields[i].value = (int) value;
+        return 0;
+    }
+
+    syslog(LOG_ERR, "unknown socket option: %s", option);
+    return -1;
+}
+
+//
+// Sets an integer socket option if value is not -1. Failures are only logged,
+// since options are a tuning aid and the server works without them.
+// On success, returns 0. On failure, returns -1.
+//
+static int sock_setopt(int sock_fd, int level, int name, const char* label, int value) {
+    if (value < 0) {
+        return 0;
+    }
+
+    if (setsockopt(sock_fd, level, name, &value, sizeof(value)) < 0) {
+        syslog(LOG_WARNING, "setsockopt: %s: %s", label, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+//
+// Reports to syslog the profile used by a listening socket, together with the
+// effective values of the buffer sizes as granted by the kernel. Sockets with
+// no profile (Unix domain sockets) are not reported.
+//
+void sock_opts_report(int sock_fd, const struct sock_opts* opts) {
+    if (!opts) {
+        return;
+    }
+
+    int sndbuf = -1, rcvbuf = -1;
+    socklen_t optlen = sizeof(int);
+
+    getsockopt(sock_fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &optlen);
+    optlen = sizeof(int);
+    getsockopt(sock_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &optlen);
+
+    syslog(LOG_INFO, "socket profile %s: nodelay=%d cork=%d sndbuf=%d(%d) "
+           "rcvbuf=%d(%d) busy_poll=%d defer_accept=%d fastopen=%d",
+           opts->profile, opts->nodelay, opts->cork, opts->sndbuf, sndbuf,
+           opts->rcvbuf, rcvbuf, opts->busy_poll, opts->defer_accept,
+           opts->fastopen);
+}
+
+//
+// Applies the per-connection options of the profile to an accepted socket.
+//
+void sock_tune(int conn_fd, const struct sock_opts* opts) {
+    if (!opts) {
+        return;
+    }
+
+    sock_setopt(conn_fd, IPPROTO_TCP, TCP_NODELAY, "TCP_NODELAY", opts->nodelay);
+    sock_setopt(conn_fd, SOL_SOCKET, SO_BUSY_POLL, "SO_BUSY_POLL", opts->busy_poll);
+}
+
+//
+// Enables (on == true) or disables corking of the socket, if the profile asks
+// for it. Uncorking flushes any pending partial frame.
+//
+void sock_cork(int conn_fd, const struct sock_opts* opts, bool on) {
+    if (opts && opts->cork > 0) {
+        sock_setopt(conn_fd, IPPROTO_TCP, TCP_CORK, "TCP_CORK", on ? 1 : 0);
+    }
+}
+
+//
+// Creates and binds a TCP socket for each address returned by getaddrinfo for
+// the given node and port (all net interfaces, both IPv4 and IPv6, when node
+// is NULL), and applies to them the listening options of the given profile.
+// Up to maxfds socket file descriptors are stored in fds.
+// On success, returns the number of sockets created. On failure, returns -1.
+//
+int sock_create(const char* node, const char* service, const struct sock_opts* opts,
+                int* fds, size_t maxfds) {
     int socket_fd, error;
+    size_t nfds = 0;
 
     struct addrinfo hints;
     memset(&hints, 0, sizeof(hints));
@@ -37,41 +221,177 @@ int sock_create(const char* node, const char* service) {
         return -1;
     }
 
-    socket_fd = socket(server_info->ai_family, server_info->ai_socktype, server_info->ai_protocol);
-    if (socket_fd < 0) {
+    // IPv6 sockets accept also IPv4 connections by default, which would make
+    // binding the IPv4 wildcard fail. Restrict them when both are returned.
+    bool v6only = server_info->ai_next != NULL;
+
+    for (struct addrinfo* info = server_info; info; info = info->ai_next) {
+        if (nfds == maxfds) {
+            syslog(LOG_WARNING, "too many addresses, ignoring the remaining ones");
+            break;
+        }
+
+        socket_fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+        if (socket_fd < 0) {
+            syslog(LOG_ERR, "socket: %s", strerror(errno));
+            goto cleanup;
+        }
+        fds[nfds++] = socket_fd;
+
+        int optval = 1; // Set socket option to enabled.
+        if (setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0) {
+            syslog(LOG_ERR, "setsockopt: %s", strerror(errno));
+            goto cleanup;
+        }
+
+        if (info->ai_family == AF_INET6 && v6only &&
+            setsockopt(socket_fd, IPPROTO_IPV6, IPV6_V6ONLY, &optval, sizeof(optval)) < 0) {
+            syslog(LOG_ERR, "setsockopt: %s", strerror(errno));
+            goto cleanup;
+        }
+
+        // Buffer sizes must be set before listen, so that the TCP window scale
+        // advertised during the handshake accounts for them.
+        sock_setopt(socket_fd, SOL_SOCKET, SO_SNDBUF, "SO_SNDBUF", opts->sndbuf);
+        sock_setopt(socket_fd, SOL_SOCKET, SO_RCVBUF, "SO_RCVBUF", opts->rcvbuf);
+        sock_setopt(socket_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, "TCP_DEFER_ACCEPT", opts->defer_accept);
+        sock_setopt(socket_fd, IPPROTO_TCP, TCP_FASTOPEN, "TCP_FASTOPEN", opts->fastopen);
+
+        if (bind(socket_fd, info->ai_addr, info->ai_addrlen) < 0) {
+            syslog(LOG_ERR, "bind: %s", strerror(errno));
+            goto cleanup;
+        }
+    }
+
+    freeaddrinfo(server_info); // This was allocated by getaddrinfo.
+
+    return nfds;
+
+  cleanup:
+    freeaddrinfo(server_info);
+    while (nfds > 0) {
+        close(fds[--nfds]);
+    }
+    return -1;
+}
+
+//
+// Removes the socket file left at addr by a server that is no longer running.
+// Files that are not sockets, and sockets a server still accepts connections
+// on, are left in place. Succeeds if there is nothing at addr.
+// On success, returns 0. On failure, returns -1.
+//
+static int sock_unlink_stale(const struct sockaddr_un* addr, socklen_t addrlen) {
+    const char* path = addr->sun_path;
+    struct stat st;
+
+    if (lstat(path, &st) < 0) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        syslog(LOG_ERR, "lstat: %s: %s", path, strerror(errno));
+        return -1;
+    }
+    if (!S_ISSOCK(st.st_mode)) {
+        syslog(LOG_ERR, "not a socket, not removed: %s", path);
+        return -1;
+    }
+
+    // A refused connection means no server is listening on the socket.
+    int probe_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probe_fd < 0) {
         syslog(LOG_ERR, "socket: %s", strerror(errno));
         return -1;
     }
+    int error = connect(probe_fd, (const struct sockaddr*) addr, addrlen);
+    int connect_errno = errno;
+    close(probe_fd);
+    if (error == 0) {
+        syslog(LOG_ERR, "socket in use by a running server: %s", path);
+        return -1;
+    }
+    if (connect_errno != ECONNREFUSED) {
+        syslog(LOG_ERR, "connect: %s: %s", path, strerror(connect_errno));
+        return -1;
+    }
 
-    int optval = 1; // Set socket option to enabled.
-    if (setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0) {
-        syslog(LOG_ERR, "setsockopt: %s", strerror(errno));
+    if (unlink(path) < 0 && errno != ENOENT) {
+        syslog(LOG_ERR, "unlink: %s: %s", path, strerror(errno));
         return -1;
     }
 
-    if (bind(socket_fd, server_info->ai_addr, server_info->ai_addrlen) < 0) {
-        syslog(LOG_ERR, "bind: %s", strerror(errno));
+    return 0;
+}
+
+//
+// Creates and binds a Unix domain stream socket. If path starts with '@', the
+// socket is bound in the abstract namespace (with the remaining characters as
+// name), otherwise a stale socket file at path is removed before binding (see
+// sock_unlink_stale).
+// On success, returns the socket file descriptor. On failure, returns -1.
+//
+int sock_create_unix(const char* path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    size_t pathlen = strlen(path);
+    if (pathlen == 0 || pathlen >= sizeof(addr.sun_path)) {
+        syslog(LOG_ERR, "invalid unix socket path: %s", path);
         return -1;
     }
+    memcpy(addr.sun_path, path, pathlen);
+    socklen_t addrlen = offsetof(struct sockaddr_un, sun_path) + pathlen;
 
-    freeaddrinfo(server_info); // This was allocated by getaddrinfo.
+    if (path[0] == '@') {
+        addr.sun_path[0] = '\0'; // Abstract names are not null terminated.
+    } else {
+        addrlen += 1;
+        if (sock_unlink_stale(&addr, addrlen) < 0) {
+            return -1;
+        }
+    }
+
+    int socket_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socket_fd < 0) {
+        syslog(LOG_ERR, "socket: %s", strerror(errno));
+        return -1;
+    }
+
+    if (bind(socket_fd, (struct sockaddr*) &addr, addrlen) < 0) {
+        syslog(LOG_ERR, "bind: %s: %s", path, strerror(errno));
+        close(socket_fd);
+        return -1;
+    }
 
     return socket_fd;
 }
 
 // 
-// Returns the host to which the socket is bound to.
+// Returns the host to which the socket is bound to. For Unix domain sockets,
+// returns the socket path prefixed by "unix:" ('@' marks abstract names).
 //
 int sock_gethost(int sockfd, char* host, size_t hostlen) {
-    struct sockaddr addr;
+    struct sockaddr_storage addr; // Large enough for any address family.
     socklen_t addrlen = sizeof(addr);
     
-    if (getsockname(sockfd, &addr, &addrlen) < 0) {
+    if (getsockname(sockfd, (struct sockaddr*) &addr, &addrlen) < 0) {
         syslog(LOG_ERR, "getsockname: %s", strerror(errno));
         return -1;
     }
 
-    int error = getnameinfo(&addr, addrlen, host, hostlen, NULL, 0, NI_NUMERICHOST);
+    if (addr.ss_family == AF_UNIX) {
+        struct sockaddr_un* unix_addr = (struct sockaddr_un*) &addr;
+        int pathlen = addrlen - offsetof(struct sockaddr_un, sun_path);
+        if (pathlen > 0 && unix_addr->sun_path[0] == '\0') {
+            snprintf(host, hostlen, "unix:@%.*s", pathlen - 1, unix_addr->sun_path + 1);
+        } else {
+            snprintf(host, hostlen, "unix:%.*s", pathlen, unix_addr->sun_path);
+        }
+        return 0;
+    }
+
+    int error = getnameinfo((struct sockaddr*) &addr, addrlen, host, hostlen, NULL, 0, NI_NUMERICHOST);
     if (error != 0) {
         syslog(LOG_ERR, "getnameinfo: %s", gai_strerror(error));
         return -1;
@@ -81,77 +401,132 @@ int sock_gethost(int sockfd, char* host, size_t hostlen) {
 }
 
 //
-// Reads characters from socket until a newline is found. On succes, returns a
-// pointer to a dynamically allocated string containing the line. On failure,
-// returns a NULL pointer.
+// Incremental reader of the lines of a packet, see sock_reader_recv.
 //
-char* sock_getline(int connection_fd, size_t* out_length) {
-    char buffer[SOCK_READBUFSIZE+1];
-    buffer[SOCK_READBUFSIZE] = '\0';
-    size_t buflen = sizeof(buffer) / sizeof(buffer[0]);
+struct sock_reader {
+    char* string;
+    size_t capacity;
+    size_t length; // Bytes received.
+    size_t lines_length; // Bytes up to the last newline received.
+};
 
-    char* string = (char*) malloc(buflen * sizeof(*string));
-    size_t maxreadlen = buflen - 1;
-    size_t capacity = maxreadlen;
-    size_t length = 0;
+//
+// Returns a new reader, or NULL on failure.
+//
+struct sock_reader* sock_reader_new(void) {
+    struct sock_reader* reader = malloc(sizeof(*reader));
+    char* string = malloc(SOCK_READBUFSIZE + 1);
+    if (!reader || !string) {
+        syslog(LOG_ERR, "malloc: %s", strerror(errno));
+        free(reader);
+        free(string);
+        return NULL;
+    }
+    reader->string = string;
+    reader->capacity = SOCK_READBUFSIZE;
+    reader->length = 0;
+    reader->lines_length = 0;
+    return reader;
+}
 
-    bool abort = false; // Used to stop loop and cleanup allocated memory.
+void sock_reader_free(struct sock_reader* reader) {
+    free(reader->string);
+    free(reader);
+}
 
-    while (!abort) {
-        ssize_t count = recv(connection_fd, buffer, maxreadlen, 0);
+//
+// Reads characters from socket until a newline is found, then whatever the
+// socket already holds. If wait is false, never blocks: returns 0 when the
+// socket holds no more data and no newline was found yet, and the call is to
+// be repeated once the socket is readable. Returns 1 when the lines are
+// complete, or when the peer closed the connection. On failure, returns -1.
+//
+int sock_reader_recv(struct sock_reader* reader, int connection_fd, bool wait) {
+    size_t offsets[SOCK_SCANBATCH];
+
+    while (true) {
+        if (reader->length == reader->capacity) {
+            char* new_string = realloc(reader->string, 2 * reader->capacity + 1);
+            if (!new_string) {
+                syslog(LOG_ERR, "realloc: %s", strerror(errno));
+                return -1;
+            }
+            reader->string = new_string;
+            reader->capacity *= 2;
+        }
+
+        // Once a line is complete, only drain pipelined data without waiting.
+        int flags = reader->lines_length > 0 || !wait ? MSG_DONTWAIT : 0;
+        ssize_t count = recv(connection_fd, reader->string + reader->length,
+                             reader->capacity - reader->length, flags);
+        if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (reader->lines_length > 0) {
+                return 1;
+            }
+            if (!wait) {
+                return 0;
+            }
+        }
         if (count < 0) {
             if (!sig_exit) // Log error only if not handling exit signal.
                 syslog(LOG_ERR, "recv: %s", strerror(errno));
-            abort = true;
-            break;
+            return -1;
+        }
+        if (count == 0) {
+            return 1; // Closed by the peer.
         }
 
-        // Reallocate if updated lenght
-        size_t new_length = length + count;
-        if (new_length > capacity) {
-            size_t new_capacity = 2 * capacity;
-            char* new_string;
-
-            new_string = realloc(string, new_capacity * sizeof(*string));
-            if (!new_string) {
-                syslog(LOG_ERR, "realloc: %s", strerror(errno));
-                abort = true;
-                break;
+        // Scan only the received bytes, in a single pass, for the last newline.
+        size_t found;
+        size_t scanned = 0;
+        do {
+            found = aesd_newline_scan(reader->string + reader->length + scanned,
+                                      count - scanned, offsets, SOCK_SCANBATCH);
+            if (found > 0) {
+                scanned += offsets[found - 1] + 1;
+                reader->lines_length = reader->length + scanned;
             }
+        } while (found == SOCK_SCANBATCH);
+        reader->length += count;
+    }
+}
 
-            string = new_string;
-            capacity = new_capacity;
-        }
+//
+// Frees the reader and returns the lines it received, as a dynamically
+// allocated string. A partial line after them is discarded.
+//
+char* sock_reader_take(struct sock_reader* reader, size_t* out_length) {
+    char* string = reader->string;
 
-        // Compute string tail, i.e. one after last valid char in string.
-        char* str_tail = string + length;
-        
-        // Check if newline is present. If it is, append characters up to 
-        // the newline to tail, then go to cleanup.
-        char* newline_pos = strchr(buffer, '\n');
-        if (newline_pos) {
-            *(newline_pos + 1) = '\0';
-            strcpy(str_tail, buffer);
-            length += count;
-            break;
-        }
-        
-        strcpy(str_tail, buffer);
-        length = new_length;
+    string[reader->lines_length] = '\0';
+    if (out_length) {
+        *out_length = reader->lines_length;
     }
+    free(reader);
+    return string;
+}
 
-    // If something went wrong free memory and return NULL pointer.
-    if (abort) {
-        free(string);
+//
+// Reads characters from socket until a newline is found, then whatever the
+// socket already holds. The line is returned together with the complete lines
+// that followed it, so that pipelined lines are appended at once; a partial
+// line after them is discarded. On success, returns a pointer to a
+// dynamically allocated string containing the lines, which is empty if the
+// peer closed the connection before ending a line. On failure, returns a NULL
+// pointer.
+//
+char* sock_getline(int connection_fd, size_t* out_length) {
+    struct sock_reader* reader = sock_reader_new();
+    if (!reader) {
         return NULL;
     }
 
-    // Return length if length pointer is not null
-    if (out_length) {
-        *out_length = length;
+    if (sock_reader_recv(reader, connection_fd, true) < 0) {
+        sock_reader_free(reader);
+        return NULL;
     }
 
-    return string;
+    return sock_reader_take(reader, out_length);
 }
 
 // 
@@ -164,7 +539,7 @@ int sock_putchars(int sock_fd, char* buffer, size_t bufsize) {
     ssize_t bytes_sent = 0;
 
     while (bytes_left > 0) {
-        bytes_sent = send(sock_fd, buf_head, bytes_left, 0);
+        bytes_sent = send(sock_fd, buf_head, bytes_left, MSG_NOSIGNAL);
         if (bytes_sent < 0) {
             if (!sig_exit) // Log error only if not handling exit signal.
                 syslog(LOG_ERR, "send: %s", strerror(errno));
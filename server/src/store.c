@@ -0,0 +1,431 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <syslog.h>
+#include <unistd.h>
+
+//
+// Compressed storage of the data file (option -z).
+//
+// Appended packets accumulate in memory in the open chunk. Once it would grow
+// past STORE_CHUNK_SIZE it is sealed: compressed with LZ4 (see lz4.c) and
+// appended to the data file as a record, a struct store_record followed by the
+// compressed bytes (or the raw ones, if they do not compress). Chunks hold
+// whole packets, so they always end with a newline. Only the index of sealed
+// chunks stays in memory.
+//
+// A replay sends the sealed chunks, then the open one. Chunks are decompressed
+// lazily, and the last STORE_CACHE_CHUNKS decompressed are kept, so that the
+// replays following each packet, which all start from the oldest chunk, do not
+// decompress the same data over and over.
+//
+#define STORE_CHUNK_SIZE (64 * 1024) // Raw bytes per chunk, unless a packet is larger.
+#define STORE_CACHE_CHUNKS 4 // Decompressed chunks kept for replays.
+#define STORE_RECORD_MAGIC 0x4b485341 // "ASHK"
+
+bool store_enabled = false;
+
+//
+// Declarations of objects with external linkage defined in other source files.
+//
+// ...lz4.c
+size_t lz4_bound(size_t);
+size_t lz4_compress(const char*, size_t, char*, size_t);
+ssize_t lz4_decompress(const char*, size_t, char*, size_t);
+//
+// ...socket.c
+int sock_putchars(int, char*, size_t);
+//
+// ...utils.c
+int putchars(int, char*, size_t);
+
+//
+// Header of a chunk in the data file. The data is compressed unless
+// stored_size equals raw_size.
+//
+struct store_record {
+    uint32_t magic;
+    uint32_t raw_size;
+    uint32_t stored_size;
+};
+
+struct store_chunk {
+    off_t offset; // Of the data, after the record header.
+    size_t raw_offset; // Of the first byte, in the raw content of the store.
+    uint32_t raw_size;
+    uint32_t stored_size;
+};
+
+//
+// Decompressed chunk, referenced by the cache and by the replays sending it.
+//
+struct store_cached {
+    size_t index;
+    unsigned int refcount;
+    unsigned long last_use;
+    size_t size;
+    char data[];
+};
+
+//
+// Store state. The caller of store_append serializes appends, the lock
+// protects what replays read: the index, the open chunk and the cache.
+//
+static struct {
+    int fd;
+    off_t file_size;
+    struct store_chunk* chunks;
+    size_t nchunks;
+    size_t chunks_capacity;
+    char* open;
+    size_t open_size;
+    size_t open_capacity;
+    size_t sealed_size; // Raw bytes in sealed chunks.
+    size_t raw_total;
+    bool failed; // Set when a partial record could not be removed.
+    struct store_cached* cache[STORE_CACHE_CHUNKS];
+    unsigned long use_clock;
+    pthread_mutex_t lock;
+} store = { .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+//
+// Creates the data file, replacing what it held before.
+// On success, returns 0. On failure, returns -1.
+//
+int store_open(const char* path) {
+    store.fd = open(path, O_RDWR|O_APPEND|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+    if (store.fd < 0) {
+        syslog(LOG_ERR, "open: %s: %s", path, strerror(errno));
+        return -1;
+    }
+    store_enabled = true;
+    return 0;
+}
+
+static void store_put(struct store_cached* cached) {
+    pthread_mutex_lock(&store.lock);
+    bool last = --cached->refcount == 0;
+    pthread_mutex_unlock(&store.lock);
+    if (last) {
+        free(cached);
+    }
+}
+
+//
+// Logs the compression ratio, then releases the store.
+//
+void store_close(void) {
+    if (!store_enabled) {
+        return;
+    }
+    syslog(LOG_INFO, "store: %zu bytes in %zu chunks, %lld bytes on disk",
+           store.raw_total, store.nchunks, (long long) store.file_size);
+
+    for (size_t i = 0; i < STORE_CACHE_CHUNKS; ++i) {
+        if (store.cache[i]) {
+            store_put(store.cache[i]);
+        }
+    }
+    free(store.chunks);
+    free(store.open);
+    if (close(store.fd) < 0) {
+        syslog(LOG_ERR, "close: %s", strerror(errno));
+    }
+    store_enabled = false;
+}
+
+//
+// Compresses the open chunk and appends it to the data file, then empties it.
+// On success, returns 0. On failure, returns -1.
+//
+static int store_seal(void) {
+    size_t bufsize = sizeof(struct store_record) + lz4_bound(store.open_size);
+    char* buffer = malloc(bufsize);
+    if (!buffer) {
+        syslog(LOG_ERR, "malloc: %s", strerror(errno));
+        return -1;
+    }
+
+    // Keep the raw bytes if compression would not save anything.
+    struct store_record record = { .magic = STORE_RECORD_MAGIC, .raw_size = store.open_size };
+    record.stored_size = lz4_compress(store.open, store.open_size,
+                                      buffer + sizeof(record), store.open_size - 1);
+    if (record.stored_size == 0) {
+        record.stored_size = store.open_size;
+        memcpy(buffer + sizeof(record), store.open, store.open_size);
+    }
+    memcpy(buffer, &record, sizeof(record));
+
+    if (store.nchunks == store.chunks_capacity) {
+        size_t capacity = store.chunks_capacity ? 2 * store.chunks_capacity : 64;
+        struct store_chunk* chunks = malloc(capacity * sizeof(*chunks));
+        if (!chunks) {
+            syslog(LOG_ERR, "malloc: %s", strerror(errno));
+            free(buffer);
+            return -1;
+        }
+        // Replays may be reading the index, swap it under the lock.
+        pthread_mutex_lock(&store.lock);
+        if (store.nchunks > 0) {
+            memcpy(chunks, store.chunks, store.nchunks * sizeof(*chunks));
+        }
+        struct store_chunk* old_chunks = store.chunks;
+        store.chunks = chunks;
+        store.chunks_capacity = capacity;
+        pthread_mutex_unlock(&store.lock);
+        free(old_chunks);
+    }
+
+    int write_status = putchars(store.fd, buffer, sizeof(record) + record.stored_size);
+    free(buffer);
+    if (write_status < 0) {
+        // Drop the partial record, the offsets of the next chunks rely on
+        // file_size. If that fails too, the file can no longer be appended to.
+        if (ftruncate(store.fd, store.file_size) < 0) {
+            syslog(LOG_ERR, "ftruncate: %s", strerror(errno));
+            store.failed = true;
+        }
+        return -1;
+    }
+
+    pthread_mutex_lock(&store.lock);
+    store.chunks[store.nchunks].offset = store.file_size + sizeof(record);
+    store.chunks[store.nchunks].raw_offset = store.sealed_size;
+    store.chunks[store.nchunks].raw_size = record.raw_size;
+    store.chunks[store.nchunks].stored_size = record.stored_size;
+    store.nchunks++;
+    store.sealed_size += record.raw_size;
+    store.file_size += sizeof(record) + record.stored_size;
+    store.open_size = 0;
+    pthread_mutex_unlock(&store.lock);
+
+    return 0;
+}
+
+//
+// Appends a buffer of one or more packets. Calls must be serialized by the
+// caller, as conn_append does with the file mutex.
+// On success, returns 0. On failure, returns -1.
+//
+int store_append(const char* buffer, size_t bufsize) {
+    if (store.failed) {
+        syslog(LOG_ERR, "store: data file is corrupted");
+        return -1;
+    }
+
+    if (store.open_size > 0 && store.open_size + bufsize > STORE_CHUNK_SIZE) {
+        if (store_seal() < 0) {
+            return -1;
+        }
+    }
+
+    if (store.open_size + bufsize > store.open_capacity) {
+        size_t capacity = store.open_size + bufsize > STORE_CHUNK_SIZE ?
+                          store.open_size + bufsize : STORE_CHUNK_SIZE;
+        char* open = malloc(capacity);
+        if (!open) {
+            syslog(LOG_ERR, "malloc: %s", strerror(errno));
+            return -1;
+        }
+        // Replays may be copying the open chunk, swap it under the lock.
+        pthread_mutex_lock(&store.lock);
+        if (store.open_size > 0) {
+            memcpy(open, store.open, store.open_size);
+        }
+        free(store.open);
+        store.open = open;
+        store.open_capacity = capacity;
+        pthread_mutex_unlock(&store.lock);
+    }
+
+    pthread_mutex_lock(&store.lock);
+    memcpy(store.open + store.open_size, buffer, bufsize);
+    store.open_size += bufsize;
+    store.raw_total += bufsize;
+    pthread_mutex_unlock(&store.lock);
+
+    // A packet larger than a chunk is sealed on its own right away.
+    if (store.open_size >= STORE_CHUNK_SIZE) {
+        return store_seal();
+    }
+    return 0;
+}
+
+//
+// Returns chunk index decompressed, with a reference the caller drops with
+// store_put. On failure, returns NULL.
+//
+static struct store_cached* store_get(size_t index) {
+    struct store_cached* cached = NULL;
+    struct store_chunk chunk;
+    size_t slot = 0;
+
+    pthread_mutex_lock(&store.lock);
+    for (size_t i = 0; i < STORE_CACHE_CHUNKS; ++i) {
+        if (store.cache[i] && store.cache[i]->index == index) {
+            cached = store.cache[i];
+            cached->refcount++;
+            cached->last_use = ++store.use_clock;
+            break;
+        }
+    }
+    chunk = store.chunks[index];
+    pthread_mutex_unlock(&store.lock);
+
+    if (cached) {
+        return cached;
+    }
+
+    char* stored = malloc(chunk.stored_size);
+    cached = malloc(sizeof(*cached) + chunk.raw_size);
+    if (!stored || !cached) {
+        syslog(LOG_ERR, "malloc: %s", strerror(errno));
+        goto cleanup;
+    }
+
+    for (size_t done = 0; done < chunk.stored_size; ) {
+        ssize_t bytes_read = pread(store.fd, stored + done, chunk.stored_size - done,
+                                   chunk.offset + done);
+        if (bytes_read <= 0) {
+            syslog(LOG_ERR, "pread: %s", bytes_read < 0 ? strerror(errno) : "short file");
+            goto cleanup;
+        }
+        done += bytes_read;
+    }
+
+    if (chunk.stored_size == chunk.raw_size) {
+        memcpy(cached->data, stored, chunk.raw_size);
+    } else if (lz4_decompress(stored, chunk.stored_size, cached->data, chunk.raw_size) !=
+               (ssize_t) chunk.raw_size) {
+        syslog(LOG_ERR, "store: chunk %zu is corrupted", index);
+        goto cleanup;
+    }
+    free(stored);
+    cached->index = index;
+    cached->size = chunk.raw_size;
+    cached->refcount = 2; // The cache and the caller.
+
+    // Replace the least recently used chunk.
+    pthread_mutex_lock(&store.lock);
+    for (size_t i = 0; i < STORE_CACHE_CHUNKS; ++i) {
+        if (!store.cache[i]) {
+            slot = i;
+            break;
+        }
+        if (store.cache[i]->last_use < store.cache[slot]->last_use) {
+            slot = i;
+        }
+    }
+    struct store_cached* evicted = store.cache[slot];
+    store.cache[slot] = cached;
+    cached->last_use = ++store.use_clock;
+    pthread_mutex_unlock(&store.lock);
+
+    if (evicted) {
+        store_put(evicted);
+    }
+    return cached;
+
+  cleanup:
+    free(stored);
+    free(cached);
+    return NULL;
+}
+
+//
+// Sends the whole content of the store to a socket: the chunks sealed when
+// the replay starts, then what the open chunk held at that time.
+// On success, returns 0. On failure, returns -1.
+//
+int store_replay(int sock_fd) {
+    pthread_mutex_lock(&store.lock);
+    size_t nchunks = store.nchunks;
+    size_t open_size = store.open_size;
+    char* open = malloc(open_size + 1);
+    if (open && open_size > 0) {
+        memcpy(open, store.open, open_size);
+    }
+    pthread_mutex_unlock(&store.lock);
+
+    if (!open) {
+        syslog(LOG_ERR, "malloc: %s", strerror(errno));
+        return -1;
+    }
+
+    int retval = 0;
+    for (size_t index = 0; index < nchunks && retval == 0; ++index) {
+        struct store_cached* cached = store_get(index);
+        if (!cached) {
+            retval = -1;
+            break;
+        }
+        retval = sock_putchars(sock_fd, cached->data, cached->size);
+        store_put(cached);
+    }
+
+    if (retval == 0 && open_size > 0) {
+        retval = sock_putchars(sock_fd, open, open_size);
+    }
+
+    free(open);
+    return retval;
+}
+
+//
+// Returns the raw size of the store content.
+//
+size_t store_size(void) {
+    pthread_mutex_lock(&store.lock);
+    size_t size = store.raw_total;
+    pthread_mutex_unlock(&store.lock);
+    return size;
+}
+
+//
+// Reads up to bufsize bytes of the raw content of the store, at position pos,
+// without crossing the end of a chunk. This is the equivalent of pread for
+// replays sent in steps (see conn_task_send).
+// On success, returns the number of bytes read, 0 at the end of the content.
+// On failure, returns -1.
+//
+ssize_t store_read(char* buffer, size_t bufsize, size_t pos) {
+    pthread_mutex_lock(&store.lock);
+    if (pos >= store.sealed_size) {
+        size_t open_pos = pos - store.sealed_size;
+        size_t count = open_pos < store.open_size ? store.open_size - open_pos : 0;
+        count = count < bufsize ? count : bufsize;
+        if (count > 0) {
+            memcpy(buffer, store.open + open_pos, count);
+        }
+        pthread_mutex_unlock(&store.lock);
+        return count;
+    }
+
+    // Find the last chunk starting at or before pos.
+    size_t low = 0;
+    size_t high = store.nchunks - 1;
+    while (low < high) {
+        size_t middle = (low + high + 1) / 2;
+        if (store.chunks[middle].raw_offset <= pos) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+    size_t chunk_pos = pos - store.chunks[low].raw_offset;
+    pthread_mutex_unlock(&store.lock);
+
+    struct store_cached* cached = store_get(low);
+    if (!cached) {
+        return -1;
+    }
+    size_t count = cached->size - chunk_pos < bufsize ? cached->size - chunk_pos : bufsize;
+    memcpy(buffer, cached->data + chunk_pos, count);
+    store_put(cached);
+    return count;
+}
@@ -0,0 +1,281 @@
+#define _GNU_SOURCE // POLLRDHUP
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <syslog.h>
+#include <time.h>
+#include "../../aesd-char-driver/aesd-newline.h"
+
+//
+// Fan-out of committed lines to subscribed connections.
+//
+// A connection whose first packet is SUB_COMMAND becomes a subscriber: it gets
+// no replay of the file, instead every line appended from then on (by any
+// client or by the timer) is pushed to it. Each line is stored once, in a
+// refcounted buffer shared by the queues of all subscribers. Queues are
+// bounded: a subscriber that falls SUB_QUEUE_LEN lines behind is considered
+// a slow consumer and is disconnected, so that it cannot hold memory or stall
+// writers. It can subscribe again and request a replay to resynchronize.
+//
+#define SUB_QUEUE_LEN 1024 // Lines queued per subscriber.
+#define SUB_BATCH 64 // Lines sent per system call.
+#define SUB_SCAN_BATCH 64 // Newlines found per scan of published buffers.
+#define SUB_POLL_MS 100 // Interval for checking exit flag and hangup while idle.
+
+const char* SUB_COMMAND = "AESDSOCKET_SUBSCRIBE\n";
+//
+// Global variables.
+extern bool sig_exit;
+
+//
+// Line shared by all subscriber queues, freed by whoever drops the last ref.
+//
+struct sub_line {
+    unsigned int refcount;
+    size_t size;
+    char data[];
+};
+
+//
+// Subscriber with its bounded queue (a ring of line pointers).
+//
+struct subscriber {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct sub_line* queue[SUB_QUEUE_LEN];
+    size_t first;
+    size_t count;
+    bool overflow;
+    LIST_ENTRY(subscriber) entries;
+};
+LIST_HEAD(sub_head, subscriber);
+//
+// ...list of subscribers, read locked by publishers and write locked when
+// subscribers come and go.
+static struct sub_head sub_list = LIST_HEAD_INITIALIZER(sub_list);
+static pthread_rwlock_t sub_list_lock = PTHREAD_RWLOCK_INITIALIZER;
+static unsigned int sub_count = 0;
+
+//
+// Drops a reference to a line, freeing it if it was the last one.
+//
+static void sub_line_put(struct sub_line* line) {
+    if (__atomic_sub_fetch(&line->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(line);
+    }
+}
+
+//
+// Pushes a line to the queue of a subscriber, applying the slow consumer
+// policy if the queue is full.
+//
+static void sub_push(struct subscriber* sub, struct sub_line* line) {
+    pthread_mutex_lock(&sub->lock);
+
+    if (!sub->overflow) {
+        if (sub->count == SUB_QUEUE_LEN) {
+            sub->overflow = true;
+        } else {
+            __atomic_add_fetch(&line->refcount, 1, __ATOMIC_RELAXED);
+            sub->queue[(sub->first + sub->count) % SUB_QUEUE_LEN] = line;
+            sub->count++;
+        }
+        pthread_cond_signal(&sub->cond);
+    }
+
+    pthread_mutex_unlock(&sub->lock);
+}
+
+//
+// Pushes a copy of one line to all the subscribers. Must be called with the
+// subscribers list locked.
+// On success, returns 0. On failure, returns -1.
+//
+static int sub_publish_line(const char* data, size_t size) {
+    struct sub_line* line = malloc(sizeof(*line) + size);
+    if (!line) {
+        syslog(LOG_ERR, "malloc: %s", strerror(errno));
+        return -1;
+    }
+    line->refcount = 1; // Held by us while pushing.
+    line->size = size;
+    memcpy(line->data, data, size);
+
+    struct subscriber* sub;
+    LIST_FOREACH(sub, &sub_list, entries) {
+        sub_push(sub, line);
+    }
+    sub_line_put(line);
+    return 0;
+}
+
+//
+// Broadcasts a buffer of one or more newline terminated lines to all the
+// subscribers, one queue entry per line. The caller serializes publishers
+// (it holds the file write mutex), so subscribers see lines in file order.
+//
+void sub_publish(const char* buffer, size_t bufsize) {
+    if (__atomic_load_n(&sub_count, __ATOMIC_RELAXED) == 0) {
+        return; // Fast path, nobody is listening.
+    }
+
+    pthread_rwlock_rdlock(&sub_list_lock);
+
+    // Split the buffer with one scan, in batches of newlines.
+    size_t offsets[SUB_SCAN_BATCH];
+    size_t line_start = 0;
+    size_t found;
+    do {
+        found = aesd_newline_scan(buffer + line_start, bufsize - line_start,
+                                  offsets, SUB_SCAN_BATCH);
+        size_t scan_start = line_start;
+        for (size_t i = 0; i < found; ++i) {
+            size_t line_end = scan_start + offsets[i] + 1;
+            if (sub_publish_line(buffer + line_start, line_end - line_start) < 0) {
+                goto unlock;
+            }
+            line_start = line_end;
+        }
+    } while (found == SUB_SCAN_BATCH);
+
+    // A last line without newline, if any.
+    if (line_start < bufsize) {
+        sub_publish_line(buffer + line_start, bufsize - line_start);
+    }
+
+  unlock:
+    pthread_rwlock_unlock(&sub_list_lock);
+}
+
+//
+// Sends a batch of lines with a single system call where possible, handling
+// partial sends. On success, returns 0. On failure, returns -1.
+//
+static int sub_send(int sock_fd, struct sub_line** lines, size_t nlines) {
+    struct iovec iov[SUB_BATCH];
+    for (size_t i = 0; i < nlines; ++i) {
+        iov[i].iov_base = lines[i]->data;
+        iov[i].iov_len = lines[i]->size;
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = nlines;
+
+    while (msg.msg_iovlen > 0) {
+        ssize_t bytes_sent = sendmsg(sock_fd, &msg, MSG_NOSIGNAL);
+        if (bytes_sent < 0) {
+            if (errno == EINTR && !sig_exit) {
+                continue;
+            }
+            return -1;
+        }
+
+        // Skip fully sent buffers, then advance into the partially sent one.
+        while (msg.msg_iovlen > 0 && (size_t) bytes_sent >= msg.msg_iov->iov_len) {
+            bytes_sent -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char*) msg.msg_iov->iov_base + bytes_sent;
+            msg.msg_iov->iov_len -= bytes_sent;
+        }
+    }
+
+    return 0;
+}
+
+//
+// Returns true if the peer has closed the connection.
+//
+static bool sub_hangup(int sock_fd) {
+    struct pollfd pfd = { .fd = sock_fd, .events = POLLRDHUP };
+    return poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR));
+}
+
+//
+// Serves a subscribed connection: registers it, then pushes queued lines to
+// the socket until the client disconnects, falls too far behind, or the
+// program exits. Disconnections are a normal way of ending a subscription.
+// On success, returns 0. On failure, returns -1.
+//
+int sub_serve(int sock_fd, const char* host) {
+    struct subscriber* sub = calloc(1, sizeof(*sub));
+    if (!sub) {
+        syslog(LOG_ERR, "calloc: %s", strerror(errno));
+        return -1;
+    }
+    pthread_mutex_init(&sub->lock, NULL);
+    pthread_cond_init(&sub->cond, NULL);
+
+    pthread_rwlock_wrlock(&sub_list_lock);
+    LIST_INSERT_HEAD(&sub_list, sub, entries);
+    __atomic_add_fetch(&sub_count, 1, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&sub_list_lock);
+    syslog(LOG_INFO, "%s subscribed", host);
+
+    struct sub_line* batch[SUB_BATCH];
+    bool done = false;
+
+    while (!done && !sig_exit) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += SUB_POLL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        pthread_mutex_lock(&sub->lock);
+        if (sub->count == 0 && !sub->overflow) {
+            pthread_cond_timedwait(&sub->cond, &sub->lock, &deadline);
+        }
+
+        size_t nlines = 0;
+        while (nlines < SUB_BATCH && sub->count > 0) {
+            batch[nlines++] = sub->queue[sub->first];
+            sub->first = (sub->first + 1) % SUB_QUEUE_LEN;
+            sub->count--;
+        }
+        bool overflow = sub->overflow && sub->count == 0;
+        pthread_mutex_unlock(&sub->lock);
+
+        if (nlines > 0) {
+            done = sub_send(sock_fd, batch, nlines) < 0;
+            for (size_t i = 0; i < nlines; ++i) {
+                sub_line_put(batch[i]);
+            }
+        } else if (overflow) {
+            syslog(LOG_WARNING, "%s is too slow, dropping subscription", host);
+            done = true;
+        } else {
+            done = sub_hangup(sock_fd);
+        }
+    }
+
+    pthread_rwlock_wrlock(&sub_list_lock);
+    LIST_REMOVE(sub, entries);
+    __atomic_sub_fetch(&sub_count, 1, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&sub_list_lock);
+    syslog(LOG_INFO, "%s unsubscribed", host);
+
+    // Nobody can push anymore, release lines still queued.
+    while (sub->count > 0) {
+        sub_line_put(sub->queue[sub->first]);
+        sub->first = (sub->first + 1) % SUB_QUEUE_LEN;
+        sub->count--;
+    }
+    pthread_cond_destroy(&sub->cond);
+    pthread_mutex_destroy(&sub->lock);
+    free(sub);
+
+    return 0;
+}
@@ -0,0 +1,443 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <syslog.h>
+#include <unistd.h>
+
+//
+// Work-stealing task scheduler (option -w).
+//
+// A fixed set of worker threads runs tasks, i.e. a function and its argument,
+// instead of one thread blocking on each connection. Every worker owns a
+// deque: it pushes and pops its own tasks at the bottom, most recent first,
+// and an idle worker steals the oldest task at the top of the deque of a
+// random victim. A long task splits itself into steps and requeues its next
+// step at the top of the deque with task_defer, behind the tasks already
+// queued, where idle workers take it first. Short requests therefore never
+// wait behind a whole multi-megabyte replay, and replays spread over all the
+// workers instead of keeping a single one busy.
+//
+// Tasks never block on sockets: a task that would block registers its socket
+// with task_wait, and the poller thread submits it again once it is ready.
+//
+// With steering (-a steer), the workers are spread over the NUMA nodes and
+// pinned to the CPUs of their node. A task is given the node of the incoming
+// traffic of its socket, it is queued on a worker of that node whenever the
+// poller submits it, and idle workers steal from workers of their own node
+// before trying the others.
+//
+#define TASK_DEQUE_SIZE 64 // Initial capacity of the deques.
+#define TASK_POLL_EVENTS 64 // Ready sockets handled per poll.
+#define TASK_POLL_MS 100 // Interval for checking the stop flag.
+
+bool task_enabled = false;
+
+//
+// Declarations of objects with external linkage defined in other source files.
+//
+// ...affinity.c
+int aff_attr_init(pthread_attr_t*, const char*, int);
+int aff_attr_init_node(pthread_attr_t*, const char*, int);
+int aff_steer_nodes(const char*, int*, int);
+
+struct task {
+    void (*run)(void*);
+    void* arg;
+    int node; // Node of the workers to queue it on, -1 for any.
+    bool polled; // Wether the socket is registered with the poller.
+};
+
+//
+// Deque of a worker, a ring buffer growing as needed.
+//
+struct task_deque {
+    pthread_mutex_t lock;
+    struct task** ring;
+    size_t capacity;
+    size_t first;
+    size_t count;
+};
+
+struct task_worker {
+    pthread_t thread;
+    struct task_deque deque;
+    int node; // -1 without steering.
+    uint64_t rng_state; // For the choice of victims.
+    unsigned long ran;
+    unsigned long stolen;
+};
+
+//
+// Scheduler state. Workers with an empty deque and nothing to steal sleep on
+// the condition until the count of pending tasks is not zero.
+//
+static struct {
+    struct task_worker* workers;
+    int nworkers;
+    int epoll_fd;
+    pthread_t poller;
+    unsigned long pending;
+    unsigned int next_victim;
+    bool stop;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+} task_pool = {
+    .epoll_fd = -1,
+    .idle_lock = PTHREAD_MUTEX_INITIALIZER,
+    .idle_cond = PTHREAD_COND_INITIALIZER,
+};
+
+static __thread struct task_worker* task_self = NULL; // NULL outside workers.
+
+//
+// Returns a new task running run(arg), preferably on a worker of the given
+// node (-1 for any), or NULL on failure.
+//
+struct task* task_new(void (*run)(void*), void* arg, int node) {
+    struct task* task = malloc(sizeof(*task));
+    if (!task) {
+        syslog(LOG_ERR, "malloc: %s", strerror(errno));
+        return NULL;
+    }
+    task->run = run;
+    task->arg = arg;
+    task->node = node;
+    task->polled = false;
+    return task;
+}
+
+//
+// Frees a task that is neither queued nor waiting for its socket.
+//
+void task_free(struct task* task) {
+    free(task);
+}
+
+//
+// Pushes a task to the bottom (owner end) or to the top (thief end) of a
+// deque. On success, returns 0. On failure, returns -1.
+//
+static int task_push(struct task_deque* deque, struct task* task, bool top) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == deque->capacity) {
+        size_t capacity = 2 * deque->capacity;
+        struct task** ring = malloc(capacity * sizeof(*ring));
+        if (!ring) {
+            pthread_mutex_unlock(&deque->lock);
+            syslog(LOG_ERR, "malloc: %s", strerror(errno));
+            return -1;
+        }
+        for (size_t i = 0; i < deque->count; ++i) {
+            ring[i] = deque->ring[(deque->first + i) % deque->capacity];
+        }
+        free(deque->ring);
+        deque->ring = ring;
+        deque->capacity = capacity;
+        deque->first = 0;
+    }
+
+    if (top) {
+        deque->first = (deque->first + deque->capacity - 1) % deque->capacity;
+        deque->ring[deque->first] = task;
+    } else {
+        deque->ring[(deque->first + deque->count) % deque->capacity] = task;
+    }
+    deque->count++;
+    pthread_mutex_unlock(&deque->lock);
+    return 0;
+}
+
+//
+// Pops the task at the bottom (owner end) or at the top (thief end) of a
+// deque. Returns NULL if it is empty.
+//
+static struct task* task_pop(struct task_deque* deque, bool top) {
+    struct task* task = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count > 0) {
+        deque->count--;
+        if (top) {
+            task = deque->ring[deque->first];
+            deque->first = (deque->first + 1) % deque->capacity;
+        } else {
+            task = deque->ring[(deque->first + deque->count) % deque->capacity];
+        }
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return task;
+}
+
+//
+// Returns the next worker in turn among those of the given node, or among all
+// of them if the node is -1 or has no worker.
+//
+static struct task_worker* task_next_worker(int node) {
+    unsigned int next = __atomic_fetch_add(&task_pool.next_victim, 1, __ATOMIC_RELAXED);
+
+    for (int i = 0; node >= 0 && i < task_pool.nworkers; ++i) {
+        struct task_worker* worker = &task_pool.workers[(next + i) % task_pool.nworkers];
+        if (worker->node == node) {
+            return worker;
+        }
+    }
+    return &task_pool.workers[next % task_pool.nworkers];
+}
+
+//
+// Queues a task in the deque of the calling worker, or of the next worker in
+// turn on the node of the task when called from another thread, and wakes up
+// an idle worker.
+// On success, returns 0. On failure, returns -1.
+//
+static int task_queue(struct task* task, bool top) {
+    struct task_worker* worker = task_self;
+    if (!worker) {
+        worker = task_next_worker(task->node);
+    }
+    if (task_push(&worker->deque, task, top) < 0) {
+        return -1;
+    }
+
+    // Count the task before taking the lock that idle workers check the count
+    // under, so that the wakeup cannot be lost.
+    __atomic_add_fetch(&task_pool.pending, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&task_pool.idle_lock);
+    pthread_cond_signal(&task_pool.idle_cond);
+    pthread_mutex_unlock(&task_pool.idle_lock);
+    return 0;
+}
+
+//
+// Queues a task to run as soon as possible.
+// On success, returns 0. On failure, returns -1.
+//
+int task_submit(struct task* task) {
+    return task_queue(task, false);
+}
+
+//
+// Queues the next step of the running task behind the tasks already queued,
+// where it is the first to be stolen.
+// On success, returns 0. On failure, returns -1.
+//
+int task_defer(struct task* task) {
+    return task_queue(task, true);
+}
+
+//
+// Submits the task again once the socket is ready for events (EPOLLIN or
+// EPOLLOUT). The caller must not touch the task after this call succeeds.
+// On success, returns 0. On failure, returns -1.
+//
+int task_wait(struct task* task, int sock_fd, uint32_t events) {
+    struct epoll_event event = { .events = events | EPOLLONESHOT, .data.ptr = task };
+    int op = task->polled ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+    task->polled = true;
+    if (epoll_ctl(task_pool.epoll_fd, op, sock_fd, &event) < 0) {
+        syslog(LOG_ERR, "epoll_ctl: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static struct task* task_steal(struct task_worker* self) {
+    // xorshift64, victims are tried from a random one in turn.
+    self->rng_state ^= self->rng_state << 13;
+    self->rng_state ^= self->rng_state >> 7;
+    self->rng_state ^= self->rng_state << 17;
+    int first = self->rng_state % task_pool.nworkers;
+
+    // Victims on the node of the thief first, then the others.
+    for (int pass = 0; pass < 2; ++pass) {
+        for (int i = 0; i < task_pool.nworkers; ++i) {
+            struct task_worker* victim = &task_pool.workers[(first + i) % task_pool.nworkers];
+            if (victim == self || (victim->node == self->node) != (pass == 0)) {
+                continue;
+            }
+            struct task* task = task_pop(&victim->deque, true);
+            if (task) {
+                self->stolen++;
+                return task;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void* task_worker_handler(void* handler_arg) {
+    struct task_worker* self = (struct task_worker*) handler_arg;
+    task_self = self;
+
+    while (true) {
+        struct task* task = task_pop(&self->deque, false);
+        if (!task) {
+            task = task_steal(self);
+        }
+        if (task) {
+            __atomic_sub_fetch(&task_pool.pending, 1, __ATOMIC_SEQ_CST);
+            self->ran++;
+            task->run(task->arg);
+            continue;
+        }
+
+        pthread_mutex_lock(&task_pool.idle_lock);
+        while (!task_pool.stop && __atomic_load_n(&task_pool.pending, __ATOMIC_SEQ_CST) == 0) {
+            pthread_cond_wait(&task_pool.idle_cond, &task_pool.idle_lock);
+        }
+        bool stop = task_pool.stop;
+        pthread_mutex_unlock(&task_pool.idle_lock);
+        if (stop) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static void* task_poll_handler(void* handler_arg) {
+    struct epoll_event events[TASK_POLL_EVENTS];
+
+    while (!__atomic_load_n(&task_pool.stop, __ATOMIC_RELAXED)) {
+        int count = epoll_wait(task_pool.epoll_fd, events, TASK_POLL_EVENTS, TASK_POLL_MS);
+        if (count < 0 && errno != EINTR) {
+            syslog(LOG_ERR, "epoll_wait: %s", strerror(errno));
+            break;
+        }
+        for (int i = 0; i < count; ++i) {
+            struct task* task = (struct task*) events[i].data.ptr;
+            if (task_submit(task) < 0) {
+                // Run it here rather than leaving its connection stuck.
+                task->run(task->arg);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+//
+// Stops the workers and the poller, after the task each of them is running.
+// Tasks left queued or waiting are not run, their owners free them.
+//
+void task_stop(void) {
+    if (!task_pool.workers) {
+        return;
+    }
+
+    pthread_mutex_lock(&task_pool.idle_lock);
+    __atomic_store_n(&task_pool.stop, true, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&task_pool.idle_cond);
+    pthread_mutex_unlock(&task_pool.idle_lock);
+
+    if (task_pool.epoll_fd >= 0) {
+        pthread_join(task_pool.poller, NULL);
+    }
+    for (int i = 0; i < task_pool.nworkers; ++i) {
+        struct task_worker* worker = &task_pool.workers[i];
+        if (worker->deque.ring) {
+            pthread_join(worker->thread, NULL);
+            syslog(LOG_INFO, "task worker %d: %lu tasks run, %lu stolen",
+                   i, worker->ran, worker->stolen);
+        }
+        free(worker->deque.ring);
+    }
+    free(task_pool.workers);
+    task_pool.workers = NULL;
+    if (task_pool.epoll_fd >= 0) {
+        close(task_pool.epoll_fd);
+        task_pool.epoll_fd = -1;
+    }
+    task_enabled = false;
+}
+
+//
+// Starts nworkers workers, pinned like connection threads (-a conn) and spread
+// over the nodes with steering, and the poller, pinned like accept threads
+// (-a accept).
+// On success, returns 0. On failure, stops what was started and returns -1.
+//
+int task_start(int nworkers) {
+    pthread_attr_t attr;
+    int error;
+
+    int* nodes = malloc(nworkers * sizeof(*nodes));
+    if (!nodes) {
+        syslog(LOG_ERR, "malloc: %s", strerror(errno));
+        return -1;
+    }
+    task_pool.workers = calloc(nworkers, sizeof(*task_pool.workers));
+    if (!task_pool.workers) {
+        syslog(LOG_ERR, "calloc: %s", strerror(errno));
+        free(nodes);
+        return -1;
+    }
+    task_pool.nworkers = nworkers;
+
+    // Nodes are assigned before any worker runs, they are read by thieves.
+    int nnodes = aff_steer_nodes("conn", nodes, nworkers);
+    for (int i = 0; i < nworkers; ++i) {
+        task_pool.workers[i].node = nnodes > 0 ? nodes[i % nnodes] : -1;
+    }
+    free(nodes);
+
+    for (int i = 0; i < nworkers; ++i) {
+        struct task_worker* worker = &task_pool.workers[i];
+        worker->rng_state = 0x9e3779b97f4a7c15ULL * (i + 1);
+        pthread_mutex_init(&worker->deque.lock, NULL);
+        worker->deque.capacity = TASK_DEQUE_SIZE;
+        worker->deque.ring = malloc(TASK_DEQUE_SIZE * sizeof(*worker->deque.ring));
+        if (!worker->deque.ring) {
+            syslog(LOG_ERR, "malloc: %s", strerror(errno));
+            goto cleanup;
+        }
+
+        if (aff_attr_init_node(&attr, "conn", worker->node) < 0) {
+            goto cleanup_ring;
+        }
+        error = pthread_create(&worker->thread, &attr, task_worker_handler, worker);
+        pthread_attr_destroy(&attr);
+        if (error != 0) {
+            syslog(LOG_ERR, "pthread_create: %s", strerror(error));
+            goto cleanup_ring;
+        }
+        continue;
+
+      cleanup_ring:
+        free(worker->deque.ring);
+        worker->deque.ring = NULL;
+        goto cleanup;
+    }
+
+    task_pool.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (task_pool.epoll_fd < 0) {
+        syslog(LOG_ERR, "epoll_create1: %s", strerror(errno));
+        goto cleanup;
+    }
+    if (aff_attr_init(&attr, "accept", -1) < 0) {
+        goto cleanup_epoll;
+    }
+    error = pthread_create(&task_pool.poller, &attr, task_poll_handler, NULL);
+    pthread_attr_destroy(&attr);
+    if (error != 0) {
+        syslog(LOG_ERR, "pthread_create: %s", strerror(error));
+        goto cleanup_epoll;
+    }
+
+    task_enabled = true;
+    syslog(LOG_INFO, "Running connections as tasks on %d workers", nworkers);
+    return 0;
+
+  cleanup_epoll:
+    close(task_pool.epoll_fd);
+    task_pool.epoll_fd = -1;
+
+  cleanup:
+    task_stop();
+    return -1;
+}
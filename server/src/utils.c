@@ -1,5 +1,6 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,7 +11,65 @@
 // Prints program usage.
 //
 void usage(void) {
-    printf("aesdsocket: Usage: aesdsocket [-d]\n");
+    printf("aesdsocket: Usage: aesdsocket [-d] [-z] [-w workers] [-a role=cpus|steer]... [-u path]... [-m path]... [[-p profile] [-o option=value]... [-l address]...]...\n"
+           "  -d             run as daemon\n"
+           "  -z             store the data file in LZ4 compressed chunks\n"
+           "  -w workers     run packet connections as tasks on a work-stealing pool of\n"
+           "                 workers (pinned as conn), replays sent in 64 KiB steps\n"
+           "  -a role=cpus   pin accept, conn or timer threads to a CPU list (0-3,8)\n"
+           "                 or a NUMA node (node1) (repeatable)\n"
+           "  -a steer       run each connection on the NUMA node of its incoming traffic\n"
+           "  -l address     listen on the given numeric IPv4/IPv6 address (repeatable),\n"
+           "                 with the profile given so far; default: all addresses\n"
+           "  -u path        also listen on a Unix domain socket (repeatable); a\n"
+           "                 leading '@' selects the abstract namespace\n"
+           "  -m path        accept shared-memory ring clients on a Unix domain socket\n"
+           "                 (repeatable, '@' as for -u)\n"
+           "  -p profile     socket options profile: balanced (default), latency,\n"
+           "                 throughput, system\n"
+           "  -o opt=value   override a profile option: nodelay, cork, sndbuf, rcvbuf,\n"
+           "                 busy_poll, defer_accept, fastopen (-1 = system default)\n");
+}
+
+//
+// Makes a relative path absolute, resolving its directory against the current
+// working directory, so that it still names the same file after daemonize. The
+// file itself need not exist yet.
+// On success, returns the path, to be freed by the caller. On failure, returns
+// NULL.
+//
+char* path_absolute(const char* path) {
+    const char* slash = strrchr(path, '/');
+    const char* base = slash ? slash + 1 : path;
+
+    char dir[PATH_MAX];
+    if (slash && slash - path >= PATH_MAX) {
+        syslog(LOG_ERR, "path too long: %s", path);
+        return NULL;
+    }
+    if (slash) {
+        snprintf(dir, sizeof(dir), "%.*s", (int) (slash - path), path);
+    } else {
+        strcpy(dir, ".");
+    }
+
+    char resolved[PATH_MAX];
+    if (!realpath(dir, resolved)) {
+        syslog(LOG_ERR, "realpath: %s: %s", dir, strerror(errno));
+        return NULL;
+    }
+    if (strcmp(resolved, "/") == 0) {
+        resolved[0] = '\0'; // Avoid a double slash.
+    }
+
+    char* absolute = malloc(strlen(resolved) + strlen(base) + 2);
+    if (!absolute) {
+        syslog(LOG_ERR, "malloc: %s", strerror(errno));
+        return NULL;
+    }
+    sprintf(absolute, "%s/%s", resolved, base);
+
+    return absolute;
 }
 
 //